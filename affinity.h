@@ -0,0 +1,128 @@
+#pragma once
+// CPU pinning and NUMA topology for processor threads.
+//
+// A thread pinned to the CPUs of one node gets its memory from that node as
+// long as it touches it first, which is the default policy of linux, so no
+// memory is bound explicitly: whatever a processor allocates and initializes
+// on its own thread, its queues, its stacks and its routines, stays local.
+// Elsewhere threads are never pinned and everything is on node 0.
+#include <cstdio>
+#include <vector>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace coro {
+
+// CPUs the calling thread may run on, ascending
+inline std::vector<int> AllowedCpus() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+        }
+    }
+#endif
+    return cpus;
+}
+
+/*!
+ * \brief Restrict the calling thread to cpus, false if it can not be.
+ */
+inline bool PinThread(const std::vector<int> &cpus) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    }
+    return CPU_COUNT(&set) != 0 &&
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+namespace detail {
+
+#ifdef __linux__
+// "0-3,8,10-11" as found in sysfs
+inline void ParseCpuList(const char *list, int node, std::vector<int> &nodes) {
+    while (*list != '\0' && *list != '\n') {
+        int first = 0;
+        int last = 0;
+        int used = 0;
+        if (sscanf(list, "%d-%d%n", &first, &last, &used) != 2) {
+            if (sscanf(list, "%d%n", &first, &used) != 1)
+                return;
+            last = first;
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            if (cpu >= int(nodes.size()))
+                nodes.resize(cpu + 1, 0);
+            nodes[cpu] = node;
+        }
+        list += used;
+        if (*list == ',')
+            list++;
+    }
+}
+#endif
+
+// node by cpu, read once
+inline const std::vector<int> &NodeMap() {
+    static const std::vector<int> nodes = [] {
+        std::vector<int> nodes;
+#ifdef __linux__
+        DIR *dir = opendir("/sys/devices/system/node");
+        if (dir == nullptr)
+            return nodes;
+        while (struct dirent *entry = readdir(dir)) {
+            int node = 0;
+            if (sscanf(entry->d_name, "node%d", &node) != 1)
+                continue;
+            char path[64];
+            snprintf(path, sizeof(path),
+                    "/sys/devices/system/node/node%d/cpulist", node);
+            FILE *file = fopen(path, "r");
+            if (file == nullptr)
+                continue;
+            char list[4096];
+            if (fgets(list, sizeof(list), file) != nullptr)
+                ParseCpuList(list, node, nodes);
+            fclose(file);
+        }
+        closedir(dir);
+#endif
+        return nodes;
+    }();
+    return nodes;
+}
+
+}  // namespace detail
+
+// NUMA node of cpu, 0 if unknown
+inline int NodeOfCpu(int cpu) {
+    const std::vector<int> &nodes = detail::NodeMap();
+    return cpu >= 0 && cpu < int(nodes.size()) ? nodes[cpu] : 0;
+}
+
+// node the calling thread runs on right now
+inline int CurrentNode() {
+#ifdef __linux__
+    return NodeOfCpu(sched_getcpu());
+#else
+    return 0;
+#endif
+}
+
+}  // namespace coro
@@ -0,0 +1,79 @@
+// coro::Await against the former implementation, a std::async thread per
+// call that the waiting routine polls by yielding. One processor runs the
+// workers, every task awaits one call.
+//   latency:    one worker, back to back calls returning immediately
+//   throughput: many workers, calls sleeping for 100us
+// CPU time of the whole process is reported too, polling burns it.
+//   usage: await [workers] [calls]
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <future>
+#include <thread>
+#include <sys/resource.h>
+#include "processor_pool.h"
+
+typedef std::chrono::steady_clock Clock;
+
+template<typename Function>
+inline typename std::result_of<Function()>::type
+LegacyAwait(Function &&func) {
+    auto future = std::async(std::launch::async, func);
+    std::future_status status = future.wait_for(std::chrono::milliseconds(0));
+
+    while (status == std::future_status::timeout) {
+        if (coro::Current() != 0)
+            coro::Yield();
+
+        status = future.wait_for(std::chrono::milliseconds(0));
+    }
+    return future.get();
+}
+
+static double CpuMs() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3 +
+        usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3;
+}
+
+template<typename AwaitCall>
+static void Run(const char *mode, uint64_t workers, size_t calls,
+        AwaitCall await_call) {
+    std::atomic<size_t> done(0);
+    auto start = Clock::now();
+    double cpu = CpuMs();
+    {
+        coro::ProcessorPool pool(1, workers);
+        for (size_t i = 0; i < calls; i++) {
+            pool.AddTask([&done, &await_call] {
+                await_call();
+                done++;
+            });
+        }
+        while (done.load() < calls)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    double wall = std::chrono::duration<double, std::micro>(
+            Clock::now() - start).count();
+    std::cout << mode << "\t" << workers << " workers\t"
+        << wall / calls << " us/call\t"
+        << calls / wall * 1e6 << " calls/s\tcpu "
+        << CpuMs() - cpu << " ms\n";
+}
+
+int main(int argc, char **argv) {
+    uint64_t workers = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+    size_t calls = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 20000;
+    auto immediate = [] { return 1; };
+    auto sleeping = [] {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+        return 1;
+    };
+    Run("latency    Await", 1, calls, [&] { coro::Await(immediate); });
+    Run("latency    std::async", 1, calls, [&] { LegacyAwait(immediate); });
+    Run("throughput Await", workers, calls, [&] { coro::Await(sleeping); });
+    Run("throughput std::async", workers, calls,
+            [&] { LegacyAwait(sleeping); });
+    return 0;
+}
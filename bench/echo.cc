@@ -0,0 +1,134 @@
+// Echo server over loopback, server and clients are coroutines on two
+// pools using coro::Accept/Read/Write/Connect. Every client sends 64 byte
+// messages and waits for each echo. Reports round trips per second and the
+// latency of a round trip.
+//   usage: echo [connections] [round trips per connection] [cores per pool]
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "processor_pool.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static const size_t kMessage = 64;
+
+static bool WriteAll(int fd, const char *buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = coro::Write(fd, buf, size);
+        if (n <= 0)
+            return false;
+        buf += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+static bool ReadAll(int fd, char *buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = coro::Read(fd, buf, size);
+        if (n <= 0)
+            return false;
+        buf += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+static void Echo(int fd) {
+    char buf[4096];
+    while (true) {
+        ssize_t n = coro::Read(fd, buf, sizeof(buf));
+        if (n <= 0 || !WriteAll(fd, buf, size_t(n)))
+            break;
+    }
+    coro::Close(fd);
+}
+
+int main(int argc, char **argv) {
+    size_t connections = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+    size_t round_trips = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 2000;
+    uint64_t cores = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 1;
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    if (bind(listener, reinterpret_cast<sockaddr *>(&addr), len) != 0 ||
+            listen(listener, 1024) != 0 ||
+            getsockname(listener, reinterpret_cast<sockaddr *>(&addr),
+                &len) != 0) {
+        perror("listen");
+        return 1;
+    }
+
+    std::mutex latency_lock;
+    std::vector<double> latency;
+    latency.reserve(connections * round_trips);
+    std::atomic<size_t> done(0);
+    auto start = Clock::now();
+    {
+        coro::ProcessorPool server(cores, connections + 1);
+        coro::ProcessorPool clients(cores, connections);
+        server.AddTask([&] {
+            for (size_t i = 0; i < connections; i++) {
+                int fd = coro::Accept(listener);
+                if (fd < 0)
+                    break;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                server.AddTask([fd] { Echo(fd); });
+            }
+            coro::Close(listener);
+        });
+        for (size_t c = 0; c < connections; c++) {
+            clients.AddTask([&] {
+                std::vector<double> local;
+                local.reserve(round_trips);
+                int fd = socket(AF_INET, SOCK_STREAM, 0);
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                if (coro::Connect(fd, reinterpret_cast<sockaddr *>(&addr),
+                            sizeof(addr)) == 0) {
+                    char out[kMessage], in[kMessage];
+                    memset(out, 'x', sizeof(out));
+                    for (size_t i = 0; i < round_trips; i++) {
+                        auto sent = Clock::now();
+                        if (!WriteAll(fd, out, sizeof(out)) ||
+                                !ReadAll(fd, in, sizeof(in)))
+                            break;
+                        local.push_back(std::chrono::duration<double,
+                                std::micro>(Clock::now() - sent).count());
+                    }
+                }
+                coro::Close(fd);
+                std::lock_guard<std::mutex> lk(latency_lock);
+                latency.insert(latency.end(), local.begin(), local.end());
+                done++;
+            });
+        }
+        while (done.load() < connections)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start)
+        .count();
+    if (latency.empty()) {
+        std::cout << "no round trips completed\n";
+        return 1;
+    }
+    std::sort(latency.begin(), latency.end());
+    std::cout << connections << " connections\t"
+        << latency.size() / seconds << " round trips/s"
+        << "\tp50 " << latency[latency.size() / 2] << " us"
+        << "\tp99 " << latency[latency.size() * 99 / 100] << " us\n";
+    return 0;
+}
@@ -0,0 +1,89 @@
+// Getting results back from tasks: AddTask fulfilling a std::promise against
+// Submit, both waited on by a coroutine of the same pool, and a long chain of
+// Then continuations.
+//   usage: future [tasks] [cores], at least two cores as std::future blocks
+//   the thread of its processor
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "processor_pool.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static void Report(const char *mode, size_t tasks, Clock::time_point start) {
+    double seconds = std::chrono::duration<double>(Clock::now() - start)
+        .count();
+    std::cout << mode << "\t" << tasks / seconds << " results/s\t"
+        << seconds * 1e9 / tasks << " ns\n";
+}
+
+// a coroutine submits a window of tasks, then collects their results
+static const size_t kWindow = 256;
+
+static void Promise(coro::ProcessorPool &pool, size_t tasks) {
+    std::promise<void> done;
+    auto start = Clock::now();
+    pool.AddTask([&] {
+        uint64_t sum = 0;
+        std::vector<std::future<uint64_t>> futures;
+        for (size_t t = 0; t < tasks; t += kWindow) {
+            for (size_t i = t; i < std::min(t + kWindow, tasks); i++) {
+                auto promise = std::make_shared<std::promise<uint64_t>>();
+                futures.push_back(promise->get_future());
+                pool.AddTask([promise, i] { promise->set_value(i); });
+            }
+            // blocks the processor's thread, not just the coroutine
+            for (auto &future : futures)
+                sum += future.get();
+            futures.clear();
+        }
+        done.set_value();
+    });
+    done.get_future().wait();
+    Report("std::promise", tasks, start);
+}
+
+static void Submit(coro::ProcessorPool &pool, size_t tasks) {
+    std::promise<void> done;
+    auto start = Clock::now();
+    pool.AddTask([&] {
+        uint64_t sum = 0;
+        std::vector<coro::Future<uint64_t>> futures;
+        for (size_t t = 0; t < tasks; t += kWindow) {
+            for (size_t i = t; i < std::min(t + kWindow, tasks); i++)
+                futures.push_back(pool.Submit([i]() -> uint64_t {
+                    return i; }));
+            for (auto &future : futures)
+                sum += future.Get();
+            futures.clear();
+        }
+        done.set_value();
+    });
+    done.get_future().wait();
+    Report("Submit      ", tasks, start);
+}
+
+static void Chain(coro::ProcessorPool &pool, size_t tasks) {
+    auto start = Clock::now();
+    auto future = pool.Submit([]() -> uint64_t { return 0; });
+    for (size_t i = 1; i < tasks; i++)
+        future = future.Then([](uint64_t n) { return n + 1; });
+    future.Get();
+    Report("Then chain  ", tasks, start);
+}
+
+int main(int argc, char **argv) {
+    size_t tasks = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000;
+    uint64_t cores = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 2;
+    // the default single worker per core, Get hands it over while waiting
+    coro::PoolOptions options;
+    options.num_cores = std::max<uint64_t>(cores, 2);
+    coro::ProcessorPool pool(options);
+    Promise(pool, tasks);
+    Submit(pool, tasks);
+    Chain(pool, tasks);
+    return 0;
+}
@@ -0,0 +1,62 @@
+// 10k coroutines taking turns on one lock, each yielding between its
+// critical sections so that they interleave on every processor:
+// std::mutex, whose contended waits block the processor's thread, against
+// coro::Mutex, which suspends only the waiting coroutine. The last run holds
+// coro::Mutex across a Yield, something std::mutex can not do at all.
+//   usage: mutex [coroutines] [locks each] [cores]
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include "processor_pool.h"
+#include "sync.h"
+
+typedef std::chrono::steady_clock Clock;
+
+template <typename Lock>
+static void Run(const char *mode, uint64_t coroutines, size_t locks,
+        uint64_t cores, bool yield_inside) {
+    Lock lock;
+    uint64_t counter = 0;
+    coro::WaitGroup done(coroutines);
+    auto start = Clock::now();
+    {
+        coro::ProcessorPool pool(cores, coroutines / cores + 1);
+        for (uint64_t i = 0; i < coroutines; i++) {
+            pool.AddTask([&] {
+                for (size_t j = 0; j < locks; j++) {
+                    {
+                        std::lock_guard<Lock> lk(lock);
+                        uint64_t value = counter;
+                        if (yield_inside)
+                            coro::Yield();
+                        counter = value + 1;
+                    }
+                    coro::Yield();
+                }
+                done.Done();
+            });
+        }
+        done.Wait();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start)
+        .count();
+    if (counter != coroutines * locks)
+        std::cout << "lost updates! ";
+    std::cout << mode << "\t" << counter / seconds << " locks/s\t"
+        << seconds * 1e9 / counter << " ns\n";
+}
+
+int main(int argc, char **argv) {
+    uint64_t coroutines = argc > 1 ? std::strtoul(argv[1], nullptr, 10) :
+        10000;
+    size_t locks = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 100;
+    uint64_t cores = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 4;
+    Run<std::mutex>("std::mutex             ", coroutines, locks, cores,
+            false);
+    Run<coro::Mutex>("coro::Mutex            ", coroutines, locks, cores,
+            false);
+    Run<coro::Mutex>("coro::Mutex over Yield ", coroutines, locks, cores,
+            true);
+    return 0;
+}
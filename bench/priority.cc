@@ -0,0 +1,80 @@
+// Latency of probe tasks on a pool saturated with background tasks, each
+// running slices of busy work with a yield in between and queued faster
+// than they complete. Reports how long probes wait from AddTask until they
+// start when high priority over low background, with a deadline, as urgent
+// as the background, and high with strict priorities.
+//   usage: priority [probes] [cores]
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include "processor_pool.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static const size_t kSlices = 50;
+static const auto kSlice = std::chrono::microseconds(20);
+static const auto kInterval = std::chrono::microseconds(500);
+
+enum Probe { kSame, kHigh, kDeadline };
+
+static void Run(const char *mode, coro::PoolOptions options, Probe probe,
+        size_t probes) {
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> done(0);
+    std::vector<double> waits(probes);
+    {
+        coro::ProcessorPool pool(options);
+        auto background = [&stop] {
+            for (size_t i = 0; i < kSlices && !stop.load(); i++) {
+                auto until = Clock::now() + kSlice;
+                while (Clock::now() < until) {}
+                coro::Yield();
+            }
+        };
+        for (size_t p = 0; p < probes; p++) {
+            for (int i = 0; i < 2; i++) {
+                if (probe == kSame)
+                    pool.AddTask(background);
+                else
+                    pool.AddTask(background, coro::Priority::kLow);
+            }
+            auto added = Clock::now();
+            auto task = [&waits, &done, p, added] {
+                waits[p] = std::chrono::duration<double, std::micro>(
+                        Clock::now() - added).count();
+                done++;
+            };
+            if (probe == kSame)
+                pool.AddTask(task);
+            else if (probe == kHigh)
+                pool.AddTask(task, coro::Priority::kHigh);
+            else
+                pool.AddTask(task, added + kInterval);
+            std::this_thread::sleep_for(kInterval);
+        }
+        while (done.load() < probes)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        stop = true;
+    }
+    std::sort(waits.begin(), waits.end());
+    std::cout << mode << "\tp50 " << waits[probes / 2] << " us\tp99 "
+        << waits[probes * 99 / 100] << " us\n";
+}
+
+int main(int argc, char **argv) {
+    size_t probes = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000;
+    uint64_t cores = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1;
+
+    coro::PoolOptions options;
+    options.num_cores = cores;
+    options.num_workers_per_core = 16;
+    Run("high over low", options, kHigh, probes);
+    Run("deadline", options, kDeadline, probes);
+    // its backlog only grows, last so that its tail does not linger
+    Run("same priority", options, kSame, probes);
+    options.starvation_limit = 0;
+    Run("high, strict", options, kHigh, probes);
+    return 0;
+}
@@ -0,0 +1,65 @@
+// Producer contention on the task queues: 1 to 64 producers push into one
+// queue drained by a single consumer with TryPopBulk.
+//   usage: queue [items] [batch]    (batch > 1 pushes with PushBulk)
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "readwrite_queue.h"
+#include "mpmc_queue.h"
+#include "mpsc_queue.h"
+
+template<typename Queue>
+static double Run(size_t producers, size_t items, size_t batch) {
+    Queue queue;
+    const size_t per_producer = items / producers;
+    const size_t total = per_producer * producers;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t p = 0; p < producers; p++) {
+        threads.emplace_back([&queue, per_producer, batch] {
+            std::vector<uint64_t> values;
+            for (size_t i = 0; i < per_producer; i++) {
+                if (batch <= 1) {
+                    queue.Push(i);
+                    continue;
+                }
+                values.push_back(i);
+                if (values.size() == batch || i + 1 == per_producer) {
+                    queue.PushBulk(values.begin(), values.end());
+                    values.clear();
+                }
+            }
+        });
+    }
+    std::vector<uint64_t> popped(64);
+    size_t received = 0;
+    while (received < total) {
+        size_t n = queue.TryPopBulk(popped.begin(), popped.size());
+        if (n == 0)
+            std::this_thread::yield();
+        received += n;
+    }
+    for (auto& thread : threads)
+        thread.join();
+    double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+    return total / seconds / 1e6;
+}
+
+int main(int argc, char **argv) {
+    size_t items = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1 << 22;
+    size_t batch = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1;
+    std::cout << "producers\tReadWriteQueue\tBoundedQueue\tMpscQueue"
+        << "\t(million items/s, batch " << batch << ")\n";
+    for (size_t producers = 1; producers <= 64; producers *= 2) {
+        std::cout << producers
+            << "\t\t" << Run<ReadWriteQueue<uint64_t>>(producers, items, batch)
+            << "\t\t" << Run<BoundedQueue<uint64_t>>(producers, items, batch)
+            << "\t\t" << Run<MpscQueue<uint64_t>>(producers, items, batch)
+            << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+// Two coroutines bouncing a value between two channels while many others
+// sit blocked in Channel::Pop on the same processor. The round trip rate
+// should not depend on how many are parked, only runnable ones are resumed.
+//   usage: ready [round trips] [parked coroutines...]
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include "processor_pool.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static void Run(size_t round_trips, uint64_t parked) {
+    coro::Channel<int> idle;
+    coro::Channel<int> ping(coro::Capacity(1));
+    coro::Channel<int> pong(coro::Capacity(1));
+    std::atomic<uint64_t> waiting(0);
+    std::atomic<bool> done(false);
+    double seconds = 0;
+    {
+        coro::ProcessorPool pool(1, parked + 2);
+        for (uint64_t i = 0; i < parked; i++) {
+            pool.AddTask([&] {
+                int value;
+                waiting++;
+                idle.Pop(value);
+            });
+        }
+        while (waiting.load() < parked)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        pool.AddTask([&] {
+            int value;
+            while (ping.Pop(value))
+                pong.Push(value + 1);
+        });
+        pool.AddTask([&] {
+            auto start = Clock::now();
+            int value = 0;
+            for (size_t i = 0; i < round_trips; i++) {
+                ping.Push(value);
+                pong.Pop(value);
+            }
+            seconds = std::chrono::duration<double>(Clock::now() - start)
+                .count();
+            ping.Close();
+            idle.Close();
+            done = true;
+        });
+        while (!done.load())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::cout << parked << " parked\t" << round_trips / seconds
+        << " round trips/s\t" << seconds * 1e9 / round_trips << " ns\n";
+}
+
+int main(int argc, char **argv) {
+    size_t round_trips = argc > 1 ? std::strtoul(argv[1], nullptr, 10) :
+        100000;
+    std::vector<uint64_t> parked;
+    for (int i = 2; i < argc; i++)
+        parked.push_back(std::strtoul(argv[i], nullptr, 10));
+    if (parked.empty())
+        parked = {0, 100, 1000, 10000};
+    for (uint64_t n : parked)
+        Run(round_trips, n);
+    return 0;
+}
@@ -0,0 +1,89 @@
+// Compares private and shared stacks at growing numbers of suspended
+// coroutines: resident memory once all of them yielded, and the cost of a
+// Resume/Yield round trip cycling through them.
+//   usage: shared_stack [count...]    (default 10000 100000 1000000)
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include "coroutine.h"
+
+static const int kRounds = 4;
+// private stacks are kept small, otherwise a million of them would not
+// even fit into the address space
+static const size_t kPrivateStack = 64 * 1024;
+
+static size_t ResidentKiB() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * (coro::PageSize() / 1024);
+}
+
+static void Work() {
+    // give every routine a few live frames worth of stack
+    volatile char frame[256];
+    for (int i = 0; i < kRounds; i++) {
+        frame[i] = char(i);
+        coro::Yield();
+        // it came back with the stack, shared or not
+        if (frame[i] != char(i))
+            std::abort();
+    }
+}
+
+static void Run(const char *mode, size_t count, bool shared) {
+    coro::SetSharedStack(shared ? STACK_LIMIT : 0);
+    std::vector<coro::routine_t> routines;
+    routines.reserve(count);
+    const size_t before = ResidentKiB();
+    try {
+        for (size_t i = 0; i < count; i++) {
+            routines.push_back(coro::Create(Work, shared ? 0 : kPrivateStack));
+            coro::Resume(routines.back());
+        }
+    }
+    catch (const std::bad_alloc &) {
+        std::cout << mode << "\t" << count << "\tout of memory after "
+            << routines.size() << " coroutines\n";
+        for (auto id : routines)
+            coro::Destroy(id);
+        return;
+    }
+    const size_t resident = ResidentKiB() - before;
+
+    auto start = std::chrono::steady_clock::now();
+    size_t switches = 0;
+    for (int round = 1; round < kRounds; round++) {
+        for (auto id : routines) {
+            coro::Resume(id);
+            switches++;
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    for (auto id : routines) {
+        while (coro::Resume(id) == 0) {
+        }
+        coro::Destroy(id);
+    }
+
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    std::cout << mode << "\t" << count << "\t" << resident << " KiB, "
+        << double(resident) * 1024 / count << " bytes per coroutine, "
+        << ns / switches << " ns per Resume/Yield pair\n";
+}
+
+int main(int argc, char **argv) {
+    std::vector<size_t> counts;
+    for (int i = 1; i < argc; i++)
+        counts.push_back(std::strtoul(argv[i], nullptr, 10));
+    if (counts.empty())
+        counts = {10000, 100000, 1000000};
+
+    for (auto count : counts) {
+        Run("private", count, false);
+        Run("shared", count, true);
+    }
+    return 0;
+}
@@ -0,0 +1,88 @@
+// Cost of coro::MaybeYield in a hot loop reading the clock, and reading the
+// flag of a preemption timer, then how long short tasks wait behind routines
+// spinning in such loops on a pool, by time slice. Normal tasks are started
+// between rounds of the processor, up to 64 slices apart, high ones after
+// the slice running when they are added.
+//   usage: slice [calls] [probes]
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include "processor_pool.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static void Calls(const char *mode, bool timer, size_t calls) {
+    if (timer)
+        coro::EnablePreemption(std::chrono::microseconds(1000));
+    size_t yields = 0;
+    double seconds = 0;
+    auto routine = coro::Create([&] {
+        auto start = Clock::now();
+        for (size_t i = 0; i < calls; i++) {
+            if (coro::MaybeYield())
+                yields++;
+        }
+        seconds = std::chrono::duration<double>(Clock::now() - start)
+            .count();
+    });
+    while (coro::Resume(routine) == 0) {
+    }
+    coro::Destroy(routine);
+    coro::DisablePreemption();
+    std::cout << mode << "\t" << seconds * 1e9 / calls << " ns per call\t"
+        << yields << " yields\n";
+}
+
+static void Probes(std::chrono::microseconds slice, bool preemption,
+        coro::Priority priority, size_t probes) {
+    coro::PoolOptions options;
+    options.num_cores = 1;
+    options.num_workers_per_core = 8;
+    options.time_slice = slice;
+    options.preemption = preemption;
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> done(0);
+    std::vector<double> waits(probes);
+    {
+        coro::ProcessorPool pool(options);
+        for (int i = 0; i < 4; i++) {
+            pool.AddTask([&stop] {
+                while (!stop.load())
+                    coro::MaybeYield();
+            });
+        }
+        for (size_t p = 0; p < probes; p++) {
+            auto added = Clock::now();
+            pool.AddTask([&waits, &done, p, added] {
+                waits[p] = std::chrono::duration<double, std::micro>(
+                        Clock::now() - added).count();
+                done++;
+            }, priority);
+            while (done.load() <= p)
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        stop = true;
+    }
+    std::sort(waits.begin(), waits.end());
+    std::cout << (priority == coro::Priority::kHigh ? "high, " : "normal, ")
+        << slice.count() << " us slice" << (preemption ? ", timer" : "")
+        << "\tp50 " << waits[probes / 2] << " us\tp99 "
+        << waits[probes * 99 / 100] << " us\n";
+}
+
+int main(int argc, char **argv) {
+    size_t calls = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000000;
+    size_t probes = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 30;
+
+    Calls("clock", false, calls);
+    Calls("timer", true, calls);
+    for (auto priority : {coro::Priority::kNormal, coro::Priority::kHigh}) {
+        for (auto us : {100, 1000}) {
+            Probes(std::chrono::microseconds(us), false, priority, probes);
+            Probes(std::chrono::microseconds(us), true, priority, probes);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,59 @@
+// I/O bound tasks, each making a few calls that wait 1ms like a request to
+// another service, on resident workers against a routine spawned per task.
+// Resident workers cap how many calls are in flight, queued tasks wait for
+// a worker even though the processor is idle. Reports two waves of tasks on
+// the same pool.
+//   usage: spawn [tasks] [calls per task] [cores]
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include "processor_pool.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static void Wave(coro::ProcessorPool &pool, size_t tasks, size_t calls,
+        std::ostream &out) {
+    std::atomic<size_t> done(0);
+    auto start = Clock::now();
+    for (size_t t = 0; t < tasks; t++) {
+        pool.AddTask([calls, &done] {
+            for (size_t i = 0; i < calls; i++)
+                coro::SleepFor(std::chrono::milliseconds(1));
+            done++;
+        });
+    }
+    while (done.load() < tasks)
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    double seconds = std::chrono::duration<double>(Clock::now() - start)
+        .count();
+    out << "\t" << tasks / seconds << " tasks/s " << seconds * 1e3 << " ms";
+}
+
+// the first wave pays for starting routines, the second one finds them
+// idle, or in spawn mode their stacks cached
+static void Run(const char *mode, coro::PoolOptions options, size_t tasks,
+        size_t calls) {
+    coro::ProcessorPool pool(options);
+    std::cout << mode;
+    Wave(pool, tasks, calls, std::cout);
+    Wave(pool, tasks, calls, std::cout);
+    std::cout << "\n";
+}
+
+int main(int argc, char **argv) {
+    size_t tasks = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20000;
+    size_t calls = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 3;
+    uint64_t cores = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 1;
+
+    coro::PoolOptions options;
+    options.num_cores = cores;
+    for (uint64_t workers : {16, 256, 4096}) {
+        options.num_workers_per_core = workers;
+        std::string mode = std::to_string(workers) + " workers";
+        Run(mode.c_str(), options, tasks, calls);
+    }
+    options.num_workers_per_core = 16;
+    options.spawn_per_task = true;
+    Run("spawn per task", options, tasks, calls);
+    return 0;
+}
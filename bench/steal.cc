@@ -0,0 +1,58 @@
+// Skewed task durations with and without work stealing: most tasks take
+// 20us, one in fifty takes 5ms. Reports makespan and latency percentiles
+// from AddTask to task completion.
+//   usage: steal [cores] [tasks]
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include "processor_pool.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static void Spin(std::chrono::microseconds duration) {
+    auto until = Clock::now() + duration;
+    while (Clock::now() < until) {
+    }
+}
+
+static void Run(const char *mode, uint64_t cores, size_t count, bool steal) {
+    std::vector<Clock::time_point> queued(count);
+    std::vector<double> latency(count);
+    std::atomic<size_t> done(0);
+    auto start = Clock::now();
+    {
+        coro::PoolOptions options;
+        options.num_cores = cores;
+        options.num_workers_per_core = 1;
+        options.work_stealing = steal;
+        coro::ProcessorPool pool(options);
+        for (size_t i = 0; i < count; i++) {
+            queued[i] = Clock::now();
+            pool.AddTask([i, &queued, &latency, &done] {
+                Spin(std::chrono::microseconds(i % 50 == 0 ? 5000 : 20));
+                latency[i] = std::chrono::duration<double, std::micro>(
+                        Clock::now() - queued[i]).count();
+                done++;
+            });
+        }
+        while (done.load() < count)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double makespan = std::chrono::duration<double, std::milli>(
+            Clock::now() - start).count();
+    std::sort(latency.begin(), latency.end());
+    std::cout << mode << "\tmakespan " << makespan << " ms"
+        << "\tp50 " << latency[count / 2] << " us"
+        << "\tp99 " << latency[count * 99 / 100] << " us"
+        << "\tmax " << latency.back() << " us\n";
+}
+
+int main(int argc, char **argv) {
+    uint64_t cores = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4;
+    size_t count = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 5000;
+    Run("round-robin", cores, count, false);
+    Run("stealing", cores, count, true);
+    return 0;
+}
@@ -0,0 +1,54 @@
+// Submitting bursts of small tasks from outside the pool, one AddTask per
+// task against one AddTasks per burst. Reports how long submitting took
+// and how long until every task ran.
+//   usage: submit [tasks] [burst] [cores]
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include "processor_pool.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static void Run(const char *mode, bool bulk, size_t tasks, size_t burst,
+        uint64_t cores) {
+    std::atomic<size_t> done(0);
+    double submit = 0;
+    auto start = Clock::now();
+    {
+        coro::ProcessorPool pool(cores, 1);
+        std::vector<coro::Task> batch;
+        batch.reserve(burst);
+        for (size_t t = 0; t < tasks; t += burst) {
+            size_t n = std::min(burst, tasks - t);
+            for (size_t i = 0; i < n; i++)
+                batch.push_back([&done] { done++; });
+            auto submit_start = Clock::now();
+            if (bulk) {
+                pool.AddTasks(std::move(batch));
+            }
+            else {
+                for (auto& task : batch)
+                    pool.AddTask(std::move(task));
+            }
+            submit += std::chrono::duration<double>(Clock::now() -
+                    submit_start).count();
+            batch.clear();
+        }
+        while (done.load() < tasks)
+            std::this_thread::yield();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start)
+        .count();
+    std::cout << mode << "\tsubmit " << submit * 1e9 / tasks << " ns/task"
+        << "\tall done " << tasks / seconds << " tasks/s\n";
+}
+
+int main(int argc, char **argv) {
+    size_t tasks = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+    size_t burst = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4096;
+    uint64_t cores = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 4;
+    Run("AddTask ", false, tasks, burst, cores);
+    Run("AddTasks", true, tasks, burst, cores);
+    return 0;
+}
@@ -0,0 +1,32 @@
+// Measures the cost of a Resume/Yield round trip, build it with
+// -DCORO_USE_UCONTEXT to compare against the swapcontext fallback.
+#include <chrono>
+#include <iostream>
+#include "coroutine.h"
+
+static const int kRounds = 10000000;
+
+int main(int argc, char **argv) {
+    const int rounds = argc > 1 ? std::atoi(argv[1]) : kRounds;
+    auto routine = coro::Create([rounds] {
+        for (int i = 0; i < rounds; i++)
+            coro::Yield();
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    while (coro::Resume(routine) == 0) {
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    coro::Destroy(routine);
+
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+#ifdef CORO_USE_UCONTEXT
+    const char *backend = "ucontext";
+#else
+    const char *backend = "assembly";
+#endif
+    std::cout << backend << ": " << rounds << " round trips, "
+        << ns / rounds << " ns per Resume/Yield pair, "
+        << ns / rounds / 2 << " ns per switch\n";
+    return 0;
+}
@@ -0,0 +1,84 @@
+// Heap allocations and throughput per task for captures of a few sizes,
+// added from outside the pool and spawned from inside a task. Counts every
+// operator new while tasks flow, after a first round grew the queues.
+//   usage: task [tasks] [cores]
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include "processor_pool.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static std::atomic<uint64_t> allocations(0);
+
+// new and delete stay out of line, inlined g++ pairs the malloc and free in
+// them with the new and delete of their callers and warns of a mismatch
+__attribute__((noinline)) void *operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = std::malloc(size == 0 ? 1 : size);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, std::size_t)
+        noexcept {
+    std::free(p);
+}
+
+template <size_t Bytes>
+struct Payload {
+    char data[Bytes];
+};
+
+template <size_t Bytes>
+static void Run(coro::ProcessorPool &pool, bool inside, size_t tasks) {
+    std::atomic<size_t> done(0);
+    Payload<Bytes> payload = {};
+    // a task spawning yields now and then, letting workers run its tasks
+    auto add = [&pool, &done, payload, tasks, inside] {
+        for (size_t i = 0; i < tasks; i++) {
+            pool.AddTask([&done, payload] { done += payload.data[0] + 1; });
+            if (inside && i % 16 == 15)
+                coro::Yield();
+        }
+    };
+    // one untimed round lets the queues and caches grow
+    for (int round = 0; round < 2; round++) {
+        done = 0;
+        uint64_t before = allocations.load();
+        auto start = Clock::now();
+        if (inside)
+            pool.AddTask(add);
+        else
+            add();
+        while (done.load() < tasks)
+            std::this_thread::yield();
+        double seconds = std::chrono::duration<double>(Clock::now() - start)
+            .count();
+        if (round == 0)
+            continue;
+        double per_task = double(allocations.load() - before) / tasks;
+        std::cout << (inside ? "spawned " : "added   ") << Bytes + 8
+            << " byte capture\t" << per_task << " allocations/task\t"
+            << tasks / seconds << " tasks/s\n";
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t tasks = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000;
+    uint64_t cores = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 2;
+    coro::ProcessorPool pool(cores, 4);
+    for (bool inside : {false, true}) {
+        Run<8>(pool, inside, tasks);
+        Run<24>(pool, inside, tasks);
+        Run<48>(pool, inside, tasks);
+    }
+    return 0;
+}
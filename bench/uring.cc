@@ -0,0 +1,102 @@
+// Random 4K reads from a file, coro::ReadAt on io_uring against pread
+// offloaded with coro::Await. One processor runs all workers, every task
+// does its share of the reads. The file is opened with O_DIRECT where the
+// filesystem allows it, otherwise reads mostly hit the page cache and
+// measure the overhead of the two paths.
+//   usage: uring [workers] [reads] [file size in MiB] [path]
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include "processor_pool.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static const size_t kBlock = 4096;
+
+template<typename ReadCall>
+static void Run(const char *mode, uint64_t workers, size_t reads,
+        size_t blocks, ReadCall read_call) {
+    std::atomic<size_t> done(0);
+    std::atomic<size_t> failed(0);
+    auto start = Clock::now();
+    {
+        coro::ProcessorPool pool(1, workers);
+        for (uint64_t w = 0; w < workers; w++) {
+            size_t share = reads / workers + (w < reads % workers ? 1 : 0);
+            pool.AddTask([w, share, blocks, &read_call, &done, &failed] {
+                void *buf = nullptr;
+                if (posix_memalign(&buf, kBlock, kBlock) != 0)
+                    return;
+                uint64_t seed = w * 2654435761U + 1;
+                for (size_t i = 0; i < share; i++) {
+                    seed ^= seed << 13;
+                    seed ^= seed >> 7;
+                    seed ^= seed << 17;
+                    off_t offset = off_t(seed % blocks * kBlock);
+                    if (read_call(buf, offset) != ssize_t(kBlock))
+                        failed++;
+                }
+                free(buf);
+                done++;
+            });
+        }
+        while (done.load() < workers)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start)
+        .count();
+    std::cout << mode << "\t" << workers << " workers\t"
+        << reads / seconds << " reads/s\t"
+        << seconds * 1e6 * workers / reads << " us/read";
+    if (failed.load() != 0)
+        std::cout << "\t" << failed.load() << " failed";
+    std::cout << "\n";
+}
+
+int main(int argc, char **argv) {
+    uint64_t workers = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+    size_t reads = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 100000;
+    size_t mib = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 64;
+    std::string path = argc > 4 ? argv[4] : "uring_bench.dat";
+    size_t blocks = mib * 1024 * 1024 / kBlock;
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    char block[kBlock];
+    memset(block, 'x', sizeof(block));
+    for (size_t i = 0; i < blocks; i++) {
+        if (write(fd, block, sizeof(block)) != ssize_t(sizeof(block))) {
+            perror("write");
+            return 1;
+        }
+    }
+    fsync(fd);
+    close(fd);
+    fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+    bool direct = fd >= 0;
+    if (!direct)
+        fd = open(path.c_str(), O_RDONLY);
+    std::cout << (direct ? "O_DIRECT" : "buffered") << ", "
+        << (coro::Uring::Local().Available() ? "io_uring available" :
+                "no io_uring, ReadAt falls back to Await") << "\n";
+
+    Run("ReadAt", workers, reads, blocks, [fd](void *buf, off_t offset) {
+        return coro::ReadAt(fd, buf, kBlock, offset);
+    });
+    Run("Await(pread)", workers, reads, blocks,
+            [fd](void *buf, off_t offset) {
+        return coro::Await([fd, buf, offset] {
+            return pread(fd, buf, kBlock, offset);
+        });
+    });
+    close(fd);
+    unlink(path.c_str());
+    return 0;
+}
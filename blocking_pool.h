@@ -0,0 +1,83 @@
+#pragma once
+// Fixed set of threads for blocking calls offloaded by coro::Await.
+//
+// Blocking work must not run on a processor thread, it would stall every
+// coroutine living there, and a thread per call is far too expensive. The
+// threads are started lazily with the first task.
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "small_function.h"
+
+// number of threads of the default blocking pool, 0 picks four per core and
+// at least sixteen, blocked threads hardly use the cpu
+#ifndef AWAIT_THREADS
+#define AWAIT_THREADS 0
+#endif
+
+class BlockingPool {
+public:
+    typedef SmallFunction<void(), 48> Job;
+
+    explicit BlockingPool(size_t num_threads) : num_threads_(num_threads),
+            stop_(false) {}
+    ~BlockingPool() {
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            stop_ = true;
+        }
+        cond_.notify_all();
+        for (auto& thread : threads_)
+            thread.join();
+    }
+
+    void Submit(Job job) {
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            if (threads_.empty())
+                Start();
+            jobs_.push_back(std::move(job));
+        }
+        cond_.notify_one();
+    }
+
+    static BlockingPool& Default() {
+        static BlockingPool pool(AWAIT_THREADS != 0 ? AWAIT_THREADS :
+                std::max(16U, 4 * std::thread::hardware_concurrency()));
+        return pool;
+    }
+
+private:
+    void Start() {
+        for (size_t i = 0; i < num_threads_; i++)
+            threads_.emplace_back([this] { Work(); });
+    }
+
+    void Work() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lk(mutex_);
+                cond_.wait(lk, [this] { return stop_ || !jobs_.empty(); });
+                if (jobs_.empty())
+                    return;
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+            }
+            job();
+        }
+    }
+
+    size_t num_threads_;
+    bool stop_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<Job> jobs_;
+    std::vector<std::thread> threads_;
+    BlockingPool(const BlockingPool&) = delete;
+};
@@ -0,0 +1,779 @@
+#pragma once
+// Go style channel that routines on any thread, and plain threads, can share.
+//
+// Values sit in a ring buffer that is either unbounded, bounded, or, with a
+// capacity of 0, absent so that every Push waits for a Pop. Push and Pop
+// that can not go on queue a node and suspend the routine until the other
+// side hands the value over and wakes it up, through the waker's wakeup
+// inbox when it lives on another thread. Nodes are recycled per thread, and
+// values waiting in them never live on a routine's stack, so routines on
+// the shared stack can block here as well.
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "alignof.h"
+#include "spinlock.h"
+#include "coroutine.h"
+
+namespace coro {
+
+// capacity of a bounded channel, see Channel
+struct Capacity {
+    explicit Capacity(size_t n) : value(n) {}
+    size_t value;
+};
+
+namespace detail {
+
+// a routine or thread blocked in Push or Pop of one channel
+template<typename Type>
+struct ChannelNode {
+    ChannelNode *prev;
+    ChannelNode *next;
+    bool linked;
+    // shared by all nodes of one Select, own otherwise
+    Waiter *waiter;
+    // passed to TryClaim, tells Select which case fired
+    int source;
+    // value to push, or the one popped
+    AlignedCharArrayUnion<Type> slot;
+    bool has_value;
+    // false if the channel was closed instead
+    bool ok;
+    Waiter own;
+
+    ChannelNode() : prev(nullptr), next(nullptr), linked(false),
+            waiter(nullptr), source(0), has_value(false), ok(false) {}
+    ~ChannelNode() {
+        ClearValue();
+    }
+
+    inline Type &Value() {
+        return *reinterpret_cast<Type *>(&slot);
+    }
+
+    template<typename T>
+    inline void SetValue(T &&value) {
+        new (&slot) Type(std::forward<T>(value));
+        has_value = true;
+    }
+
+    inline void ClearValue() {
+        if (has_value) {
+            Value().~Type();
+            has_value = false;
+        }
+    }
+
+    // a cleared node from the calling thread's cache
+    static ChannelNode *Acquire() {
+        std::vector<ChannelNode *> &cache = Cache().nodes;
+        ChannelNode *node;
+        if (cache.empty()) {
+            node = new ChannelNode();
+        }
+        else {
+            node = cache.back();
+            cache.pop_back();
+        }
+        node->waiter = &node->own;
+        node->source = 0;
+        node->ok = false;
+        return node;
+    }
+
+    static void Release(ChannelNode *node) {
+        node->ClearValue();
+        std::vector<ChannelNode *> &cache = Cache().nodes;
+        if (cache.size() < kCacheLimit)
+            cache.push_back(node);
+        else
+            delete node;
+    }
+
+private:
+    static const size_t kCacheLimit = 64;
+
+    struct NodeCache {
+        std::vector<ChannelNode *> nodes;
+        ~NodeCache() {
+            for (ChannelNode *node : nodes)
+                delete node;
+        }
+    };
+
+    CORO_TLS_ACCESSOR static NodeCache &Cache() {
+        CORO_TLS_FENCE();
+        thread_local NodeCache cache;
+        return cache;
+    }
+};
+
+// FIFO of blocked nodes, O(1) removal for waits that gave up
+template<typename Node>
+class WaitQueue {
+public:
+    WaitQueue() : head_(nullptr), tail_(nullptr) {}
+
+    inline void PushBack(Node *node) {
+        node->prev = tail_;
+        node->next = nullptr;
+        if (tail_ != nullptr)
+            tail_->next = node;
+        else
+            head_ = node;
+        tail_ = node;
+        node->linked = true;
+    }
+
+    inline void PushFront(Node *node) {
+        node->prev = nullptr;
+        node->next = head_;
+        if (head_ != nullptr)
+            head_->prev = node;
+        else
+            tail_ = node;
+        head_ = node;
+        node->linked = true;
+    }
+
+    inline Node *PopFront() {
+        Node *node = head_;
+        if (node != nullptr)
+            Remove(node);
+        return node;
+    }
+
+    inline void Remove(Node *node) {
+        if (node->prev != nullptr)
+            node->prev->next = node->next;
+        else
+            head_ = node->next;
+        if (node->next != nullptr)
+            node->next->prev = node->prev;
+        else
+            tail_ = node->prev;
+        node->prev = node->next = nullptr;
+        node->linked = false;
+    }
+
+    // first node whose waiter this call could claim, unlinked
+    inline Node *Claim() {
+        while (Node *node = PopFront()) {
+            if (node->waiter->TryClaim(node->source))
+                return node;
+        }
+        return nullptr;
+    }
+
+    inline bool IsEmpty() const {
+        return head_ == nullptr;
+    }
+
+private:
+    Node *head_;
+    Node *tail_;
+};
+
+template<typename Type> class RecvCase;
+template<typename Type> class SendCase;
+
+}  // namespace detail
+
+template<typename Type>
+class Channel {
+public:
+    typedef detail::ChannelNode<Type> Node;
+
+    /*!
+     * \brief Unbounded channel, Push never blocks.
+     */
+    Channel() : limit_(SIZE_MAX), capacity_(0), head_(0), size_(0),
+            closed_(false) {}
+
+    /*!
+     * \brief Channel holding at most capacity values, Push blocks while it
+     * is full. With a capacity of 0 every Push waits for a Pop.
+     */
+    explicit Channel(Capacity capacity) : limit_(capacity.value),
+            capacity_(0), head_(0), size_(0), closed_(false) {}
+
+    // any routine may Pop now, a taker is no longer needed
+    explicit Channel(routine_t) : Channel() {}
+
+    ~Channel() {
+        Clear();
+    }
+
+    inline void Consumer(routine_t) {}
+
+    /*!
+     * \brief Hand obj to a waiting Pop or buffer it, blocking while the
+     * channel is full. False if the channel is closed.
+     */
+    inline bool Push(const Type &obj) {
+        return Send(obj, Clock::time_point::max());
+    }
+
+    inline bool Push(Type &&obj) {
+        return Send(std::move(obj), Clock::time_point::max());
+    }
+
+    // Push giving up after timeout, false if it timed out or the channel
+    // is closed
+    inline bool Push(const Type &obj, std::chrono::nanoseconds timeout) {
+        return Send(obj, Clock::now() + timeout);
+    }
+
+    // obj is gone either way
+    inline bool Push(Type &&obj, std::chrono::nanoseconds timeout) {
+        return Send(std::move(obj), Clock::now() + timeout);
+    }
+
+    /*!
+     * \brief Take the oldest value, blocking while there is none. False
+     * once the channel is closed and drained.
+     */
+    inline bool Pop(Type &obj) {
+        return Receive(obj, Clock::time_point::max());
+    }
+
+    // Pop giving up after timeout, false if it timed out or the channel is
+    // closed and drained
+    inline bool Pop(Type &obj, std::chrono::nanoseconds timeout) {
+        return Receive(obj, Clock::now() + timeout);
+    }
+
+    // Push that never blocks, false if the channel is full or closed
+    inline bool TryPush(Type &&obj) {
+        Node *notify = nullptr;
+        lock_.lock();
+        int result = SendLocked(std::move(obj), &notify);
+        lock_.unlock();
+        return Finish(result, notify);
+    }
+
+    // Pop that never blocks, false if the channel is empty
+    inline bool TryPop(Type &obj) {
+        Node *notify = nullptr;
+        lock_.lock();
+        int result = ReceiveLocked(obj, &notify);
+        lock_.unlock();
+        return Finish(result, notify);
+    }
+
+    /*!
+     * \brief Wake everybody waiting: Pop drains what is buffered and then
+     * fails, Push fails right away.
+     */
+    inline void Close() {
+        Node *woken = nullptr;
+        lock_.lock();
+        closed_ = true;
+        while (Node *node = receivers_.Claim()) {
+            node->ok = false;
+            node->next = woken;
+            woken = node;
+        }
+        while (Node *node = senders_.Claim()) {
+            node->ok = false;
+            node->next = woken;
+            woken = node;
+        }
+        lock_.unlock();
+        while (woken != nullptr) {
+            Node *next = woken->next;
+            woken->waiter->Notify();
+            woken = next;
+        }
+    }
+
+    inline bool IsClosed() {
+        std::lock_guard<::SpinLock> lk(lock_);
+        return closed_;
+    }
+
+    // drop buffered values
+    inline void Clear() {
+        std::lock_guard<::SpinLock> lk(lock_);
+        while (size_ > 0)
+            PopBuffer();
+    }
+
+    // nothing to do, Push wakes a waiting Pop itself
+    inline void Touch() {}
+
+    inline size_t Size() {
+        std::lock_guard<::SpinLock> lk(lock_);
+        return size_;
+    }
+
+    inline bool IsEmpty() {
+        return Size() == 0;
+    }
+
+private:
+    template<typename> friend class detail::RecvCase;
+    template<typename> friend class detail::SendCase;
+
+    typedef AlignedCharArrayUnion<Type> Slot;
+
+    static const int kDone = 0;
+    static const int kBlocked = 1;
+    static const int kClosed = 2;
+
+    // with lock_ held, notify gets a node to notify once it is released
+    template<typename T>
+    inline int SendLocked(T &&obj, Node **notify) {
+        if (closed_)
+            return kClosed;
+        if (Node *receiver = receivers_.Claim()) {
+            receiver->SetValue(std::forward<T>(obj));
+            receiver->ok = true;
+            *notify = receiver;
+            return kDone;
+        }
+        if (size_ < limit_) {
+            PushBuffer(std::forward<T>(obj));
+            return kDone;
+        }
+        return kBlocked;
+    }
+
+    inline int ReceiveLocked(Type &obj, Node **notify) {
+        if (size_ > 0) {
+            obj = std::move(Front());
+            PopBuffer();
+            // room for the oldest blocked sender now
+            if (Node *sender = senders_.Claim()) {
+                PushBuffer(std::move(sender->Value()));
+                sender->ClearValue();
+                sender->ok = true;
+                *notify = sender;
+            }
+            return kDone;
+        }
+        // unbuffered, or a sender got queued while all slots were taken
+        if (Node *sender = senders_.Claim()) {
+            obj = std::move(sender->Value());
+            sender->ClearValue();
+            sender->ok = true;
+            *notify = sender;
+            return kDone;
+        }
+        return closed_ ? kClosed : kBlocked;
+    }
+
+    static inline bool Finish(int result, Node *notify) {
+        if (notify != nullptr)
+            notify->waiter->Notify();
+        return result == kDone;
+    }
+
+    template<typename T>
+    inline bool Send(T &&obj, Clock::time_point deadline) {
+        Node *notify = nullptr;
+        lock_.lock();
+        int result = SendLocked(std::forward<T>(obj), &notify);
+        if (result != kBlocked) {
+            lock_.unlock();
+            return Finish(result, notify);
+        }
+        Node *node = Node::Acquire();
+        node->SetValue(std::forward<T>(obj));
+        node->waiter->Prepare();
+        senders_.PushBack(node);
+        lock_.unlock();
+        return Block(node, senders_, deadline);
+    }
+
+    inline bool Receive(Type &obj, Clock::time_point deadline) {
+        Node *notify = nullptr;
+        lock_.lock();
+        int result = ReceiveLocked(obj, &notify);
+        if (result != kBlocked) {
+            lock_.unlock();
+            return Finish(result, notify);
+        }
+        Node *node = Node::Acquire();
+        node->waiter->Prepare();
+        receivers_.PushBack(node);
+        lock_.unlock();
+        bool ok = Block(node, receivers_, deadline);
+        if (ok)
+            obj = std::move(node->Value());
+        Node::Release(node);
+        return ok;
+    }
+
+    // wait for node to be claimed, or take it back after deadline; senders'
+    // nodes are released here, receivers' once the value is taken
+    inline bool Block(Node *node, detail::WaitQueue<Node> &queue,
+            Clock::time_point deadline) {
+        bool ok = false;
+        if (node->waiter->Wait(deadline)) {
+            ok = node->ok;
+        }
+        else {
+            std::lock_guard<::SpinLock> lk(lock_);
+            if (node->linked)
+                queue.Remove(node);
+        }
+        if (&queue == &senders_)
+            Node::Release(node);
+        return ok;
+    }
+
+    inline Type &Front() {
+        return *reinterpret_cast<Type *>(&buffer_[head_]);
+    }
+
+    template<typename T>
+    inline void PushBuffer(T &&obj) {
+        if (size_ == capacity_)
+            Grow();
+        size_t tail = (head_ + size_) & (capacity_ - 1);
+        new (&buffer_[tail]) Type(std::forward<T>(obj));
+        size_++;
+    }
+
+    inline void PopBuffer() {
+        Front().~Type();
+        head_ = (head_ + 1) & (capacity_ - 1);
+        size_--;
+    }
+
+    // double the ring, a power of two so that indices wrap with a mask
+    inline void Grow() {
+        size_t capacity = capacity_ != 0 ? capacity_ * 2 : 16;
+        std::unique_ptr<Slot[]> buffer(new Slot[capacity]);
+        for (size_t i = 0; i < size_; i++) {
+            Type *from = reinterpret_cast<Type *>(
+                    &buffer_[(head_ + i) & (capacity_ - 1)]);
+            new (&buffer[i]) Type(std::move(*from));
+            from->~Type();
+        }
+        buffer_ = std::move(buffer);
+        capacity_ = capacity;
+        head_ = 0;
+    }
+
+    ::SpinLock lock_;
+    std::unique_ptr<Slot[]> buffer_;
+    // most values buffered, SIZE_MAX if unbounded
+    size_t limit_;
+    // slots of buffer_
+    size_t capacity_;
+    size_t head_;
+    size_t size_;
+    bool closed_;
+    detail::WaitQueue<Node> senders_;
+    detail::WaitQueue<Node> receivers_;
+    Channel(const Channel&) = delete;
+};
+
+namespace detail {
+
+// one case of a Select, type erased so that channels of any type mix; the
+// *Locked calls run with the channel's lock held
+class SelectCase {
+public:
+    SelectCase() : ok_(nullptr) {}
+    virtual ~SelectCase() {}
+
+    virtual ::SpinLock &Lock() = 0;
+    // complete the case right away if the channel allows it, notify gets
+    // the waiter of the other side to notify once unlocked
+    virtual bool TryLocked(Waiter **notify) = 0;
+    // queue a node for the case, sharing waiter, or its own one if waiter
+    // is still null, which is prepared and returned then
+    virtual Waiter *EnqueueLocked(Waiter *waiter, int source) = 0;
+    virtual void DequeueLocked() = 0;
+    // take the value over or back and release the node
+    virtual void Complete(bool fired) = 0;
+
+    inline void SetOk(bool ok) {
+        if (ok_ != nullptr)
+            *ok_ = ok;
+    }
+
+protected:
+    bool *ok_;
+};
+
+template<typename Type>
+class RecvCase : public SelectCase {
+public:
+    typedef ChannelNode<Type> Node;
+
+    RecvCase(Channel<Type> &channel, Type &obj, bool *ok) :
+            channel_(&channel), obj_(&obj), node_(nullptr) {
+        ok_ = ok;
+    }
+
+    virtual ::SpinLock &Lock() {
+        return channel_->lock_;
+    }
+
+    virtual bool TryLocked(Waiter **notify) {
+        Node *node = nullptr;
+        int result = channel_->ReceiveLocked(*obj_, &node);
+        if (result == Channel<Type>::kBlocked)
+            return false;
+        SetOk(result == Channel<Type>::kDone);
+        if (node != nullptr)
+            *notify = node->waiter;
+        return true;
+    }
+
+    virtual Waiter *EnqueueLocked(Waiter *waiter, int source) {
+        node_ = Node::Acquire();
+        if (waiter == nullptr) {
+            waiter = node_->waiter;
+            waiter->Prepare();
+        }
+        node_->waiter = waiter;
+        node_->source = source;
+        channel_->receivers_.PushBack(node_);
+        return waiter;
+    }
+
+    virtual void DequeueLocked() {
+        if (node_->linked)
+            channel_->receivers_.Remove(node_);
+    }
+
+    virtual void Complete(bool fired) {
+        if (fired) {
+            SetOk(node_->ok);
+            if (node_->ok)
+                *obj_ = std::move(node_->Value());
+        }
+        Node::Release(node_);
+        node_ = nullptr;
+    }
+
+private:
+    Channel<Type> *channel_;
+    Type *obj_;
+    Node *node_;
+};
+
+template<typename Type>
+class SendCase : public SelectCase {
+public:
+    typedef ChannelNode<Type> Node;
+
+    // obj is moved from only if the case fires
+    SendCase(Channel<Type> &channel, Type &obj, bool *ok) :
+            channel_(&channel), obj_(&obj), copy_(nullptr), node_(nullptr) {
+        ok_ = ok;
+    }
+
+    SendCase(Channel<Type> &channel, const Type &obj, bool *ok) :
+            channel_(&channel), obj_(nullptr), copy_(&obj), node_(nullptr) {
+        ok_ = ok;
+    }
+
+    virtual ::SpinLock &Lock() {
+        return channel_->lock_;
+    }
+
+    virtual bool TryLocked(Waiter **notify) {
+        Node *node = nullptr;
+        int result = obj_ != nullptr ?
+            channel_->SendLocked(std::move(*obj_), &node) :
+            channel_->SendLocked(*copy_, &node);
+        if (result == Channel<Type>::kBlocked)
+            return false;
+        SetOk(result == Channel<Type>::kDone);
+        if (node != nullptr)
+            *notify = node->waiter;
+        return true;
+    }
+
+    virtual Waiter *EnqueueLocked(Waiter *waiter, int source) {
+        node_ = Node::Acquire();
+        if (waiter == nullptr) {
+            waiter = node_->waiter;
+            waiter->Prepare();
+        }
+        node_->waiter = waiter;
+        node_->source = source;
+        if (obj_ != nullptr)
+            node_->SetValue(std::move(*obj_));
+        else
+            node_->SetValue(*copy_);
+        channel_->senders_.PushBack(node_);
+        return waiter;
+    }
+
+    virtual void DequeueLocked() {
+        if (node_->linked)
+            channel_->senders_.Remove(node_);
+    }
+
+    virtual void Complete(bool fired) {
+        if (fired)
+            SetOk(node_->ok);
+        // not sent, hand the value back
+        if (obj_ != nullptr && node_->has_value)
+            *obj_ = std::move(node_->Value());
+        Node::Release(node_);
+        node_ = nullptr;
+    }
+
+private:
+    Channel<Type> *channel_;
+    Type *obj_;
+    const Type *copy_;
+    Node *node_;
+};
+
+CORO_TLS_ACCESSOR inline uint32_t SelectSeed() {
+    CORO_TLS_FENCE();
+    thread_local uint32_t seed = 2463534242U;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+/*!
+ * \brief Complete the first of cases that can go on, or, if block, queue a
+ * node for every case and wait for the first to be completed by the other
+ * side or for deadline. The index of the case done, or -1.
+ */
+inline int DoSelect(SelectCase **cases, ::SpinLock **locks, size_t size,
+        bool block, Clock::time_point deadline) {
+    // every channel locked at once, in address order, so that no case can
+    // go on between looking at all of them and queueing for all of them
+    for (size_t i = 0; i < size; i++)
+        locks[i] = &cases[i]->Lock();
+    std::sort(locks, locks + size);
+    size_t locked = size_t(std::unique(locks, locks + size) - locks);
+    for (size_t i = 0; i < locked; i++)
+        locks[i]->lock();
+
+    // from a random case on, or the first ones would starve the others
+    size_t start = SelectSeed() % size;
+    int fired = -1;
+    Waiter *notify = nullptr;
+    for (size_t k = 0; k < size; k++) {
+        size_t i = (start + k) % size;
+        if (cases[i]->TryLocked(&notify)) {
+            fired = int(i);
+            break;
+        }
+    }
+    if (fired >= 0 || !block) {
+        for (size_t i = 0; i < locked; i++)
+            locks[i]->unlock();
+        if (notify != nullptr)
+            notify->Notify();
+        return fired;
+    }
+
+    Waiter *waiter = nullptr;
+    for (size_t i = 0; i < size; i++)
+        waiter = cases[i]->EnqueueLocked(waiter, int(i));
+    for (size_t i = 0; i < locked; i++)
+        locks[i]->unlock();
+
+    bool woken = waiter->Wait(deadline);
+    if (woken)
+        fired = waiter->Fired();
+    // nobody can claim the waiter anymore, but its nodes may still be
+    // queued at the channels that did not fire
+    for (size_t i = 0; i < locked; i++)
+        locks[i]->lock();
+    for (size_t i = 0; i < size; i++)
+        cases[i]->DequeueLocked();
+    for (size_t i = 0; i < locked; i++)
+        locks[i]->unlock();
+    // the waiter lives in the first case's node, release that one last
+    for (size_t i = size; i-- > 0; )
+        cases[i]->Complete(int(i) == fired);
+    return fired;
+}
+
+}  // namespace detail
+
+/*!
+ * \brief Case of a Select popping into obj, ok tells whether a value came
+ * or the channel was closed and drained.
+ */
+template<typename Type>
+inline detail::RecvCase<Type> Recv(Channel<Type> &channel, Type &obj) {
+    return detail::RecvCase<Type>(channel, obj, nullptr);
+}
+
+template<typename Type>
+inline detail::RecvCase<Type> Recv(Channel<Type> &channel, Type &obj,
+        bool &ok) {
+    return detail::RecvCase<Type>(channel, obj, &ok);
+}
+
+/*!
+ * \brief Case of a Select pushing obj, which is moved from only if the case
+ * fires. ok is false if the channel was closed.
+ */
+template<typename Type>
+inline detail::SendCase<Type> Send(Channel<Type> &channel, Type &obj) {
+    return detail::SendCase<Type>(channel, obj, nullptr);
+}
+
+template<typename Type>
+inline detail::SendCase<Type> Send(Channel<Type> &channel, Type &obj,
+        bool &ok) {
+    return detail::SendCase<Type>(channel, obj, &ok);
+}
+
+// copies obj, leaving it alone
+template<typename Type>
+inline detail::SendCase<Type> Send(Channel<Type> &channel, const Type &obj) {
+    return detail::SendCase<Type>(channel, obj, nullptr);
+}
+
+/*!
+ * \brief Block until one of the Recv and Send cases is done, parking the
+ * routine or thread once, and return its index. If several can go on, one
+ * of them is picked at random, only that one takes effect.
+ */
+template<typename... Cases>
+inline int Select(Cases &&... cases) {
+    static_assert(sizeof...(Cases) > 0, "Select needs a case");
+    detail::SelectCase *list[] = { &cases... };
+    ::SpinLock *locks[sizeof...(Cases)];
+    return detail::DoSelect(list, locks, sizeof...(Cases), true,
+            Clock::time_point::max());
+}
+
+// Select giving up after timeout, -1 then
+template<typename... Cases>
+inline int SelectFor(std::chrono::nanoseconds timeout, Cases &&... cases) {
+    static_assert(sizeof...(Cases) > 0, "SelectFor needs a case");
+    detail::SelectCase *list[] = { &cases... };
+    ::SpinLock *locks[sizeof...(Cases)];
+    return detail::DoSelect(list, locks, sizeof...(Cases), true,
+            Clock::now() + timeout);
+}
+
+// Select that never blocks, -1 if no case can go on right away
+template<typename... Cases>
+inline int TrySelect(Cases &&... cases) {
+    static_assert(sizeof...(Cases) > 0, "TrySelect needs a case");
+    detail::SelectCase *list[] = { &cases... };
+    ::SpinLock *locks[sizeof...(Cases)];
+    return detail::DoSelect(list, locks, sizeof...(Cases), false,
+            Clock::time_point::max());
+}
+
+}  // namespace coro
@@ -0,0 +1,201 @@
+#pragma once
+// Context switching primitives used by the unix implementation of coroutine.h.
+//
+// On x86-64 and AArch64 the switch is a few lines of assembly that only save
+// and restore the callee-saved registers on the stack being left, in the spirit
+// of boost.context's jump_fcontext. Other targets, or builds with
+// -DCORO_USE_UCONTEXT, fall back to ucontext. Keep in mind that swapcontext
+// saves and restores the signal mask as well, which costs a syscall per switch.
+
+#include <cstddef>
+#include <cstdint>
+
+#if !defined(CORO_USE_UCONTEXT) && !defined(__x86_64__) && !defined(__aarch64__)
+#define CORO_USE_UCONTEXT
+#endif
+
+#ifdef CORO_USE_UCONTEXT
+#if defined(__APPLE__) && defined(__MACH__)
+#define _XOPEN_SOURCE
+#include <ucontext.h>
+#else
+#include <ucontext.h>
+#endif
+#endif
+
+namespace coro {
+
+#ifdef CORO_USE_UCONTEXT
+
+struct Context {
+    ucontext_t uc;
+};
+
+// prepare ctx so that switching to it runs entry on [stack, stack + size),
+// entry must never return, it has to switch away for the last time instead
+inline void MakeContext(Context *ctx, char *stack, size_t size,
+        void (*entry)()) {
+    //initializes the structure to the currently active context.
+    getcontext(&ctx->uc);
+    ctx->uc.uc_stack.ss_sp = stack;
+    ctx->uc.uc_stack.ss_size = size;
+    ctx->uc.uc_link = nullptr;
+    makecontext(&ctx->uc, entry, 0);
+}
+
+// save the running context into from and activate to
+inline void SwapContext(Context *from, Context *to) {
+    swapcontext(&from->uc, &to->uc);
+}
+
+// lowest stack address in use by a suspended context, not tracked here
+inline void *StackPointer(const Context &ctx) {
+    (void)ctx;
+    return nullptr;
+}
+
+#else    // assembly
+
+struct Context {
+    // stack pointer of a suspended context, the callee-saved registers
+    // live right above it on that stack
+    void *sp;
+};
+
+extern "C" void coro_swap_context(void **from_sp, void *to_sp);
+extern "C" void coro_context_entry();
+
+// the switch is emitted as a weak symbol so that the header can be included
+// from several translation units
+#if defined(__APPLE__) && defined(__MACH__)
+#define CORO_ASM_BEGIN(name) \
+    ".text\n.globl _" #name "\n.weak_definition _" #name "\n" \
+    ".p2align 4\n_" #name ":\n"
+#define CORO_ASM_END(name) ""
+#else
+#define CORO_ASM_BEGIN(name) \
+    ".text\n.globl " #name "\n.weak " #name "\n" \
+    ".type " #name ",%function\n.p2align 4\n" #name ":\n"
+#define CORO_ASM_END(name) ".size " #name ",.-" #name "\n"
+#endif
+
+#if defined(__x86_64__)
+
+// frame left below the saved stack pointer:
+//   fpu control word, mxcsr, r15, r14, r13, r12, rbx, rbp, return address
+asm(CORO_ASM_BEGIN(coro_swap_context)
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $16, %rsp\n"
+    "    stmxcsr 8(%rsp)\n"
+    "    fnstcw (%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    fldcw (%rsp)\n"
+    "    ldmxcsr 8(%rsp)\n"
+    "    addq $16, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    CORO_ASM_END(coro_swap_context)
+    // first activation of a context made by MakeContext, entry is in rbx
+    CORO_ASM_BEGIN(coro_context_entry)
+    "    callq *%rbx\n"
+    "    ud2\n"
+    CORO_ASM_END(coro_context_entry));
+
+inline void MakeContext(Context *ctx, char *stack, size_t size,
+        void (*entry)()) {
+    // keep the stack pointer 16 byte aligned once the frame is popped,
+    // so that entry sees the usual alignment after the call
+    uintptr_t top = (reinterpret_cast<uintptr_t>(stack) + size) &
+        ~uintptr_t(15);
+    uint64_t *frame = reinterpret_cast<uint64_t *>(top - 16) - 9;
+    frame[0] = 0x037f;    // x87 control word, default after finit
+    frame[1] = 0x1f80;    // mxcsr, default
+    frame[2] = 0;         // r15
+    frame[3] = 0;         // r14
+    frame[4] = 0;         // r13
+    frame[5] = 0;         // r12
+    frame[6] = reinterpret_cast<uint64_t>(entry);    // rbx
+    frame[7] = 0;         // rbp
+    frame[8] = reinterpret_cast<uint64_t>(&coro_context_entry);
+    ctx->sp = frame;
+}
+
+#elif defined(__aarch64__)
+
+// frame left below the saved stack pointer:
+//   d8-d15, x19-x28, x29 (fp), x30 (lr), stored in pairs
+asm(CORO_ASM_BEGIN(coro_swap_context)
+    "    sub sp, sp, #0xb0\n"
+    "    stp d8, d9, [sp, #0x00]\n"
+    "    stp d10, d11, [sp, #0x10]\n"
+    "    stp d12, d13, [sp, #0x20]\n"
+    "    stp d14, d15, [sp, #0x30]\n"
+    "    stp x19, x20, [sp, #0x40]\n"
+    "    stp x21, x22, [sp, #0x50]\n"
+    "    stp x23, x24, [sp, #0x60]\n"
+    "    stp x25, x26, [sp, #0x70]\n"
+    "    stp x27, x28, [sp, #0x80]\n"
+    "    stp x29, x30, [sp, #0x90]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp d8, d9, [sp, #0x00]\n"
+    "    ldp d10, d11, [sp, #0x10]\n"
+    "    ldp d12, d13, [sp, #0x20]\n"
+    "    ldp d14, d15, [sp, #0x30]\n"
+    "    ldp x19, x20, [sp, #0x40]\n"
+    "    ldp x21, x22, [sp, #0x50]\n"
+    "    ldp x23, x24, [sp, #0x60]\n"
+    "    ldp x25, x26, [sp, #0x70]\n"
+    "    ldp x27, x28, [sp, #0x80]\n"
+    "    ldp x29, x30, [sp, #0x90]\n"
+    "    add sp, sp, #0xb0\n"
+    "    ret\n"
+    CORO_ASM_END(coro_swap_context)
+    // first activation of a context made by MakeContext, entry is in x19
+    CORO_ASM_BEGIN(coro_context_entry)
+    "    blr x19\n"
+    "    brk #0\n"
+    CORO_ASM_END(coro_context_entry));
+
+inline void MakeContext(Context *ctx, char *stack, size_t size,
+        void (*entry)()) {
+    uintptr_t top = (reinterpret_cast<uintptr_t>(stack) + size) &
+        ~uintptr_t(15);
+    uint64_t *frame = reinterpret_cast<uint64_t *>(top - 0xb0);
+    for (int i = 0; i < 22; i++)
+        frame[i] = 0;
+    frame[8] = reinterpret_cast<uint64_t>(entry);    // x19
+    frame[19] = reinterpret_cast<uint64_t>(&coro_context_entry);    // x30
+    ctx->sp = frame;
+}
+
+#endif
+
+#undef CORO_ASM_BEGIN
+#undef CORO_ASM_END
+
+// save the running context into from and activate to
+inline void SwapContext(Context *from, Context *to) {
+    coro_swap_context(&from->sp, to->sp);
+}
+
+// lowest stack address in use by a suspended context
+inline void *StackPointer(const Context &ctx) {
+    return ctx.sp;
+}
+
+#endif
+
+}  // namespace coro
@@ -4,7 +4,49 @@
 #define STACK_LIMIT (1024*1024)
 #endif
 
+// number of released stacks each thread keeps around for reuse
+#ifndef STACK_POOL_LIMIT
+#define STACK_POOL_LIMIT 64
+#endif
+
+// callables up to this size are stored inside the routine itself
+#ifndef ROUTINE_INLINE_SIZE
+#define ROUTINE_INLINE_SIZE 64
+#endif
+
+// callables up to this size are stored inside a queued task
+#ifndef TASK_INLINE_SIZE
+#define TASK_INLINE_SIZE 64
+#endif
+
+// tick of the per-thread timer wheel, sleeps and timeouts are rounded up
+// to it
+#ifndef TIMER_RESOLUTION_US
+#define TIMER_RESOLUTION_US 1000
+#endif
+
+// resumes of more urgent routines after which a ready one of a less urgent
+// class gets a turn, see SetStarvationLimit
+#ifndef PRIORITY_STARVATION_LIMIT
+#define PRIORITY_STARVATION_LIMIT 32
+#endif
+
+// time a routine runs before MaybeYield lets the others go on, see
+// SetTimeSlice
+#ifndef TIME_SLICE_US
+#define TIME_SLICE_US 1000
+#endif
+
+// Let routines move to other threads at MigrationPoint and Park. Every
+// thread_local is then read through a call the compiler can not fold across
+// a context switch, a little slower, hence opt-in. Fibers and ucontext can
+// not move.
+#if defined(CORO_MIGRATION) && (defined(_MSC_VER) || defined(CORO_USE_UCONTEXT))
+#undef CORO_MIGRATION
+#endif
+
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <cstdio>
 #include <cassert>
@@ -12,8 +54,24 @@
 #include <string>
 #include <vector>
 #include <list>
+#include <memory>
+#include <new>
 #include <thread>
 #include <future>
+#include <mutex>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "small_function.h"
+#include "spinlock.h"
+#include "parker.h"
+#include "blocking_pool.h"
+#include "timer_wheel.h"
+#include "cycle_clock.h"
 
 using ::std::string;
 using ::std::wstring;
@@ -21,85 +79,578 @@ using ::std::wstring;
 #ifdef _MSC_VER
 #include <Windows.h>
 #else
-#if defined(__APPLE__) && defined(__MACH__)
-#define _XOPEN_SOURCE
-#include <ucontext.h>
-#else
-#include <ucontext.h>
+#include "context.h"
+#include "stack.h"
 #endif
+
+// Accessors of thread_locals a routine may use on both sides of a switch are
+// kept out of line, and opaque, when routines can move: the address of a
+// thread_local must not be reused after the routine continued on another
+// thread.
+#ifdef CORO_MIGRATION
+#define CORO_TLS_ACCESSOR __attribute__((noinline))
+#define CORO_TLS_FENCE() __asm__ __volatile__("" ::: "memory")
+#else
+#define CORO_TLS_ACCESSOR
+#define CORO_TLS_FENCE()
 #endif
 
 namespace coro {
 
 typedef unsigned routine_t;
 
+typedef SmallFunction<void(), ROUTINE_INLINE_SIZE> RoutineFunction;
+
+// a task on its way to a pool, moved from queue to worker and never copied
+typedef SmallFunction<void(), TASK_INLINE_SIZE> UniqueTask;
+
+typedef std::chrono::steady_clock Clock;
+
+// How urgent a routine, or the task it runs, is. Ready routines of a more
+// urgent class are resumed first.
+enum class Priority : uint8_t {
+    kCritical = 0,
+    kHigh = 1,
+    kNormal = 2,
+    kLow = 3,
+};
+
+const size_t kPriorityLevels = 4;
+
+// tick of the timer wheel a point in time falls into
+inline uint64_t TimerTick(Clock::time_point time) {
+    return uint64_t(time.time_since_epoch() /
+            std::chrono::microseconds(TIMER_RESOLUTION_US));
+}
+
+// Routines live in chunks that never move, so that a routine_t indexes them
+// directly. Slots of destroyed routines are chained through next_free and
+// handed out again first, nothing is allocated once the slab is warm.
+template <typename Routine>
+class RoutineSlab {
+public:
+    RoutineSlab() : size_(0), free_(0) {}
+
+    // slot of id, nullptr if id was never handed out
+    inline Routine *Get(routine_t id) {
+        if (id == 0 || id > size_)
+            return nullptr;
+        return &chunks_[(id - 1) >> kShift][(id - 1) & kMask];
+    }
+
+    inline routine_t Allocate() {
+        if (free_ != 0) {
+            routine_t id = free_;
+            free_ = Get(id)->next_free;
+            return id;
+        }
+        if ((size_ & kMask) == 0)
+            chunks_.emplace_back(new Routine[kChunk]);
+        return ++size_;
+    }
+
+    inline void Release(routine_t id) {
+        Get(id)->next_free = free_;
+        free_ = id;
+    }
+
+    inline routine_t Size() const {
+        return size_;
+    }
+
+private:
+    static const routine_t kShift = 6;
+    static const routine_t kChunk = 1U << kShift;
+    static const routine_t kMask = kChunk - 1;
+
+    std::vector<std::unique_ptr<Routine[]>> chunks_;
+    routine_t size_;
+    routine_t free_;
+};
+
+// FIFOs of the routines that can run, one per priority, linked through
+// their slots by id so that pushing, popping and removing never allocate. A
+// routine is in the one of its priority while it is neither running,
+// suspended nor finished, its priority does not change meanwhile.
+//
+// The most urgent class goes first, but after starvation_limit pops in a
+// row while less urgent routines wait one of those gets a turn, each less
+// urgent class in rotation; a limit of 0 keeps priorities strict.
+template <typename Routine>
+class ReadyQueue {
+public:
+    explicit ReadyQueue(RoutineSlab<Routine> *routines) : routines_(routines),
+            size_(0), mask_(0), starvation_limit_(PRIORITY_STARVATION_LIMIT),
+            served_(0), aged_(0) {
+        for (size_t level = 0; level < kPriorityLevels; level++) {
+            head_[level] = 0;
+            tail_[level] = 0;
+        }
+    }
+
+    inline void PushBack(routine_t id) {
+        Routine *routine = routines_->Get(id);
+        if (routine->ready)
+            return;
+        const size_t level = size_t(routine->priority);
+        routine->ready = true;
+        routine->ready_prev = tail_[level];
+        routine->ready_next = 0;
+        if (tail_[level] != 0)
+            routines_->Get(tail_[level])->ready_next = id;
+        else
+            head_[level] = id;
+        tail_[level] = id;
+        mask_ |= 1U << level;
+        size_++;
+    }
+
+    // oldest ready routine of the class whose turn it is, 0 if there is none
+    inline routine_t PopFront() {
+        if (mask_ == 0)
+            return 0;
+        routine_t id = head_[Turn()];
+        Remove(id);
+        return id;
+    }
+
+    inline void Remove(routine_t id) {
+        Routine *routine = routines_->Get(id);
+        if (!routine->ready)
+            return;
+        const size_t level = size_t(routine->priority);
+        routine_t prev = routine->ready_prev;
+        routine_t next = routine->ready_next;
+        if (prev != 0)
+            routines_->Get(prev)->ready_next = next;
+        else
+            head_[level] = next;
+        if (next != 0)
+            routines_->Get(next)->ready_prev = prev;
+        else
+            tail_[level] = prev;
+        if (head_[level] == 0)
+            mask_ &= ~(1U << level);
+        routine->ready = false;
+        size_--;
+    }
+
+    inline size_t Size() const {
+        return size_;
+    }
+
+    // newest ready routine of a class, earlier ones follow through
+    // ready_prev
+    inline routine_t Back(Priority priority) const {
+        return tail_[size_t(priority)];
+    }
+
+    inline void SetStarvationLimit(size_t limit) {
+        starvation_limit_ = limit;
+        served_ = 0;
+    }
+
+private:
+    // level PopFront takes from, mask_ is not empty
+    inline size_t Turn() {
+        size_t level = 0;
+        while ((mask_ & (1U << level)) == 0)
+            level++;
+        if (starvation_limit_ == 0 || (mask_ >> (level + 1)) == 0) {
+            served_ = 0;
+            return level;
+        }
+        if (served_++ < starvation_limit_)
+            return level;
+        served_ = 0;
+        for (size_t i = 0; i < kPriorityLevels; i++) {
+            aged_ = (aged_ + 1) % kPriorityLevels;
+            if (aged_ > level && (mask_ & (1U << aged_)) != 0)
+                return aged_;
+        }
+        return level;
+    }
+
+    RoutineSlab<Routine> *routines_;
+    routine_t head_[kPriorityLevels];
+    routine_t tail_[kPriorityLevels];
+    size_t size_;
+    // bit per class with ready routines
+    unsigned mask_;
+    size_t starvation_limit_;
+    // pops of the most urgent class while less urgent ones waited
+    size_t served_;
+    // less urgent class that had the last turn
+    size_t aged_;
+};
+
+// Time the current routine of a thread has been running, in CycleClock
+// ticks. Unless CORO_CPU_TIME reads the clock at every resume anyway, the
+// slice starts at the first MaybeYield after it. With a timer, see
+// preemption.h, MaybeYield only reads the mark it leaves instead.
+struct TimeSlice {
+    // 0 for TIME_SLICE_US, converted on first use so that only programs
+    // using it calibrate the clock
+    uint64_t length;
+    // 0 until the clock was read
+    uint64_t started;
+    // set from a signal handler
+    std::atomic<bool> expired;
+    bool signalled;
+
+    TimeSlice() : length(0), started(0), expired(false), signalled(false) {}
+
+    inline void Start() {
+#ifdef CORO_CPU_TIME
+        started = CycleClock::Now();
+#else
+        started = 0;
+#endif
+        expired.store(false, std::memory_order_relaxed);
+    }
+
+    // ticks since Start
+    inline uint64_t Elapsed() const {
+        return started != 0 ? CycleClock::Now() - started : 0;
+    }
+
+    inline bool IsOver() {
+        if (signalled)
+            return expired.load(std::memory_order_relaxed);
+        const uint64_t now = CycleClock::Now();
+        if (started == 0) {
+            started = now;
+            return false;
+        }
+        if (length == 0)
+            length = CycleClock::FromMicroseconds(
+                    std::chrono::microseconds(TIME_SLICE_US));
+        return now - started >= length;
+    }
+};
+
+struct Ordinator;
+struct MovedRoutine;
+
+// Routine together with the ordinator it lives on, what other threads need
+// to wake it up.
+struct Handle {
+    Ordinator *ordinator;
+    routine_t id;
+};
+
+// Routine by an id that stays the same wherever it runs, see GlobalSelf.
+struct GlobalHandle {
+    uint64_t id;
+};
+
+// Told by the ordinator of a thread whenever one of its routines moved to
+// another thread or arrived from one, on that thread, see SetMigrationHooks.
+// What OnMovedOut gives travels with the routine to OnMovedIn.
+class MigrationHooks {
+public:
+    virtual ~MigrationHooks() {}
+    virtual uintptr_t OnMovedOut(routine_t id) = 0;
+    virtual void OnMovedIn(routine_t id, uintptr_t cookie) = 0;
+};
+
+namespace detail {
+
+// Where routines that were given a global id live now, updated when they
+// move. Sharded so that threads waking different routines rarely meet.
+class Directory {
+public:
+    static Directory &Get() {
+        static Directory directory;
+        return directory;
+    }
+
+    inline uint64_t Add(const Handle &handle) {
+        uint64_t id = next_.fetch_add(1, std::memory_order_relaxed);
+        Shard &shard = shards_[id % kShards];
+        std::lock_guard<::SpinLock> lk(shard.lock);
+        shard.handles[id] = handle;
+        return id;
+    }
+
+    inline void Update(uint64_t id, const Handle &handle) {
+        Shard &shard = shards_[id % kShards];
+        std::lock_guard<::SpinLock> lk(shard.lock);
+        shard.handles[id] = handle;
+    }
+
+    inline void Remove(uint64_t id) {
+        Shard &shard = shards_[id % kShards];
+        std::lock_guard<::SpinLock> lk(shard.lock);
+        shard.handles.erase(id);
+    }
+
+    /*!
+     * \brief Call f with where id lives, false if it is gone. The routine
+     * can neither move nor be destroyed while f runs.
+     */
+    template<typename F>
+    inline bool With(uint64_t id, F &&f) {
+        Shard &shard = shards_[id % kShards];
+        std::lock_guard<::SpinLock> lk(shard.lock);
+        auto it = shard.handles.find(id);
+        if (it == shard.handles.end())
+            return false;
+        f(it->second);
+        return true;
+    }
+
+private:
+    static const size_t kShards = 64;
+
+    struct Shard {
+        ::SpinLock lock;
+        std::unordered_map<uint64_t, Handle> handles;
+    };
+
+    Directory() : next_(1) {}
+
+    Shard shards_[kShards];
+    std::atomic<uint64_t> next_;
+};
+
+}  // namespace detail
+
+// Routines woken up from other threads, collected under a lock and applied
+// by the thread owning the ordinator, along with routines moved over from
+// other threads. The parker, if any, is unparked for every post so that a
+// sleeping owner notices.
+class WakeupInbox {
+public:
+    WakeupInbox() : pending_(false), closed_(false), parker_(nullptr) {}
+
+    // target, if any, is where the routine should go on from
+    inline void Post(routine_t id, Ordinator *target = nullptr) {
+        lock_.lock();
+        Wakeup wakeup = {id, target};
+        ids_.push_back(wakeup);
+        pending_.store(true, std::memory_order_release);
+        lock_.unlock();
+        Unpark();
+    }
+
+    // false once closed, the routine stays with the sender then
+    inline bool PostMoved(MovedRoutine *moved) {
+        lock_.lock();
+        if (closed_) {
+            lock_.unlock();
+            return false;
+        }
+        moved_.push_back(moved);
+        pending_.store(true, std::memory_order_release);
+        lock_.unlock();
+        Unpark();
+        return true;
+    }
+
+    // owner only, calls f for every posted id and target, then adopt for
+    // every moved routine
+    template<typename F, typename G>
+    inline void Drain(F &&f, G &&adopt) {
+        if (!pending_.load(std::memory_order_acquire))
+            return;
+        lock_.lock();
+        draining_.swap(ids_);
+        adopting_.swap(moved_);
+        pending_.store(false, std::memory_order_relaxed);
+        lock_.unlock();
+        for (const Wakeup &wakeup : draining_)
+            f(wakeup.id, wakeup.target);
+        draining_.clear();
+        for (MovedRoutine *moved : adopting_)
+            adopt(moved);
+        adopting_.clear();
+    }
+
+    // refuse moved routines from now on, false while some are not drained
+    inline bool Close() {
+        std::lock_guard<::SpinLock> lk(lock_);
+        if (!moved_.empty())
+            return false;
+        closed_ = true;
+        return true;
+    }
+
+    inline void SetParker(Parker *parker) {
+        parker_.store(parker, std::memory_order_release);
+    }
+
+private:
+    struct Wakeup {
+        routine_t id;
+        Ordinator *target;
+    };
+
+    inline void Unpark() {
+        Parker *parker = parker_.load(std::memory_order_acquire);
+        if (parker != nullptr)
+            parker->Unpark();
+    }
+
+    ::SpinLock lock_;
+    std::vector<Wakeup> ids_;
+    // swapped with ids_, both keep their capacity
+    std::vector<Wakeup> draining_;
+    std::vector<MovedRoutine *> moved_;
+    std::vector<MovedRoutine *> adopting_;
+    std::atomic<bool> pending_;
+    bool closed_;
+    std::atomic<Parker *> parker_;
+};
+
 #ifdef _MSC_VER
 
 struct Routine {
-    std::function<void()> func;
+    RoutineFunction func;
+    bool used;
     bool finished;
+    // suspended until Wake, Resume leaves it alone
+    bool blocked;
     LPVOID fiber;
-
-    Routine(std::function<void()> f) {
-        func = f;
+    size_t stack_size;
+    // id in the directory, 0 until GlobalSelf asked for one
+    uint64_t global;
+    // waiting at a MigrationPoint or in Park
+    bool movable;
+    Priority priority;
+    // CycleClock ticks spent running, with CORO_CPU_TIME
+    uint64_t cpu_ticks;
+    // pending sleep or timeout, data holds the routine id
+    TimerNode timer;
+    // links in the ready queue of the ordinator while ready is set
+    bool ready;
+    routine_t ready_prev;
+    routine_t ready_next;
+    routine_t next_free;
+
+    Routine() {
+        used = false;
         finished = false;
+        blocked = false;
         fiber = nullptr;
+        stack_size = 0;
+        global = 0;
+        movable = false;
+        priority = Priority::kNormal;
+        cpu_ticks = 0;
+        ready = false;
+        ready_prev = 0;
+        ready_next = 0;
+        next_free = 0;
     }
 
     ~Routine() {
-        DeleteFiber(fiber);
+        if (fiber != nullptr)
+            DeleteFiber(fiber);
     }
 };
 
 struct Ordinator {
-    std::vector<Routine *> routines;
-    std::list<routine_t> indexes;
+    RoutineSlab<Routine> routines;
     routine_t current;
     size_t stack_size;
     LPVOID fiber;
-
-    Ordinator(size_t ss = STACK_LIMIT) {
+    WakeupInbox wakeups;
+    TimerWheel timers;
+    ReadyQueue<Routine> ready;
+    MigrationHooks *hooks;
+    TimeSlice slice;
+
+    Ordinator(size_t ss = STACK_LIMIT) : timers(TimerTick(Clock::now())),
+            ready(&routines) {
         current = 0;
         stack_size = ss;
         fiber = ConvertThreadToFiber(nullptr);
+        hooks = nullptr;
     }
 
-    ~Ordinator() {
-        for (auto &routine : routines)
-            delete routine;
+    // fibers stay on their thread
+    inline bool MoveTo(routine_t, Ordinator *) {
+        return false;
     }
-};
 
-thread_local static Ordinator ordinator;
+    inline size_t MoveReady(Ordinator *, size_t) {
+        return 0;
+    }
 
-inline routine_t Create(std::function<void()> f) {
-    Routine *routine = new Routine(f);
+    inline void Unblock(routine_t id) {
+        Routine *routine = routines.Get(id);
+        if (routine != nullptr && routine->used && routine->blocked) {
+            routine->blocked = false;
+            ready.PushBack(id);
+        }
+    }
 
-    if (ordinator.indexes.empty()) {
-        ordinator.routines.push_back(routine);
-        return ordinator.routines.size();
+    inline void ApplyWakeups() {
+        wakeups.Drain([this](routine_t id, Ordinator *) { Unblock(id); },
+                [](MovedRoutine *) {});
     }
-    else {
-        routine_t id = ordinator.indexes.front();
-        ordinator.indexes.pop_front();
-        assert(ordinator.routines[id - 1] == nullptr);
-        ordinator.routines[id - 1] = routine;
-        return id;
+
+    // wake routines whose timers are due, gives how many
+    inline size_t ExpireTimers() {
+        if (timers.IsEmpty())
+            return 0;
+        return timers.Advance(TimerTick(Clock::now()), [this](TimerNode *node) {
+            Unblock(routine_t(node->data));
+        });
     }
+};
+
+thread_local static Ordinator thread_ordinator;
+
+// ordinator of the calling thread
+CORO_TLS_ACCESSOR inline Ordinator &LocalOrdinator() {
+    CORO_TLS_FENCE();
+    return thread_ordinator;
+}
+
+// stack_size of 0 means the default size of the ordinator
+template<typename Function>
+inline routine_t Create(Function &&f, size_t stack_size = 0) {
+    Ordinator &ordinator = LocalOrdinator();
+    routine_t id = ordinator.routines.Allocate();
+    Routine *routine = ordinator.routines.Get(id);
+    routine->func = std::forward<Function>(f);
+    routine->used = true;
+    routine->finished = false;
+    routine->blocked = false;
+    routine->stack_size = stack_size;
+    routine->priority = Priority::kNormal;
+    ordinator.ready.PushBack(id);
+    return id;
 }
 
 inline void Destroy(routine_t id) {
-    Routine *routine = ordinator.routines[id - 1];
-    assert(routine != nullptr);
+    Ordinator &ordinator = LocalOrdinator();
+    Routine *routine = ordinator.routines.Get(id);
+    assert(routine != nullptr && routine->used);
 
-    delete routine;
-    ordinator.routines[id - 1] = nullptr;
-    ordinator.indexes.push_back(id);
+    if (routine->fiber != nullptr) {
+        DeleteFiber(routine->fiber);
+        routine->fiber = nullptr;
+    }
+    if (routine->timer.IsLinked())
+        ordinator.timers.Remove(&routine->timer);
+    ordinator.ready.Remove(id);
+    if (routine->global != 0) {
+        detail::Directory::Get().Remove(routine->global);
+        routine->global = 0;
+    }
+    routine->func = nullptr;
+    routine->used = false;
+    routine->movable = false;
+    ordinator.routines.Release(id);
 }
 
 inline void __stdcall Entry(LPVOID lpParameter) {
+    Ordinator &ordinator = LocalOrdinator();
     routine_t id = ordinator.current;
-    Routine *routine = ordinator.routines[id - 1];
+    Routine *routine = ordinator.routines.Get(id);
     assert(routine != nullptr);
 
     routine->func();
@@ -111,30 +662,43 @@ inline void __stdcall Entry(LPVOID lpParameter) {
 }
 
 inline int Resume(routine_t id) {
+    Ordinator &ordinator = LocalOrdinator();
     assert(ordinator.current == 0);
-    Routine *routine = ordinator.routines[id - 1];
-    if (routine == nullptr)
+    Routine *routine = ordinator.routines.Get(id);
+    if (routine == nullptr || !routine->used)
         return -1;
 
     if (routine->finished)
         return -2;
 
-    if (routine->fiber == nullptr) {
-        routine->fiber = CreateFiber(ordinator.stack_size, entry, 0);
-        ordinator.current = id;
-        SwitchToFiber(routine->fiber);
+    if (routine->blocked) {
+        ordinator.ApplyWakeups();
+        if (routine->blocked)
+            return -3;
     }
-    else {
-        ordinator.current = id;
-        SwitchToFiber(routine->fiber);
+
+    ordinator.ready.Remove(id);
+    if (routine->fiber == nullptr) {
+        routine->fiber = CreateFiber(routine->stack_size ?
+                routine->stack_size : ordinator.stack_size, entry, 0);
     }
+    ordinator.current = id;
+    ordinator.slice.Start();
+    SwitchToFiber(routine->fiber);
+#ifdef CORO_CPU_TIME
+    routine->cpu_ticks += ordinator.slice.Elapsed();
+#endif
+    // yielded, its turn comes again after the others ready now
+    if (!routine->finished && !routine->blocked)
+        ordinator.ready.PushBack(id);
 
     return 0;
 }
 
 inline void Yield() {
+    Ordinator &ordinator = LocalOrdinator();
     routine_t id = ordinator.current;
-    Routine *routine = ordinator.routines[id - 1];
+    Routine *routine = ordinator.routines.Get(id);
     assert(routine != nullptr);
 
     ordinator.current = 0;
@@ -142,258 +706,1091 @@ inline void Yield() {
 }
 
 inline routine_t Current() {
-    return ordinator.current;
+    return LocalOrdinator().current;
 }
 
-#if 0
-template<typename Function>
-inline typename std::result_of<Function()>::type
-Await(Function &&func)
-{
-    auto future = std::async(std::launch::async, func);
-    std::future_status status = future.wait_for(std::chrono::milliseconds(0));
-
-    while (status == std::future_status::timeout) {
-        if (ordinator.current != 0)
-            yield();
-
-        status = future.wait_for(std::chrono::milliseconds(0));
-    }
-    return future.get();
-}
-#endif
-
-#if 1
-template<typename Function>
-inline std::result_of_t<std::decay_t<Function>()>
-Await(Function &&func) {
-    auto future = std::async(std::launch::async, func);
-    std::future_status status = future.wait_for(std::chrono::milliseconds(0));
-
-    while (status == std::future_status::timeout)
-    {
-        if (ordinator.current != 0)
-            yield();
-
-        status = future.wait_for(std::chrono::milliseconds(0));
-    }
-    return future.get();
-}
-#endif
-
 #else    // unix
 
 struct Routine {
-    std::function<void()> func;
-    char *stack;
+    RoutineFunction func;
+    Stack stack;
+    size_t stack_size;
+    bool used;
     bool finished;
-    ucontext_t ctx;
-
-    Routine(std::function<void()> f) {
-        func = f;
-        stack = nullptr;
+    // suspended until Wake, Resume leaves it alone
+    bool blocked;
+    Context ctx;
+    // runs on the shared stack of the ordinator, its frames are copied
+    // into saved while another routine occupies that stack, the buffer is
+    // kept when the slot is reused
+    bool shared;
+    char *saved;
+    size_t saved_size;
+    size_t saved_capacity;
+    // id in the directory, 0 until GlobalSelf asked for one
+    uint64_t global;
+    // waiting at a MigrationPoint or in Park, another thread may take it
+    bool movable;
+    Priority priority;
+    // CycleClock ticks spent running, with CORO_CPU_TIME
+    uint64_t cpu_ticks;
+    // pending sleep or timeout, data holds the routine id
+    TimerNode timer;
+    // links in the ready queue of the ordinator while ready is set
+    bool ready;
+    routine_t ready_prev;
+    routine_t ready_next;
+    routine_t next_free;
+
+    Routine() {
+        stack_size = 0;
+        used = false;
         finished = false;
+        blocked = false;
+        shared = false;
+        saved = nullptr;
+        saved_size = 0;
+        saved_capacity = 0;
+        global = 0;
+        movable = false;
+        priority = Priority::kNormal;
+        cpu_ticks = 0;
+        ready = false;
+        ready_prev = 0;
+        ready_next = 0;
+        next_free = 0;
     }
 
     ~Routine() {
-        delete[] stack;
+        std::free(saved);
     }
 };
 
+inline void Entry();
+
+// A routine on its way to another thread, its stack and context travel, the
+// slot it had stays behind.
+struct MovedRoutine {
+    Stack stack;
+    size_t stack_size;
+    Context ctx;
+    uint64_t global;
+    Priority priority;
+    uint64_t cpu_ticks;
+    uintptr_t cookie;
+};
+
 struct Ordinator {
-    std::vector<Routine *> routines;
-    std::list<routine_t> indexes;
+    RoutineSlab<Routine> routines;
     routine_t current;
     size_t stack_size;
-    ucontext_t ctx;
-
-    inline Ordinator(size_t ss = STACK_LIMIT) {
+    Context ctx;
+    StackAllocator *allocator;
+    // stacks of released routines, handed out again before allocating
+    std::vector<Stack> free_stacks;
+    // stack shared by routines created without an explicit size, if any
+    Stack shared_stack;
+    routine_t occupant;
+    size_t shared_routines;
+    WakeupInbox wakeups;
+    TimerWheel timers;
+    ReadyQueue<Routine> ready;
+    MigrationHooks *hooks;
+    TimeSlice slice;
+
+    inline Ordinator(size_t ss = STACK_LIMIT) :
+            timers(TimerTick(Clock::now())), ready(&routines) {
         current = 0;
         stack_size = ss;
+        allocator = DefaultStackAllocator();
+        occupant = 0;
+        shared_routines = 0;
+        hooks = nullptr;
     }
 
     inline ~Ordinator() {
-        for (auto &routine : routines)
-            delete routine;
+        for (routine_t id = 1; id <= routines.Size(); id++) {
+            Routine *routine = routines.Get(id);
+            if (routine->used && routine->global != 0)
+                detail::Directory::Get().Remove(routine->global);
+            if (routine->used && !routine->shared &&
+                    routine->stack.base != nullptr)
+                allocator->Deallocate(routine->stack);
+        }
+        TrimStacks(0);
+        if (shared_stack.base != nullptr)
+            allocator->Deallocate(shared_stack);
     }
-};
 
-thread_local static Ordinator ordinator;
+    inline Stack AcquireStack(size_t size) {
+        size = RoundToPage(size);
+        for (size_t i = free_stacks.size(); i > 0; i--) {
+            if (free_stacks[i - 1].size == size) {
+                Stack stack = free_stacks[i - 1];
+                free_stacks[i - 1] = free_stacks.back();
+                free_stacks.pop_back();
+                return stack;
+            }
+        }
+        return allocator->Allocate(size);
+    }
+
+    inline void Unblock(routine_t id) {
+        Routine *routine = routines.Get(id);
+        if (routine != nullptr && routine->used && routine->blocked) {
+            routine->blocked = false;
+            ready.PushBack(id);
+        }
+    }
 
-inline routine_t Create(std::function<void()> f) {
-    Routine *routine = new Routine(f);
+    inline void ApplyWakeups() {
+        wakeups.Drain([this](routine_t id, Ordinator *target) {
+            Unblock(id);
+            if (target != nullptr && target != this)
+                MoveTo(id, target);
+        }, [this](MovedRoutine *moved) { Adopt(moved); });
+    }
 
-    if (ordinator.indexes.empty()) {
-        ordinator.routines.push_back(routine);
-        return ordinator.routines.size();
+    /*!
+     * \brief Hand routine id over to the thread of target, if it waits at a
+     * MigrationPoint or in Park, runs on a stack of its own and has no timer
+     * pending. Routines target refuses are adopted again right away, with a
+     * new id.
+     */
+    inline bool MoveTo(routine_t id, Ordinator *target) {
+#ifdef CORO_MIGRATION
+        Routine *routine = routines.Get(id);
+        if (routine == nullptr || !routine->used || !routine->movable ||
+                routine->finished || routine->blocked || routine->shared ||
+                id == current ||
+                routine->stack.base == nullptr || routine->timer.IsLinked())
+            return false;
+        MovedRoutine *moved = new MovedRoutine;
+        moved->stack = routine->stack;
+        moved->stack_size = routine->stack_size;
+        moved->ctx = routine->ctx;
+        moved->global = routine->global;
+        moved->priority = routine->priority;
+        moved->cpu_ticks = routine->cpu_ticks;
+        moved->cookie = hooks != nullptr ? hooks->OnMovedOut(id) : 0;
+        // destroyed here without giving its stack back
+        ready.Remove(id);
+        routine->stack = Stack();
+        routine->global = 0;
+        routine->used = false;
+        routine->movable = false;
+        routines.Release(id);
+        if (!target->wakeups.PostMoved(moved)) {
+            Adopt(moved);
+            return false;
+        }
+        return true;
+#else
+        (void)id;
+        (void)target;
+        return false;
+#endif
     }
-    else {
-        routine_t id = ordinator.indexes.front();
-        ordinator.indexes.pop_front();
-        assert(ordinator.routines[id - 1] == nullptr);
-        ordinator.routines[id - 1] = routine;
+
+    // take in a routine moved here, it is ready under a new id
+    inline routine_t Adopt(MovedRoutine *moved) {
+        routine_t id = routines.Allocate();
+        Routine *routine = routines.Get(id);
+        // a growable stack grows from a fault handler, which needs an
+        // alternate stack on this thread too
+        if (moved->stack.committed != nullptr)
+            detail::InstallStackFaultHandler();
+        routine->stack = moved->stack;
+        routine->stack_size = moved->stack_size;
+        routine->ctx = moved->ctx;
+        routine->global = moved->global;
+        routine->priority = moved->priority;
+        routine->cpu_ticks = moved->cpu_ticks;
+        routine->used = true;
+        routine->finished = false;
+        routine->blocked = false;
+        routine->shared = false;
+        routine->movable = true;
+        uintptr_t cookie = moved->cookie;
+        delete moved;
+        if (routine->global != 0) {
+            Handle handle = {this, id};
+            detail::Directory::Get().Update(routine->global, handle);
+        }
+        ready.PushBack(id);
+        if (hooks != nullptr)
+            hooks->OnMovedIn(id, cookie);
         return id;
     }
+
+    // move up to max of the routines ready here to target, the least
+    // urgent and newest first
+    inline size_t MoveReady(Ordinator *target, size_t max) {
+        size_t moved = 0;
+        for (size_t level = kPriorityLevels; level > 0 && moved < max;
+                level--) {
+            routine_t id = ready.Back(Priority(level - 1));
+            while (id != 0 && moved < max) {
+                routine_t prev = routines.Get(id)->ready_prev;
+                if (MoveTo(id, target))
+                    moved++;
+                id = prev;
+            }
+        }
+        return moved;
+    }
+
+    // wake routines whose timers are due, gives how many
+    inline size_t ExpireTimers() {
+        if (timers.IsEmpty())
+            return 0;
+        return timers.Advance(TimerTick(Clock::now()), [this](TimerNode *node) {
+            Unblock(routine_t(node->data));
+        });
+    }
+
+    inline void ReleaseStack(const Stack &stack) {
+        if (free_stacks.size() < STACK_POOL_LIMIT)
+            free_stacks.push_back(stack);
+        else
+            allocator->Deallocate(stack);
+    }
+
+    // give cached stacks back to the allocator until at most limit are left
+    inline void TrimStacks(size_t limit) {
+        while (free_stacks.size() > limit) {
+            allocator->Deallocate(free_stacks.back());
+            free_stacks.pop_back();
+        }
+    }
+
+#ifndef CORO_USE_UCONTEXT
+    // copy the live part of the shared stack into the occupant's buffer
+    inline void SaveSharedStack(Routine *routine) {
+        char *top = shared_stack.base + shared_stack.size;
+        char *sp = static_cast<char *>(StackPointer(routine->ctx));
+        size_t used = size_t(top - sp);
+        if (routine->saved_capacity < used) {
+            std::free(routine->saved);
+            routine->saved = static_cast<char *>(std::malloc(used));
+            if (routine->saved == nullptr) {
+                routine->saved_capacity = 0;
+                throw std::bad_alloc();
+            }
+            routine->saved_capacity = used;
+        }
+        memcpy(routine->saved, sp, used);
+        routine->saved_size = used;
+    }
+
+    // move routine onto the shared stack, saving whoever is there now
+    inline void OccupySharedStack(routine_t id, Routine *routine) {
+        if (occupant == id)
+            return;
+        if (occupant != 0) {
+            Routine *previous = routines.Get(occupant);
+            if (!previous->finished)
+                SaveSharedStack(previous);
+        }
+        occupant = id;
+        if (routine->stack.base == nullptr) {
+            routine->stack = shared_stack;
+            MakeContext(&routine->ctx, shared_stack.base, shared_stack.size,
+                    Entry);
+        }
+        else {
+            char *top = shared_stack.base + shared_stack.size;
+            memcpy(top - routine->saved_size, routine->saved,
+                    routine->saved_size);
+        }
+    }
+#endif
+};
+
+thread_local static Ordinator thread_ordinator;
+
+// ordinator of the calling thread
+CORO_TLS_ACCESSOR inline Ordinator &LocalOrdinator() {
+    CORO_TLS_FENCE();
+    return thread_ordinator;
+}
+
+// stack_size of 0 means the default size of the ordinator, or the shared
+// stack if SetSharedStack was called on this thread
+template<typename Function>
+inline routine_t Create(Function &&f, size_t stack_size = 0) {
+    Ordinator &ordinator = LocalOrdinator();
+    routine_t id = ordinator.routines.Allocate();
+    Routine *routine = ordinator.routines.Get(id);
+    try {
+        routine->func = std::forward<Function>(f);
+    }
+    catch (...) {
+        ordinator.routines.Release(id);
+        throw;
+    }
+    routine->used = true;
+    routine->finished = false;
+    routine->blocked = false;
+    routine->shared = stack_size == 0 && ordinator.shared_stack.base != nullptr;
+    routine->stack_size = stack_size ? stack_size : ordinator.stack_size;
+    if (routine->shared)
+        ordinator.shared_routines++;
+    routine->priority = Priority::kNormal;
+    ordinator.ready.PushBack(id);
+    return id;
 }
 
 inline void Destroy(routine_t id) {
-    Routine *routine = ordinator.routines[id - 1];
-    assert(routine != nullptr);
+    Ordinator &ordinator = LocalOrdinator();
+    Routine *routine = ordinator.routines.Get(id);
+    assert(routine != nullptr && routine->used);
+
+    if (routine->shared) {
+        ordinator.shared_routines--;
+        if (ordinator.occupant == id)
+            ordinator.occupant = 0;
+        routine->saved_size = 0;
+    }
+    else if (routine->stack.base != nullptr) {
+        ordinator.ReleaseStack(routine->stack);
+    }
+    routine->stack = Stack();
+    if (routine->timer.IsLinked())
+        ordinator.timers.Remove(&routine->timer);
+    ordinator.ready.Remove(id);
+    if (routine->global != 0) {
+        detail::Directory::Get().Remove(routine->global);
+        routine->global = 0;
+    }
+    routine->func = nullptr;
+    routine->used = false;
+    routine->movable = false;
+    ordinator.routines.Release(id);
+}
 
-    delete routine;
-    ordinator.routines[id - 1] = nullptr;
+// Replace the stack provider of the calling thread, cached stacks are given
+// back to the previous one. Stacks in use are released to whichever provider
+// is installed when their routine is destroyed, so set it before creating
+// any routine on this thread.
+inline void SetStackAllocator(StackAllocator *allocator) {
+    Ordinator &ordinator = LocalOrdinator();
+    ordinator.TrimStacks(0);
+    ordinator.allocator =
+        allocator != nullptr ? allocator : DefaultStackAllocator();
 }
 
+// Let routines created from now on without an explicit stack size run on one
+// stack of the given size, like libco does. Only the used part of it is
+// copied out when another routine takes over, and copied back on Resume, so
+// a suspended routine costs as much memory as its frames really use. The
+// stack must not change while routines still run on it, and the ucontext
+// backend does not support this mode, false is returned in both cases.
+inline bool SetSharedStack(size_t size) {
+#ifdef CORO_USE_UCONTEXT
+    (void)size;
+    return false;
+#else
+    Ordinator &ordinator = LocalOrdinator();
+    if (ordinator.shared_routines != 0)
+        return false;
+    if (ordinator.shared_stack.base != nullptr) {
+        ordinator.allocator->Deallocate(ordinator.shared_stack);
+        ordinator.shared_stack = Stack();
+    }
+    if (size != 0)
+        ordinator.shared_stack = ordinator.allocator->Allocate(size);
+    return true;
+#endif
+}
+
+#ifdef CORO_MIGRATION
+// Call the function of the current routine from the routine's own stack,
+// which is what moves with it. Out of line, its frame is left before the
+// last switch while that of Entry never is.
+__attribute__((noinline)) inline void RunMovable() {
+    Ordinator &ordinator = LocalOrdinator();
+    RoutineFunction func(std::move(
+                ordinator.routines.Get(ordinator.current)->func));
+    func();
+}
+#endif
+
 inline void Entry() {
+#ifdef CORO_MIGRATION
+    RunMovable();
+    // wherever it ended up
+    Ordinator &ordinator = LocalOrdinator();
+    Routine *routine = ordinator.routines.Get(ordinator.current);
+#else
+    Ordinator &ordinator = LocalOrdinator();
     routine_t id = ordinator.current;
-    Routine *routine = ordinator.routines[id - 1];
+    Routine *routine = ordinator.routines.Get(id);
     routine->func();
+    routine->func = nullptr;
+#endif
 
     routine->finished = true;
     ordinator.current = 0;
-    ordinator.indexes.push_back(id);
+
+    // nothing returns here, the stack is released once the routine is destroyed
+    SwapContext(&routine->ctx, &ordinator.ctx);
 }
 
+// Run routine id until it yields or returns. Gives 0 if it ran, -1 for an
+// unknown id, -2 once it has finished and -3 while it is suspended waiting
+// for Wake. A routine that yielded is queued as ready again.
 inline int Resume(routine_t id) {
+    Ordinator &ordinator = LocalOrdinator();
     //LOG(INFO) << id;
     assert(ordinator.current == 0);
 
-    Routine* routine = ordinator.routines[id - 1];
-    if (routine == nullptr)
+    Routine *routine = ordinator.routines.Get(id);
+    if (routine == nullptr || !routine->used)
         return -1;
 
     if (routine->finished)
         return -2;
 
-    if (routine->stack == nullptr) {
-        //initializes the structure to the currently active context.
-        //When successful, getcontext() returns 0
-        //On error, return -1 and set errno appropriately.
-        getcontext(&routine->ctx);
-
-        //Before invoking makecontext(), the caller must allocate a new stack
-        //for this context and assign its address to ucp->uc_stack,
-        //and define a successor context and assign its address to ucp->uc_link.
-        routine->stack = new char[ordinator.stack_size];
-        routine->ctx.uc_stack.ss_sp = routine->stack;
-        routine->ctx.uc_stack.ss_size = ordinator.stack_size;
-        routine->ctx.uc_link = &ordinator.ctx;
-        ordinator.current = id;
-
-        //When this context is later activated by swapcontext(), the function entry is called.
-        //When this function returns, the  successor context is activated.
-        //If the successor context pointer is NULL, the thread exits.
-        makecontext(&routine->ctx, reinterpret_cast<void (*)(void)>(Entry), 0);
+    if (routine->blocked) {
+        ordinator.ApplyWakeups();
+        if (routine->blocked)
+            return -3;
+    }
 
-        //The swapcontext() function saves the current context,
-        //and then activates the context of another.
-        swapcontext(&ordinator.ctx, &routine->ctx);
+    ordinator.ready.Remove(id);
+    Stack *stack = &routine->stack;
+    if (routine->shared) {
+        // never with ucontext, see SetSharedStack
+#ifndef CORO_USE_UCONTEXT
+        ordinator.OccupySharedStack(id, routine);
+        stack = &ordinator.shared_stack;
+#endif
     }
-    else {
-        ordinator.current = id;
-        swapcontext(&ordinator.ctx, &routine->ctx);
+    else if (routine->stack.base == nullptr) {
+        //Before the first switch, the caller must provide a new stack
+        //for this context, Entry is called on it once it is activated.
+        routine->stack = ordinator.AcquireStack(routine->stack_size);
+        MakeContext(&routine->ctx, routine->stack.base, routine->stack.size,
+                Entry);
     }
 
+    ordinator.current = id;
+    ActiveStack() = stack;
+    ordinator.slice.Start();
+    //saves the current context, and then activates the context of another.
+    SwapContext(&ordinator.ctx, &routine->ctx);
+#ifdef CORO_CPU_TIME
+    routine->cpu_ticks += ordinator.slice.Elapsed();
+#endif
+    ActiveStack() = nullptr;
+    // yielded, its turn comes again after the others ready now
+    if (!routine->finished && !routine->blocked)
+        ordinator.ready.PushBack(id);
+
     return 0;
 }
 
 inline void Yield() {
+    Ordinator &ordinator = LocalOrdinator();
     routine_t id = ordinator.current;
-    Routine *routine = ordinator.routines[id - 1];
+    Routine *routine = ordinator.routines.Get(id);
     assert(routine != nullptr);
 
-    char *stack_top = routine->stack + ordinator.stack_size;
+    char *stack_top = routine->stack.base + routine->stack.size;
     char stack_bottom = 0;
-    assert(size_t(stack_top - &stack_bottom) <= ordinator.stack_size);
+    assert(size_t(stack_top - &stack_bottom) <= routine->stack.size);
 
     ordinator.current = 0;
-    swapcontext(&routine->ctx , &ordinator.ctx);
+    SwapContext(&routine->ctx, &ordinator.ctx);
 }
 
 inline routine_t Current() {
-    return ordinator.current;
+    return LocalOrdinator().current;
 }
 
-template<typename Function>
-inline typename std::result_of<Function()>::type
-Await(Function &&func) {
-    auto future = std::async(std::launch::async, func);
-    std::future_status status = future.wait_for(std::chrono::milliseconds(0));
+#endif
 
-    while (status == std::future_status::timeout) {
-        if (ordinator.current != 0)
-            Yield();
+// the current routine, for Wake from any thread
+inline Handle Self() {
+    Ordinator &ordinator = LocalOrdinator();
+    Handle handle = {&ordinator, ordinator.current};
+    return handle;
+}
+
+// Yield and stay away until Wake is called for the current routine. Wakeups
+// may be spurious, a routine left over from an earlier wait or sharing a
+// recycled id can be woken early, so always suspend in a loop checking the
+// condition waited for.
+inline void Suspend() {
+    Ordinator &ordinator = LocalOrdinator();
+    Routine *routine = ordinator.routines.Get(ordinator.current);
+    assert(routine != nullptr);
+    routine->blocked = true;
+    Yield();
+}
+
+// Make a suspended routine runnable again, from any thread.
+inline void Wake(const Handle &handle) {
+    Ordinator &ordinator = LocalOrdinator();
+    if (handle.ordinator == &ordinator)
+        ordinator.Unblock(handle.id);
+    else
+        handle.ordinator->wakeups.Post(handle.id);
+}
+
+// Queue routines woken up from other threads as ready.
+inline void ApplyWakeups() {
+    LocalOrdinator().ApplyWakeups();
+}
+
+// Take the routine of this thread that became ready first, 0 if none is.
+// Routines are ready once created, after they yielded and when woken up, so
+// a scheduler resuming only these never looks at suspended ones; wakeups
+// from other threads, timers and I/O have to be applied first.
+inline routine_t NextReady() {
+    return LocalOrdinator().ready.PopFront();
+}
+
+inline size_t ReadyCount() {
+    return LocalOrdinator().ready.Size();
+}
+
+// Unpark parker whenever a routine of the calling thread is woken up from
+// another thread, for schedulers that sleep while every routine is suspended.
+inline void SetWakeupParker(Parker *parker) {
+    LocalOrdinator().wakeups.SetParker(parker);
+}
 
-        status = future.wait_for(std::chrono::milliseconds(0));
+// Class of routine id of this thread from now on, a ready one is queued
+// again in it. Does nothing for ids that are not in use.
+inline void SetPriority(routine_t id, Priority priority) {
+    Ordinator &ordinator = LocalOrdinator();
+    Routine *routine = ordinator.routines.Get(id);
+    if (routine == nullptr || !routine->used || routine->priority == priority)
+        return;
+    if (!routine->ready) {
+        routine->priority = priority;
+        return;
     }
-    return future.get();
+    ordinator.ready.Remove(id);
+    routine->priority = priority;
+    ordinator.ready.PushBack(id);
+}
+
+// class of the current routine, it is queued in it whenever it is ready
+// again
+inline void SetPriority(Priority priority) {
+    SetPriority(LocalOrdinator().current, priority);
+}
+
+inline Priority GetPriority() {
+    Ordinator &ordinator = LocalOrdinator();
+    Routine *routine = ordinator.routines.Get(ordinator.current);
+    return routine != nullptr ? routine->priority : Priority::kNormal;
+}
+
+// Let a less urgent ready routine of this thread run after limit resumes of
+// more urgent ones, 0 to never, see ReadyQueue.
+inline void SetStarvationLimit(size_t limit) {
+    LocalOrdinator().ready.SetStarvationLimit(limit);
+}
+
+// Yield if the current routine has been running for its time slice, for
+// loops that would otherwise keep their thread to themselves; cheap enough
+// to call every iteration. Gives whether it yielded.
+inline bool MaybeYield() {
+    Ordinator &ordinator = LocalOrdinator();
+    if (ordinator.current == 0 || !ordinator.slice.IsOver())
+        return false;
+    Yield();
+    return true;
 }
 
+// how long routines of this thread run before MaybeYield yields
+inline void SetTimeSlice(std::chrono::microseconds slice) {
+    const uint64_t length = CycleClock::FromMicroseconds(slice);
+    LocalOrdinator().slice.length = length != 0 ? length : 1;
+}
+
+#ifdef CORO_CPU_TIME
+// Time routine id of this thread has been running, the current routine by
+// default. Counts wall time between its resume and its yield, including
+// time the OS gave its thread's CPU to others. Built with CORO_CPU_TIME
+// only, that reads the clock twice per switch.
+inline std::chrono::nanoseconds CpuTime(routine_t id = 0) {
+    Ordinator &ordinator = LocalOrdinator();
+    if (id == 0)
+        id = ordinator.current;
+    Routine *routine = ordinator.routines.Get(id);
+    if (routine == nullptr || !routine->used)
+        return std::chrono::nanoseconds(0);
+    uint64_t ticks = routine->cpu_ticks;
+    if (id == ordinator.current)
+        ticks += ordinator.slice.Elapsed();
+    return CycleClock::ToNanoseconds(ticks);
+}
 #endif
 
-template<typename Type>
-class Channel {
-public:
-    Channel() {
-        taker_ = 0;
-    }
+namespace detail {
+
+// for preemption.h: whether a timer expires the slices of this thread, and
+// the expiry, safe in a signal handler of a thread whose slice is in use
+inline void SetSliceSignalled(bool signalled) {
+    Ordinator &ordinator = LocalOrdinator();
+    ordinator.slice.signalled = signalled;
+    ordinator.slice.expired.store(false, std::memory_order_relaxed);
+}
+
+inline void ExpireSlice() {
+    LocalOrdinator().slice.expired.store(true, std::memory_order_relaxed);
+}
 
-    Channel(routine_t id) {
-        taker_ = id;
+}  // namespace detail
+
+// Id of the current routine that stays the same when it moves to another
+// thread, see MigrationPoint. Handed out on first use.
+inline GlobalHandle GlobalSelf() {
+    Ordinator &ordinator = LocalOrdinator();
+    Routine *routine = ordinator.routines.Get(ordinator.current);
+    assert(routine != nullptr);
+    if (routine->global == 0) {
+        Handle handle = {&ordinator, ordinator.current};
+        routine->global = detail::Directory::Get().Add(handle);
     }
+    GlobalHandle global = {routine->global};
+    return global;
+}
+
+/*!
+ * \brief Wake the routine wherever it lives now, from any thread. Given a
+ * target, a routine waiting in Park goes on from the thread of target, which
+ * must outlive the call. False once the routine is gone.
+ */
+inline bool Wake(const GlobalHandle &global, Ordinator *target = nullptr) {
+    Ordinator &ordinator = LocalOrdinator();
+    return detail::Directory::Get().With(global.id,
+            [&ordinator, target](const Handle &handle) {
+        if (handle.ordinator == &ordinator && target == nullptr)
+            ordinator.Unblock(handle.id);
+        else
+            handle.ordinator->wakeups.Post(handle.id, target);
+    });
+}
 
-    inline void Consumer(routine_t id) {
-        taker_ = id;
+// Yield and let the scheduler move the routine to another thread. Its
+// routine_t and Handle change when it moves, references to thread_locals
+// taken before must not be used after; GlobalSelf stays. A plain Yield
+// without CORO_MIGRATION.
+inline void MigrationPoint() {
+    Ordinator &ordinator = LocalOrdinator();
+    Routine *routine = ordinator.routines.Get(ordinator.current);
+    assert(routine != nullptr);
+    routine->movable = true;
+    Yield();
+    Ordinator &now = LocalOrdinator();
+    now.routines.Get(now.current)->movable = false;
+}
+
+// Suspend like Suspend does, Wake(GlobalSelf(), target) may resume the
+// routine on the thread of target.
+inline void Park() {
+    Ordinator &ordinator = LocalOrdinator();
+    Routine *routine = ordinator.routines.Get(ordinator.current);
+    assert(routine != nullptr);
+    routine->movable = true;
+    Suspend();
+    Ordinator &now = LocalOrdinator();
+    now.routines.Get(now.current)->movable = false;
+}
+
+// Move up to max routines of this thread that are ready at a MigrationPoint
+// to the thread of target, the least urgent and newest first, gives how many
+// moved.
+inline size_t MoveReady(Ordinator *target, size_t max) {
+    return LocalOrdinator().MoveReady(target, max);
+}
+
+// Tell hooks about routines moving away from or arriving at this thread,
+// nullptr to stop. Moved routines arrive with ApplyWakeups.
+inline void SetMigrationHooks(MigrationHooks *hooks) {
+    LocalOrdinator().hooks = hooks;
+}
+
+// Refuse routines moved to this thread from now on, they stay where they
+// were. False while some are on their way, ApplyWakeups takes them in;
+// threads that may be a target call it until true before they end.
+inline bool CloseToMoves() {
+    return LocalOrdinator().wakeups.Close();
+}
+
+// Wake the current routine at deadline, replacing a timer it may have
+// already. Every routine has exactly one timer, it lives in the routine's
+// slot, so arming it never allocates.
+inline void StartTimer(Clock::time_point deadline) {
+    Ordinator &ordinator = LocalOrdinator();
+    Routine *routine = ordinator.routines.Get(ordinator.current);
+    assert(routine != nullptr);
+    if (routine->timer.IsLinked())
+        ordinator.timers.Remove(&routine->timer);
+    routine->timer.data = ordinator.current;
+    // round up, firing early would cut a sleep short
+    const auto tick = std::chrono::microseconds(TIMER_RESOLUTION_US);
+    ordinator.timers.Add(&routine->timer, uint64_t(
+                (deadline.time_since_epoch() + tick - Clock::duration(1)) /
+                tick));
+}
+
+// the timer of the current routine has not fired yet
+inline bool TimerPending() {
+    Ordinator &ordinator = LocalOrdinator();
+    Routine *routine = ordinator.routines.Get(ordinator.current);
+    return routine != nullptr && routine->timer.IsLinked();
+}
+
+inline void StopTimer() {
+    Ordinator &ordinator = LocalOrdinator();
+    Routine *routine = ordinator.routines.Get(ordinator.current);
+    if (routine != nullptr && routine->timer.IsLinked())
+        ordinator.timers.Remove(&routine->timer);
+}
+
+// Wake routines of this thread whose timers are due, gives how many.
+// Processors do this every round, threads resuming routines by hand have to
+// call it themselves.
+inline size_t ExpireTimers() {
+    return LocalOrdinator().ExpireTimers();
+}
+
+// time until ExpireTimers may have something to do, for sleeping schedulers
+inline std::chrono::nanoseconds NextTimerIn() {
+    Ordinator &ordinator = LocalOrdinator();
+    uint64_t ticks = ordinator.timers.TicksUntilNext();
+    if (ticks == UINT64_MAX)
+        return std::chrono::nanoseconds::max();
+    Clock::time_point at(std::chrono::microseconds(TIMER_RESOLUTION_US) *
+            (ordinator.timers.Now() + ticks));
+    auto now = Clock::now();
+    if (at <= now)
+        return std::chrono::nanoseconds(0);
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(at - now);
+}
+
+// Suspend the current routine until deadline, other routines keep running.
+// Outside of a routine the thread sleeps.
+inline void SleepUntil(Clock::time_point deadline) {
+    if (Current() == 0) {
+        std::this_thread::sleep_until(deadline);
+        return;
     }
+    StartTimer(deadline);
+    while (TimerPending())
+        Suspend();
+}
+
+template<typename Rep, typename Period>
+inline void SleepFor(const std::chrono::duration<Rep, Period> &duration) {
+    SleepUntil(Clock::now() +
+            std::chrono::duration_cast<Clock::duration>(duration));
+}
+
+class TimeoutError : public std::runtime_error {
+public:
+    explicit TimeoutError(const char *what) : std::runtime_error(what) {}
+};
 
-    inline void Push(const Type &obj) {
-        list_.push_back(obj);
-        if (taker_ && taker_ != Current())
-            Resume(taker_);
+// parks threads that wait outside of routines
+CORO_TLS_ACCESSOR inline Parker &ThreadParker() {
+    CORO_TLS_FENCE();
+    thread_local Parker parker;
+    return parker;
+}
+
+// One blocking wait of a routine, or of a thread outside of routines, that
+// any thread can end. Whoever wants to end it claims it first, so that of
+// several wakers, or a waker and the timeout, exactly one wins; the winner
+// hands over its result and then calls Notify. Neither may touch the waiter
+// after Notify, the waiting side frees it as soon as it sees the state.
+class Waiter {
+public:
+    Waiter() : parker_(nullptr), fired_(-1), state_(kNotified) {
+        handle_.ordinator = nullptr;
+        handle_.id = 0;
     }
 
-    inline void Push(Type &&obj) {
-        list_.push_back(std::move(obj));
-        if (taker_ && taker_ != Current())
-            Resume(taker_);
+    /*!
+     * \brief Arm for the calling routine or thread.
+     */
+    inline void Prepare() {
+        handle_ = Self();
+        parker_ = handle_.id == 0 ? &ThreadParker() : nullptr;
+        fired_ = -1;
+        state_.store(kWaiting, std::memory_order_relaxed);
     }
 
-    inline bool Pop(Type& obj) {
-        if (!taker_)
-            taker_ = Current();
-        while (list_.empty() && !closed_.load(std::memory_order_release))
-            Yield();
-        if (list_.empty() && closed_.load(std::memory_order_release)) {
+    /*!
+     * \brief Win the right to end the wait, recording which of the sources
+     * waited on ended it.
+     */
+    inline bool TryClaim(int source = 0) {
+        int expected = kWaiting;
+        if (!state_.compare_exchange_strong(expected, kClaimed,
+                    std::memory_order_acquire, std::memory_order_relaxed))
             return false;
+        fired_ = source;
+        return true;
+    }
+
+    inline void Notify() {
+        Handle handle = handle_;
+        Parker *parker = parker_;
+        state_.store(kNotified, std::memory_order_release);
+        if (parker != nullptr)
+            parker->Unpark();
+        else
+            Wake(handle);
+    }
+
+    /*!
+     * \brief Block until notified, true, or until deadline passed without
+     * anybody claiming the wait, false.
+     */
+    inline bool Wait(Clock::time_point deadline = Clock::time_point::max()) {
+        const bool timed = deadline != Clock::time_point::max();
+        if (parker_ == nullptr) {
+            if (timed)
+                StartTimer(deadline);
+            while (state_.load(std::memory_order_acquire) != kNotified) {
+                if (timed && !TimerPending() && Cancel())
+                    return false;
+                Suspend();
+            }
+            if (timed)
+                StopTimer();
+            return true;
+        }
+        while (state_.load(std::memory_order_acquire) != kNotified) {
+            if (!timed) {
+                parker_->Park();
+                continue;
+            }
+            auto now = Clock::now();
+            if (now >= deadline && Cancel())
+                return false;
+            parker_->ParkFor(deadline > now ? deadline - now :
+                    Clock::duration(0));
         }
-        obj = std::move(list_.front());
-        list_.pop_front();
         return true;
     }
-    inline void Close() {
-        closed_.store(true, std::memory_order_release);
+
+    // the source passed to the successful TryClaim
+    inline int Fired() const {
+        return fired_;
     }
-    inline void Clear() {
-        list_.clear();
+
+private:
+    static const int kWaiting = 0;
+    static const int kClaimed = 1;
+    static const int kNotified = 2;
+    static const int kCancelled = 3;
+
+    inline bool Cancel() {
+        int expected = kWaiting;
+        return state_.compare_exchange_strong(expected, kCancelled,
+                std::memory_order_acquire, std::memory_order_relaxed);
     }
 
-    inline void Touch() {
-        if (taker_ && taker_ != Current())
-            Resume(taker_);
+    Handle handle_;
+    Parker *parker_;
+    int fired_;
+    std::atomic<int> state_;
+    Waiter(const Waiter&) = delete;
+};
+
+namespace detail {
+
+template<typename R>
+class AwaitResult {
+public:
+    AwaitResult() : set_(false) {}
+    ~AwaitResult() {
+        if (set_)
+            Value().~R();
     }
+    template<typename F>
+    inline void Set(F &f) {
+        new (&storage_) R(f());
+        set_ = true;
+    }
+    inline R Get() {
+        return std::move(Value());
+    }
+private:
+    inline R &Value() {
+        return *reinterpret_cast<R *>(&storage_);
+    }
+    AlignedCharArrayUnion<R> storage_;
+    bool set_;
+};
 
-    inline size_t Size() {
-        return list_.size();
+template<typename R>
+class AwaitResult<R &> {
+public:
+    template<typename F>
+    inline void Set(F &f) {
+        value_ = &f();
     }
+    inline R &Get() {
+        return *value_;
+    }
+private:
+    R *value_;
+};
 
-    inline bool IsEmpty() {
-        return list_.empty();
+template<>
+class AwaitResult<void> {
+public:
+    template<typename F>
+    inline void Set(F &f) {
+        f();
+    }
+    inline void Get() {}
+};
+
+// Lives on the heap rather than on the waiting routine's stack, which may be
+// the shared one and hold another routine's frames while this one waits.
+// Owned by the pool thread and the waiter, a waiter that timed out leaves
+// it to the call still running.
+template<typename Function>
+struct AwaitState {
+    typedef typename std::result_of<Function()>::type Result;
+
+    Function func;
+    AwaitResult<Result> result;
+    std::exception_ptr error;
+    std::atomic<bool> done;
+    std::atomic<int> refs;
+    Handle waiter;
+
+    template<typename F>
+    AwaitState(F &&f, const Handle &handle) : func(std::forward<F>(f)),
+            done(false), refs(2), waiter(handle) {}
+
+    // hand func over to the pool, the returned state has to be released
+    template<typename F>
+    static AwaitState *Start(F &&f) {
+        AwaitState *state = new AwaitState(std::forward<F>(f), Self());
+        try {
+            BlockingPool::Default().Submit([state] { state->Run(); });
+        }
+        catch (...) {
+            delete state;
+            throw;
+        }
+        return state;
+    }
+
+    // runs on the blocking pool
+    inline void Run() {
+        try {
+            result.Set(func);
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+        done.store(true, std::memory_order_release);
+        Wake(waiter);
+        Release();
+    }
+
+    inline Result Get() {
+        if (error)
+            std::rethrow_exception(error);
+        return result.Get();
+    }
+
+    inline void Release() {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete this;
+    }
+
+    struct Releaser {
+        inline void operator()(AwaitState *state) const {
+            state->Release();
+        }
+    };
+    typedef std::unique_ptr<AwaitState, Releaser> Ref;
+};
+
+}  // namespace detail
+
+// Run a blocking call on BlockingPool::Default() and suspend the calling
+// routine until it returns, without polling. Exceptions thrown by func are
+// rethrown here. Outside of a routine func simply runs on the caller.
+template<typename Function>
+inline typename std::result_of<typename std::decay<Function>::type()>::type
+Await(Function &&func) {
+    typedef detail::AwaitState<typename std::decay<Function>::type> State;
+    if (Current() == 0)
+        return func();
+    typename State::Ref state(State::Start(std::forward<Function>(func)));
+    while (!state->done.load(std::memory_order_acquire))
+        Suspend();
+    return state->Get();
+}
+
+// Await giving up after timeout with TimeoutError. The call itself can not
+// be interrupted, it keeps its pool thread until it returns and its result
+// is dropped. Outside of a routine there is no timeout.
+template<typename Function>
+inline typename std::result_of<typename std::decay<Function>::type()>::type
+Await(Function &&func, std::chrono::nanoseconds timeout) {
+    typedef detail::AwaitState<typename std::decay<Function>::type> State;
+    if (Current() == 0)
+        return func();
+    typename State::Ref state(State::Start(std::forward<Function>(func)));
+    StartTimer(Clock::now() + timeout);
+    while (!state->done.load(std::memory_order_acquire) && TimerPending())
+        Suspend();
+    StopTimer();
+    if (!state->done.load(std::memory_order_acquire))
+        throw TimeoutError("coro::Await timed out");
+    return state->Get();
+}
+
+// SpinLock for state shared by coroutines. A coroutine that finds it held
+// yields instead of spinning, the holder may be a coroutine suspended on the
+// same thread which could never release it otherwise. Outside of coroutines
+// it behaves like SpinLock.
+class YieldingSpinLock {
+public:
+    YieldingSpinLock() = default;
+    ~YieldingSpinLock() = default;
+
+    inline void lock() {
+        if (lock_.try_lock())
+            return;
+        if (Current() == 0) {
+            lock_.lock();
+            return;
+        }
+        while (!lock_.try_lock())
+            Yield();
+    }
+
+    inline bool try_lock() {
+        return lock_.try_lock();
+    }
+
+    inline void unlock() {
+        lock_.unlock();
     }
 
 private:
-    std::list<Type> list_;
-    routine_t taker_;
-    std::atomic<bool> closed_;
+    ::SpinLock lock_;
+    YieldingSpinLock(const YieldingSpinLock&) = delete;
 };
 
 }
+
+#include "channel.h"
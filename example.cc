@@ -13,6 +13,7 @@ void Print(int  k) {
         log_lock.unlock();
         // remember yield may be useful when you want to use pool, but is not compulisive,
         // it can imporve concurency in many cases
+        // a long loop that never yields can call coro::MaybeYield() every iteration
         coro::Yield();
     }
 }
@@ -0,0 +1,23 @@
+#pragma once
+// Thin wrappers around the linux futex syscall, the building block of the
+// sleeping paths of Parker and SpinLock. Not available on other systems.
+#ifdef __linux__
+#include <atomic>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// sleep while *addr == expected, until woken up or timeout passed
+inline void FutexWait(std::atomic<int> *addr, int expected,
+        const struct timespec *timeout = nullptr) {
+    syscall(SYS_futex, reinterpret_cast<int *>(addr), FUTEX_WAIT_PRIVATE,
+            expected, timeout, nullptr, 0);
+}
+
+// wake up to count threads sleeping on addr
+inline void FutexWake(std::atomic<int> *addr, int count = 1) {
+    syscall(SYS_futex, reinterpret_cast<int *>(addr), FUTEX_WAKE_PRIVATE,
+            count, nullptr, nullptr, 0);
+}
+#endif
@@ -0,0 +1,496 @@
+#pragma once
+// Futures for the results of tasks, see ProcessorPool::Submit.
+//
+// A future and whoever completes it share one reference counted state that
+// holds the result, or the exception, next to the task itself, so a
+// submitted task costs a single allocation. Get and Wait suspend the
+// calling routine, or park the thread outside of routines, until the result
+// is there. Then chains a continuation, which is handed to the executor of
+// the future by the thread completing it; for a pool that is the processor
+// that ran the task, since AddTask from inside a task queues locally.
+//
+// A worker of a pool blocking in Get or Wait would keep the task it waits
+// for from running if that is queued behind it, so the pool is told through
+// BlockingHooks and starts another worker meanwhile.
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "coroutine.h"
+
+namespace coro {
+
+// Somewhere to run tasks, the pool futures schedule continuations on.
+class Executor {
+public:
+    virtual ~Executor() {}
+    virtual void Execute(UniqueTask task) = 0;
+};
+
+// Told when a routine of the calling thread is about to block on a future,
+// and, if OnBlocking returned true, once it goes on, see SetBlockingHooks.
+class BlockingHooks {
+public:
+    virtual ~BlockingHooks() {}
+    virtual bool OnBlocking() = 0;
+    virtual void OnUnblocked() = 0;
+};
+
+template<typename T> class Future;
+
+namespace detail {
+
+CORO_TLS_ACCESSOR inline BlockingHooks *&LocalBlockingHooks() {
+    CORO_TLS_FENCE();
+    thread_local BlockingHooks *hooks = nullptr;
+    return hooks;
+}
+
+template<typename T> class WhenAllState;
+template<typename T> class WhenAnyState;
+
+// told once the state it listens to is ready, by the thread making it so
+class FutureListener {
+public:
+    FutureListener() : next_listener(nullptr) {}
+    virtual ~FutureListener() {}
+    virtual void OnReady() = 0;
+
+    FutureListener *next_listener;
+};
+
+template<typename T>
+class FutureState {
+public:
+    FutureState(Executor *executor, int refs) : flags_(0),
+            listeners_(nullptr), refs_(refs), executor_(executor) {}
+    virtual ~FutureState() {}
+
+    // complete with what f returns or throws, only once
+    template<typename F>
+    inline void SetWith(F &f) {
+        try {
+            result_.Set(f);
+        }
+        catch (...) {
+            error_ = std::current_exception();
+        }
+        Complete();
+    }
+
+    inline bool IsReady() const {
+        return (flags_.load(std::memory_order_acquire) & kReady) != 0;
+    }
+
+    /*!
+     * \brief Block until ready or until deadline, true if ready. Only the
+     * owner of the future waits, one wait at a time.
+     */
+    inline bool Wait(Clock::time_point deadline) {
+        if (IsReady())
+            return true;
+        waiter_.Prepare();
+        if (flags_.fetch_or(kWaiter, std::memory_order_acq_rel) & kReady)
+            return true;
+        // the routine is woken on this thread, the hooks stay the same
+        BlockingHooks *hooks = LocalBlockingHooks();
+        const bool told = hooks != nullptr && hooks->OnBlocking();
+        const bool notified = waiter_.Wait(deadline);
+        if (told)
+            hooks->OnUnblocked();
+        if (notified)
+            return true;
+        flags_.fetch_and(~kWaiter, std::memory_order_acq_rel);
+        return IsReady();
+    }
+
+    // once ready, rethrows what the task threw
+    inline T Get() {
+        if (error_)
+            std::rethrow_exception(error_);
+        return result_.Get();
+    }
+
+    /*!
+     * \brief Call listener->OnReady once ready, right away if it is.
+     */
+    inline void AddListener(FutureListener *listener) {
+        FutureListener *head = listeners_.load(std::memory_order_acquire);
+        do {
+            if (head == Closed()) {
+                listener->OnReady();
+                return;
+            }
+            listener->next_listener = head;
+        } while (!listeners_.compare_exchange_weak(head, listener,
+                    std::memory_order_acq_rel, std::memory_order_acquire));
+    }
+
+    inline Executor *GetExecutor() const {
+        return executor_;
+    }
+
+    inline void Release() {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete this;
+    }
+
+    struct Releaser {
+        inline void operator()(FutureState *state) const {
+            state->Release();
+        }
+    };
+    typedef std::unique_ptr<FutureState, Releaser> Ref;
+
+private:
+    static const int kReady = 1;
+    static const int kWaiter = 2;
+
+    // listeners_ once the listeners were told
+    static inline FutureListener *Closed() {
+        static char closed;
+        return reinterpret_cast<FutureListener *>(&closed);
+    }
+
+    inline void Complete() {
+        int flags = flags_.fetch_or(kReady, std::memory_order_acq_rel);
+        if ((flags & kWaiter) != 0 && waiter_.TryClaim())
+            waiter_.Notify();
+        FutureListener *listener = listeners_.exchange(Closed(),
+                std::memory_order_acq_rel);
+        while (listener != nullptr) {
+            FutureListener *next = listener->next_listener;
+            listener->OnReady();
+            listener = next;
+        }
+    }
+
+    AwaitResult<T> result_;
+    std::exception_ptr error_;
+    std::atomic<int> flags_;
+    std::atomic<FutureListener *> listeners_;
+    std::atomic<int> refs_;
+    Waiter waiter_;
+    Executor *executor_;
+    FutureState(const FutureState&) = delete;
+};
+
+// state of a submitted task, owned by the future and the queued task
+template<typename T, typename Function>
+class FutureTask : public FutureState<T> {
+public:
+    template<typename F>
+    FutureTask(Executor *executor, F &&f) : FutureState<T>(executor, 2),
+            func_(std::forward<F>(f)) {}
+
+    inline void Run() {
+        this->SetWith(func_);
+        this->Release();
+    }
+
+private:
+    Function func_;
+};
+
+// calls a continuation with the result of the state it follows
+template<typename T, typename Function>
+struct Continue {
+    typedef typename std::result_of<Function(T)>::type Result;
+    static inline Result Call(Function &f, FutureState<T> *parent) {
+        return f(parent->Get());
+    }
+};
+
+template<typename Function>
+struct Continue<void, Function> {
+    typedef typename std::result_of<Function()>::type Result;
+    static inline Result Call(Function &f, FutureState<void> *parent) {
+        parent->Get();
+        return f();
+    }
+};
+
+// state of a Then, owned by its future and, until it ran, by itself; it
+// owns the state it follows
+template<typename T, typename Function>
+class ThenState : public FutureState<typename Continue<T, Function>::Result>,
+        public FutureListener {
+public:
+    typedef typename Continue<T, Function>::Result Result;
+
+    template<typename F>
+    ThenState(FutureState<T> *parent, F &&f) :
+            FutureState<Result>(parent->GetExecutor(), 2), parent_(parent),
+            func_(std::forward<F>(f)) {}
+
+    inline void Attach() {
+        parent_->AddListener(this);
+    }
+
+    virtual void OnReady() {
+        Executor *executor = this->GetExecutor();
+        if (executor == nullptr) {
+            Run();
+            return;
+        }
+        ThenState *self = this;
+        executor->Execute([self] { self->Run(); });
+    }
+
+private:
+    inline void Run() {
+        // a failed parent skips func, its exception moves on
+        auto call = [this]() -> Result {
+            return Continue<T, Function>::Call(func_, parent_);
+        };
+        this->SetWith(call);
+        parent_->Release();
+        parent_ = nullptr;
+        this->Release();
+    }
+
+    FutureState<T> *parent_;
+    Function func_;
+};
+
+}  // namespace detail
+
+// Tell hooks about routines of the calling thread blocking on futures,
+// nullptr for nobody.
+inline void SetBlockingHooks(BlockingHooks *hooks) {
+    detail::LocalBlockingHooks() = hooks;
+}
+
+template<typename T>
+class Future {
+public:
+    Future() : state_(nullptr) {}
+
+    // adopts a reference to state
+    explicit Future(detail::FutureState<T> *state) : state_(state) {}
+
+    Future(Future &&other) : state_(other.state_) {
+        other.state_ = nullptr;
+    }
+
+    Future &operator=(Future &&other) {
+        if (this != &other) {
+            Reset();
+            state_ = other.state_;
+            other.state_ = nullptr;
+        }
+        return *this;
+    }
+
+    ~Future() {
+        Reset();
+    }
+
+    // false once Get or Then consumed it, or if default constructed
+    inline bool Valid() const {
+        return state_ != nullptr;
+    }
+
+    inline bool IsReady() const {
+        return state_->IsReady();
+    }
+
+    /*!
+     * \brief Block until the result is there, suspending the calling
+     * routine, or parking the thread outside of routines.
+     */
+    inline void Wait() const {
+        state_->Wait(Clock::time_point::max());
+    }
+
+    // Wait giving up after timeout, false then
+    template<typename Rep, typename Period>
+    inline bool WaitFor(const std::chrono::duration<Rep, Period> &timeout)
+            const {
+        return state_->Wait(Clock::now() +
+                std::chrono::duration_cast<Clock::duration>(timeout));
+    }
+
+    /*!
+     * \brief Wait, then hand out the result or rethrow the exception of the
+     * task. The future is invalid afterwards.
+     */
+    inline T Get() {
+        Wait();
+        typename detail::FutureState<T>::Ref state(state_);
+        state_ = nullptr;
+        return state->Get();
+    }
+
+    /*!
+     * \brief Future of f called with the result once it is there, f runs
+     * on the executor the result came from, or on the completing thread if
+     * there is none. If the task threw, f is skipped and the exception
+     * passed on. Consumes this future.
+     */
+    template<typename F>
+    inline Future<typename detail::Continue<T,
+           typename std::decay<F>::type>::Result> Then(F &&f) {
+        typedef detail::ThenState<T, typename std::decay<F>::type> State;
+        State *next = new State(state_, std::forward<F>(f));
+        state_ = nullptr;
+        Future<typename State::Result> future(next);
+        // the parent keeps next alive until it told it
+        next->Attach();
+        return future;
+    }
+
+private:
+    template<typename> friend class Future;
+    template<typename> friend class detail::WhenAllState;
+    template<typename> friend class detail::WhenAnyState;
+
+    inline void Reset() {
+        if (state_ != nullptr)
+            state_->Release();
+        state_ = nullptr;
+    }
+
+    detail::FutureState<T> *state_;
+};
+
+// what WhenAny hands out, index is the first ready one
+template<typename T>
+struct WhenAnyResult {
+    size_t index;
+    std::vector<Future<T>> futures;
+};
+
+namespace detail {
+
+template<typename T>
+class WhenAllState : public FutureState<std::vector<Future<T>>> {
+public:
+    explicit WhenAllState(std::vector<Future<T>> &&futures) :
+            FutureState<std::vector<Future<T>>>(
+                futures.empty() ? nullptr : futures[0].state_->GetExecutor(),
+                2),
+            futures_(std::move(futures)), listeners_(futures_.size()),
+            remaining_(futures_.size() + 1) {
+        for (size_t i = 0; i < futures_.size(); i++) {
+            listeners_[i].owner = this;
+            listeners_[i].input = futures_[i].state_;
+        }
+    }
+
+    // the extra count is Attach itself, inputs ready before the last one
+    // is attached can not complete the state
+    inline void Attach() {
+        for (auto& listener : listeners_)
+            listener.input->AddListener(&listener);
+        CountDown();
+    }
+
+private:
+    struct Listener : public FutureListener {
+        virtual void OnReady() {
+            owner->CountDown();
+        }
+        WhenAllState *owner;
+        FutureState<T> *input;
+    };
+
+    inline void CountDown() {
+        if (remaining_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+        auto take = [this] { return std::move(futures_); };
+        this->SetWith(take);
+        this->Release();
+    }
+
+    std::vector<Future<T>> futures_;
+    std::vector<Listener> listeners_;
+    std::atomic<size_t> remaining_;
+};
+
+template<typename T>
+class WhenAnyState : public FutureState<WhenAnyResult<T>> {
+public:
+    explicit WhenAnyState(std::vector<Future<T>> &&futures) :
+            FutureState<WhenAnyResult<T>>(
+                futures.empty() ? nullptr : futures[0].state_->GetExecutor(),
+                futures.size() + 1),
+            futures_(std::move(futures)), listeners_(futures_.size()),
+            fired_(false) {
+        for (size_t i = 0; i < futures_.size(); i++) {
+            listeners_[i].owner = this;
+            listeners_[i].index = i;
+            listeners_[i].input = futures_[i].state_;
+        }
+    }
+
+    // every input keeps the state alive until it told its listener, the
+    // futures handed out may still be waited on or continued; futures_ is
+    // gone once the first ready input fired
+    inline void Attach() {
+        if (listeners_.empty()) {
+            Fire(static_cast<size_t>(-1));
+            return;
+        }
+        for (auto& listener : listeners_)
+            listener.input->AddListener(&listener);
+    }
+
+private:
+    struct Listener : public FutureListener {
+        virtual void OnReady() {
+            owner->Fire(index);
+            owner->Release();
+        }
+        WhenAnyState *owner;
+        size_t index;
+        FutureState<T> *input;
+    };
+
+    inline void Fire(size_t index) {
+        if (fired_.exchange(true, std::memory_order_acq_rel))
+            return;
+        auto take = [this, index] {
+            return WhenAnyResult<T>{index, std::move(futures_)};
+        };
+        this->SetWith(take);
+    }
+
+    std::vector<Future<T>> futures_;
+    std::vector<Listener> listeners_;
+    std::atomic<bool> fired_;
+};
+
+}  // namespace detail
+
+/*!
+ * \brief Future of all futures once each is ready, handed back in the same
+ * order. Exceptions stay in the futures, for their Get.
+ */
+template<typename T>
+inline Future<std::vector<Future<T>>> WhenAll(
+        std::vector<Future<T>> futures) {
+    auto state = new detail::WhenAllState<T>(std::move(futures));
+    Future<std::vector<Future<T>>> future(state);
+    state->Attach();
+    return future;
+}
+
+/*!
+ * \brief Future of the futures once any of them is ready, with its index,
+ * or index -1 if there are none.
+ */
+template<typename T>
+inline Future<WhenAnyResult<T>> WhenAny(std::vector<Future<T>> futures) {
+    auto state = new detail::WhenAnyState<T>(std::move(futures));
+    Future<WhenAnyResult<T>> future(state);
+    state->Attach();
+    return future;
+}
+
+}  // namespace coro
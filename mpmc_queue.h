@@ -0,0 +1,193 @@
+#pragma once
+// Bounded lock-free multi-producer multi-consumer queue, after Dmitry
+// Vyukov's bounded MPMC queue.
+//
+// Every cell carries a sequence number telling whether it is ready to be
+// written or read for a given position, so producers and consumers only
+// contend on their own position counter. Bulk operations reserve a run of
+// cells with a single CAS of that counter. The capacity is rounded up to a
+// power of two and fixed, TryPush fails and Push waits for room when the
+// queue is full.
+#include <atomic>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <thread>
+#include <utility>
+
+#include "alignof.h"
+
+template<typename T> class BoundedQueue {
+public:
+    static const bool kMultiConsumer = true;
+
+    explicit BoundedQueue(size_t capacity = 4096) {
+        size_t cap = 2;
+        while (cap < capacity)
+            cap <<= 1;
+        mask_ = cap - 1;
+        cells_.reset(new Cell[cap]);
+        for (size_t i = 0; i < cap; i++)
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        enqueue_pos_.store(0, std::memory_order_relaxed);
+        dequeue_pos_.store(0, std::memory_order_relaxed);
+    }
+    ~BoundedQueue() {
+        T value;
+        while (TryPop(value)) {
+        }
+    }
+
+    // value is left alone if the queue is full
+    bool TryPush(T&& value) {
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos);
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                            std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0) {
+                return false;    // full
+            }
+            else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        new (cell->storage.buffer) T(std::move(value));
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    void Push(T new_value) {
+        while (!TryPush(std::move(new_value)))
+            std::this_thread::yield();
+    }
+
+    // push from begin on while there is room, returns where it stopped
+    template<typename Iterator>
+    Iterator TryPushBulk(Iterator begin, Iterator end) {
+        const size_t count = size_t(std::distance(begin, end));
+        if (count == 0)
+            return begin;
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        size_t free;
+        while (true) {
+            // cells free for pos, pos + 1, ... until the first that is not
+            intptr_t diff = 0;
+            for (free = 0; free < count; free++) {
+                size_t seq = cells_[(pos + free) & mask_].sequence.load(
+                        std::memory_order_acquire);
+                diff = intptr_t(seq) - intptr_t(pos + free);
+                if (diff != 0)
+                    break;
+            }
+            if (free == 0 && diff < 0)
+                return begin;    // full
+            if (free == 0) {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (enqueue_pos_.compare_exchange_weak(pos, pos + free,
+                        std::memory_order_relaxed))
+                break;
+        }
+        for (size_t i = 0; i < free; i++, ++begin) {
+            Cell *cell = &cells_[(pos + i) & mask_];
+            new (cell->storage.buffer) T(std::move(*begin));
+            cell->sequence.store(pos + i + 1, std::memory_order_release);
+        }
+        return begin;
+    }
+
+    template<typename Iterator>
+    void PushBulk(Iterator begin, Iterator end) {
+        while (begin != end) {
+            Iterator rest = TryPushBulk(begin, end);
+            if (rest == begin)
+                std::this_thread::yield();
+            begin = rest;
+        }
+    }
+
+    bool TryPop(T& value) {
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                            std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0) {
+                return false;    // empty
+            }
+            else {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        T *slot = reinterpret_cast<T *>(cell->storage.buffer);
+        value = std::move(*slot);
+        slot->~T();
+        cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    // pop up to max values into out, returns how many were popped
+    template<typename OutputIterator>
+    size_t TryPopBulk(OutputIterator out, size_t max) {
+        if (max == 0)
+            return 0;
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        size_t ready;
+        while (true) {
+            // cells written for pos, pos + 1, ... until the first that is not
+            intptr_t diff = 0;
+            for (ready = 0; ready < max; ready++) {
+                size_t seq = cells_[(pos + ready) & mask_].sequence.load(
+                        std::memory_order_acquire);
+                diff = intptr_t(seq) - intptr_t(pos + ready + 1);
+                if (diff != 0)
+                    break;
+            }
+            if (ready == 0 && diff < 0)
+                return 0;    // empty
+            if (ready == 0) {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (dequeue_pos_.compare_exchange_weak(pos, pos + ready,
+                        std::memory_order_relaxed))
+                break;
+        }
+        for (size_t i = 0; i < ready; i++) {
+            Cell *cell = &cells_[(pos + i) & mask_];
+            T *slot = reinterpret_cast<T *>(cell->storage.buffer);
+            *out++ = std::move(*slot);
+            slot->~T();
+            cell->sequence.store(pos + i + mask_ + 1,
+                    std::memory_order_release);
+        }
+        return ready;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        AlignedCharArrayUnion<T> storage;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> enqueue_pos_;
+    alignas(64) std::atomic<size_t> dequeue_pos_;
+    BoundedQueue(const BoundedQueue&) = delete;
+};
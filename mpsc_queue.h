@@ -0,0 +1,139 @@
+#pragma once
+// Unbounded lock-free multi-producer single-consumer queue, after Dmitry
+// Vyukov's intrusive MPSC node queue.
+//
+// A push is one allocation and one exchange, no matter how many producers
+// there are, and a whole batch is linked privately and published with a
+// single exchange. Only one thread at a time may pop. A producer preempted
+// between its exchange and linking the node hides later values from the
+// consumer until it continues, TryPop then reports an empty queue.
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+template<typename T> class MpscQueue {
+public:
+    static const bool kMultiConsumer = false;
+
+    MpscQueue() : head_(&stub_), tail_(&stub_) {
+        stub_.next.store(nullptr, std::memory_order_relaxed);
+    }
+    ~MpscQueue() {
+        T value;
+        while (TryPop(value)) {
+        }
+    }
+
+    void Push(T new_value) {
+        Node *node = new Node(std::move(new_value));
+        Link(node, node);
+    }
+
+    // never full, for code that also takes bounded queues
+    bool TryPush(T&& value) {
+        Push(std::move(value));
+        return true;
+    }
+
+    template<typename Iterator>
+    Iterator TryPushBulk(Iterator begin, Iterator end) {
+        PushBulk(begin, end);
+        return end;
+    }
+
+    template<typename Iterator>
+    void PushBulk(Iterator begin, Iterator end) {
+        if (begin == end)
+            return;
+        Node *first = new Node(std::move(*begin));
+        Node *last = first;
+        for (++begin; begin != end; ++begin) {
+            Node *node = new Node(std::move(*begin));
+            last->next.store(node, std::memory_order_relaxed);
+            last = node;
+        }
+        Link(first, last);
+    }
+
+    bool TryPop(T& value) {
+        Node *tail = tail_;
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (tail == &stub_) {
+            if (next == nullptr)
+                return false;
+            // skip the stub, it only keeps the list non-empty
+            tail_ = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+            tail_ = next;
+            value = std::move(tail->value);
+            delete tail;
+            return true;
+        }
+        if (tail != head_.load(std::memory_order_acquire))
+            return false;    // a producer is in the middle of linking
+        // tail is the last node, put the stub behind it to take it out
+        stub_.next.store(nullptr, std::memory_order_relaxed);
+        Link(&stub_, &stub_);
+        next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr)
+            return false;
+        tail_ = next;
+        value = std::move(tail->value);
+        delete tail;
+        return true;
+    }
+
+    // pop up to max values into out, returns how many were popped; nodes
+    // with a successor are plain loads, only the last one needs TryPop
+    template<typename OutputIterator>
+    size_t TryPopBulk(OutputIterator out, size_t max) {
+        size_t count = 0;
+        while (count < max) {
+            Node *tail = tail_;
+            Node *next = tail->next.load(std::memory_order_acquire);
+            if (tail == &stub_) {
+                if (next == nullptr)
+                    break;
+                tail_ = next;
+                continue;
+            }
+            if (next == nullptr) {
+                T value;
+                if (!TryPop(value))
+                    break;
+                *out++ = std::move(value);
+                count++;
+                continue;
+            }
+            tail_ = next;
+            *out++ = std::move(tail->value);
+            delete tail;
+            count++;
+        }
+        return count;
+    }
+
+private:
+    struct Node {
+        std::atomic<Node *> next;
+        T value;
+
+        Node() : next(nullptr) {}
+        explicit Node(T&& v) : next(nullptr), value(std::move(v)) {}
+    };
+
+    // append the chain first..last, producers may race on this
+    void Link(Node *first, Node *last) {
+        last->next.store(nullptr, std::memory_order_relaxed);
+        Node *prev = head_.exchange(last, std::memory_order_acq_rel);
+        prev->next.store(first, std::memory_order_release);
+    }
+
+    alignas(64) std::atomic<Node *> head_;
+    alignas(64) Node *tail_;
+    Node stub_;
+    MpscQueue(const MpscQueue&) = delete;
+};
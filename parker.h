@@ -0,0 +1,114 @@
+#pragma once
+// Lets a thread sleep until another one has something for it.
+//
+// Unpark leaves a notification behind if the owner is not parked yet, so
+// a Park right after it returns immediately: check for work, then Park, and
+// wakeups can not get lost in between. On linux this is a futex, elsewhere a
+// mutex and condition variable, unless a ParkHook is set.
+#include <atomic>
+#include <chrono>
+
+#ifdef __linux__
+#include "futex.h"
+#else
+#include <condition_variable>
+#include <mutex>
+#endif
+
+// Something else to sleep in while parked, e.g. an epoll_wait that also
+// returns for I/O. Interrupt must make a Sleep in progress, or the next one,
+// return soon.
+class ParkHook {
+public:
+    virtual ~ParkHook() {}
+    virtual void Sleep(std::chrono::nanoseconds timeout) = 0;
+    virtual void Interrupt() = 0;
+};
+
+class Parker {
+public:
+    Parker() : state_(kEmpty), hook_(nullptr) {}
+    ~Parker() = default;
+    /*!
+     * \brief Sleep until Unpark is called, may wake up spuriously.
+     */
+    inline void Park() {
+        ParkFor(std::chrono::nanoseconds::max());
+    }
+    /*!
+     * \brief Like Park, but gives up after timeout.
+     */
+    inline void ParkFor(std::chrono::nanoseconds timeout) {
+        // consume a pending notification, or announce that we sleep
+        if (state_.fetch_sub(1, std::memory_order_acq_rel) == kNotified)
+            return;
+        ParkHook *hook = hook_.load(std::memory_order_relaxed);
+        if (hook != nullptr) {
+            hook->Sleep(timeout);
+            state_.exchange(kEmpty, std::memory_order_acquire);
+            return;
+        }
+#ifdef __linux__
+        if (timeout == std::chrono::nanoseconds::max()) {
+            FutexWait(&state_, kParked);
+        }
+        else {
+            struct timespec ts;
+            ts.tv_sec = time_t(timeout.count() / 1000000000);
+            ts.tv_nsec = long(timeout.count() % 1000000000);
+            FutexWait(&state_, kParked, &ts);
+        }
+#else
+        std::unique_lock<std::mutex> lk(mutex_);
+        if (timeout == std::chrono::nanoseconds::max()) {
+            cond_.wait(lk, [this] {
+                return state_.load(std::memory_order_relaxed) != kParked;
+            });
+        }
+        else {
+            cond_.wait_for(lk, timeout, [this] {
+                return state_.load(std::memory_order_relaxed) != kParked;
+            });
+        }
+#endif
+        state_.exchange(kEmpty, std::memory_order_acquire);
+    }
+    /*!
+     * \brief Wake the owner up, or make its next Park return immediately.
+     */
+    inline void Unpark() {
+        if (state_.exchange(kNotified, std::memory_order_acq_rel) != kParked)
+            return;
+        ParkHook *hook = hook_.load(std::memory_order_acquire);
+        if (hook != nullptr) {
+            hook->Interrupt();
+            return;
+        }
+#ifdef __linux__
+        FutexWake(&state_);
+#else
+        // the owner may be between its check and the wait
+        std::lock_guard<std::mutex> lk(mutex_);
+        cond_.notify_one();
+#endif
+    }
+    /*!
+     * \brief Sleep in hook from now on, nullptr goes back to the default.
+     * Owner only, never while parked.
+     */
+    inline void SetHook(ParkHook *hook) {
+        hook_.store(hook, std::memory_order_release);
+    }
+private:
+    static const int kParked = -1;
+    static const int kEmpty = 0;
+    static const int kNotified = 1;
+
+    std::atomic<int> state_;
+    std::atomic<ParkHook *> hook_;
+#ifndef __linux__
+    std::mutex mutex_;
+    std::condition_variable cond_;
+#endif
+    Parker(const Parker&) = delete;
+};
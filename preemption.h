@@ -0,0 +1,141 @@
+#pragma once
+// A timer per thread that marks the time slice of its running routine as
+// expired, so that MaybeYield only reads that mark instead of the clock.
+//
+// The timer runs on CLOCK_MONOTONIC, a high resolution timer that fires on
+// time rather than at the next scheduler tick, and signals the thread with
+// CORO_PREEMPT_SIGNAL every slice. It is not lined up with the resumes, so
+// a routine runs at most one slice before MaybeYield yields. Nothing is
+// preempted for real: a routine that never calls MaybeYield, Yield or
+// anything suspending keeps running. Blocking calls of the thread may return
+// EINTR when the signal arrives, schedulers pause the timer before they
+// sleep, see PausePreemption. Linux only, elsewhere EnablePreemption fails
+// and MaybeYield reads the clock.
+#include <chrono>
+#include <mutex>
+
+#ifdef __linux__
+#include <csignal>
+#include <ctime>
+#include <cerrno>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "coroutine.h"
+
+// ignored by default and used for nothing else by the runtime
+#ifndef CORO_PREEMPT_SIGNAL
+#define CORO_PREEMPT_SIGNAL SIGURG
+#endif
+
+#if defined(__linux__) && !defined(sigev_notify_thread_id)
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+namespace coro {
+
+namespace detail {
+
+#ifdef __linux__
+inline void OnPreemptSignal(int) {
+    int saved = errno;
+    ExpireSlice();
+    errno = saved;
+}
+
+struct PreemptTimer {
+    timer_t id;
+    struct itimerspec spec;
+    bool created;
+    bool paused;
+};
+
+// timer of the calling thread, created on first use
+CORO_TLS_ACCESSOR inline PreemptTimer &LocalPreemptTimer() {
+    CORO_TLS_FENCE();
+    thread_local PreemptTimer timer = {timer_t(), {}, false, false};
+    return timer;
+}
+#endif
+
+}  // namespace detail
+
+/*!
+ * \brief Expire the time slice of the calling thread's routines every slice,
+ * false if that can not be done. Disable it before the thread exits.
+ */
+inline bool EnablePreemption(std::chrono::microseconds slice) {
+#ifdef __linux__
+    static std::once_flag installed;
+    std::call_once(installed, [] {
+        struct sigaction action = {};
+        action.sa_handler = detail::OnPreemptSignal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(CORO_PREEMPT_SIGNAL, &action, nullptr);
+    });
+    detail::PreemptTimer &timer = detail::LocalPreemptTimer();
+    if (!timer.created) {
+        struct sigevent event = {};
+        event.sigev_notify = SIGEV_THREAD_ID;
+        event.sigev_signo = CORO_PREEMPT_SIGNAL;
+        event.sigev_notify_thread_id = pid_t(syscall(SYS_gettid));
+        if (timer_create(CLOCK_MONOTONIC, &event, &timer.id) != 0)
+            return false;
+        timer.created = true;
+    }
+    // the handler touches the ordinator, which has to exist by then
+    detail::SetSliceSignalled(true);
+    SetTimeSlice(slice);
+    const auto us = slice.count() > 0 ? slice.count() : 1;
+    timer.spec.it_interval.tv_sec = time_t(us / 1000000);
+    timer.spec.it_interval.tv_nsec = long(us % 1000000 * 1000);
+    timer.spec.it_value = timer.spec.it_interval;
+    timer.paused = false;
+    return timer_settime(timer.id, 0, &timer.spec, nullptr) == 0;
+#else
+    (void)slice;
+    return false;
+#endif
+}
+
+/*!
+ * \brief Stop the timer of the calling thread until ResumePreemption, for a
+ * scheduler about to sleep, which it would wake every slice otherwise.
+ */
+inline void PausePreemption() {
+#ifdef __linux__
+    detail::PreemptTimer &timer = detail::LocalPreemptTimer();
+    if (!timer.created || timer.paused)
+        return;
+    struct itimerspec stopped = {};
+    timer_settime(timer.id, 0, &stopped, nullptr);
+    timer.paused = true;
+#endif
+}
+
+// restart a paused timer, it fires a full slice later
+inline void ResumePreemption() {
+#ifdef __linux__
+    detail::PreemptTimer &timer = detail::LocalPreemptTimer();
+    if (!timer.created || !timer.paused)
+        return;
+    timer_settime(timer.id, 0, &timer.spec, nullptr);
+    timer.paused = false;
+#endif
+}
+
+// stop the timer of the calling thread, MaybeYield reads the clock again
+inline void DisablePreemption() {
+#ifdef __linux__
+    detail::PreemptTimer &timer = detail::LocalPreemptTimer();
+    if (!timer.created)
+        return;
+    timer_delete(timer.id);
+    timer.created = false;
+    detail::SetSliceSignalled(false);
+#endif
+}
+
+}  // namespace coro
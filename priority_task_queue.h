@@ -0,0 +1,95 @@
+#pragma once
+// Tasks by class, level 0 being the most urgent, plus tasks with a deadline
+// which are taken earliest deadline first and count as level 0. Any thread
+// may push and pop, counters by level let a look at empty levels skip the
+// locks.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "readwrite_queue.h"
+#include "spinlock.h"
+
+template<typename T, size_t Levels,
+        typename Clock = std::chrono::steady_clock>
+class PriorityTaskQueue {
+public:
+    static const bool kMultiConsumer = true;
+
+    PriorityTaskQueue() {
+        for (size_t level = 0; level < Levels; level++)
+            sizes_[level].store(0, std::memory_order_relaxed);
+    }
+
+    void Push(T new_value, size_t level) {
+        levels_[level].Push(std::move(new_value));
+        sizes_[level].fetch_add(1, std::memory_order_release);
+    }
+
+    void PushDeadline(T new_value, typename Clock::time_point deadline) {
+        {
+            std::lock_guard<SpinLock> lk(deadline_lock_);
+            deadlines_.push_back(Deadline{deadline, std::move(new_value)});
+            std::push_heap(deadlines_.begin(), deadlines_.end(), Later());
+        }
+        sizes_[0].fetch_add(1, std::memory_order_release);
+    }
+
+    // most urgent value of the levels first to last, deadlines included if
+    // first is 0; level tells where it came from
+    bool TryPop(T& value, size_t& level, size_t first, size_t last) {
+        if (first == 0 && sizes_[0].load(std::memory_order_acquire) != 0 &&
+                TryPopDeadline(value)) {
+            level = 0;
+            return true;
+        }
+        for (level = first; level <= last && level < Levels; level++) {
+            if (sizes_[level].load(std::memory_order_acquire) != 0 &&
+                    levels_[level].TryPop(value)) {
+                sizes_[level].fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // nothing is queued at levels up to last
+    bool Empty(size_t last = Levels - 1) const {
+        for (size_t level = 0; level <= last && level < Levels; level++) {
+            if (sizes_[level].load(std::memory_order_acquire) != 0)
+                return false;
+        }
+        return true;
+    }
+private:
+    struct Deadline {
+        typename Clock::time_point when;
+        T value;
+    };
+
+    // min heap by deadline
+    struct Later {
+        bool operator()(const Deadline& a, const Deadline& b) const {
+            return a.when > b.when;
+        }
+    };
+
+    bool TryPopDeadline(T& value) {
+        std::lock_guard<SpinLock> lk(deadline_lock_);
+        if (deadlines_.empty())
+            return false;
+        std::pop_heap(deadlines_.begin(), deadlines_.end(), Later());
+        value = std::move(deadlines_.back().value);
+        deadlines_.pop_back();
+        sizes_[0].fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    ReadWriteQueue<T> levels_[Levels];
+    SpinLock deadline_lock_;
+    std::vector<Deadline> deadlines_;
+    // values pushed and not yet popped by level, deadlines at 0
+    std::atomic<size_t> sizes_[Levels];
+};
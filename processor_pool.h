@@ -1,133 +1,1017 @@
 #pragma once
 #include <iostream>
 #include <thread>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <iterator>
+#include <mutex>
+#include <type_traits>
 
+#include "affinity.h"
 #include "smallvector.h"
 #include "spinlock.h"
+#include "parker.h"
 #include "readwrite_queue.h"
+#include "mpmc_queue.h"
+#include "mpsc_queue.h"
+#include "priority_task_queue.h"
+#include "work_stealing_deque.h"
 #include "coroutine.h"
+#include "future.h"
+#include "preemption.h"
+#ifdef __linux__
+#include "reactor.h"
+#include "uring.h"
+#endif
+
+// how long an idle processor keeps polling before it goes to sleep
+#ifndef PROCESSOR_SPIN_US
+#define PROCESSOR_SPIN_US 50
+#endif
+
+// most workers a processor runs at once when it spawns them per task, and
+// how long those beyond the resident ones stay idle before they return
+#ifndef PROCESSOR_SPAWN_LIMIT
+#define PROCESSOR_SPAWN_LIMIT 10000
+#endif
+#ifndef PROCESSOR_SPAWN_IDLE_MS
+#define PROCESSOR_SPAWN_IDLE_MS 1000
+#endif
 
 namespace coro {
 
-using Task = std::function<void()>;
+using Task = UniqueTask;
 using TaskQueue = ReadWriteQueue<Task>;
 
-class Processor {
+struct PoolOptions {
+    uint64_t num_cores;
+    uint64_t num_workers_per_core;
+    // an idle processor polls for spin_time before it goes to sleep, a
+    // longer time trades cpu for latency when tasks trickle in
+    std::chrono::microseconds spin_time;
+    // idle processors take tasks queued on busy ones, and tasks added from
+    // inside a task stay on the processor running it
+    bool work_stealing;
+    // start another worker whenever a task is queued and no worker is idle,
+    // so that tasks suspended in Await or I/O never hold up the ones queued
+    // behind them; at most spawn_limit run on a processor, and those beyond
+    // num_workers_per_core return after spawn_idle_time without a task
+    bool spawn_per_task;
+    uint64_t spawn_limit;
+    std::chrono::milliseconds spawn_idle_time;
+    // busy processors hand routines waiting at coro::MigrationPoint to idle
+    // ones, their tasks go on there; needs CORO_MIGRATION
+    bool migration;
+    // pin processor i to cpu_sets[i % cpu_sets.size()], or, with pin_threads
+    // and no sets, to the i-th of the CPUs the pool is created on
+    std::vector<std::vector<int>> cpu_sets;
+    bool pin_threads;
+    // build every processor on its own thread once it is pinned, so that
+    // its queues are first touched, and placed, on its NUMA node
+    bool numa_local;
+    // every starvation_limit-th task a processor takes, and every
+    // starvation_limit-th resume of a thread, goes to a less urgent class if
+    // one waits; 0 keeps priorities strict
+    size_t starvation_limit;
+    // coro::MaybeYield yields once a routine ran for time_slice, with
+    // preemption a timer per processor tells it so instead of the clock,
+    // paused while the processor sleeps
+    std::chrono::microseconds time_slice;
+    bool preemption;
+
+    PoolOptions(): num_cores(std::thread::hardware_concurrency()),
+            num_workers_per_core(1U),
+            spin_time(std::chrono::microseconds(PROCESSOR_SPIN_US)),
+            work_stealing(true), spawn_per_task(false),
+            spawn_limit(PROCESSOR_SPAWN_LIMIT),
+            spawn_idle_time(std::chrono::milliseconds(
+                        PROCESSOR_SPAWN_IDLE_MS)),
+            migration(false), pin_threads(false), numa_local(false),
+            starvation_limit(PRIORITY_STARVATION_LIMIT),
+            time_slice(std::chrono::microseconds(TIME_SLICE_US)),
+            preemption(false) {}
+};
+
+// Queue is the type of the shared task queue of every processor, it needs
+// Push, TryPush, TryPop, PushBulk, TryPushBulk, TryPopBulk and a
+// kMultiConsumer flag telling whether other processors may steal from it.
+// ReadWriteQueue, BoundedQueue and MpscQueue all fit.
+template <typename Queue>
+class BasicProcessor : private MigrationHooks, private BlockingHooks {
 private:
-    std::vector<routine_t> workers_;
-    TaskQueue& task_queue_;
-    Channel<Task> tasks_;
+    typedef SmallVector<std::shared_ptr<BasicProcessor>> Peers;
+
+    // fewest resumes between two looks at wakeups, timers and I/O
+    static const size_t kRoundBudget = 64;
+    // most emptied local task cells kept for the next Spawn
+    static const size_t kSpareTasks = 4096;
+
+    struct Worker {
+        Handle handle;
+        // handed over by the processor while the worker was idle
+        Task task;
+        // suspended until there is a task for it
+        bool idle;
+        // class of task, the worker runs in it
+        Priority priority;
+    };
+
+    // indexed by worker, slots of returned workers are reused
+    std::vector<Worker> workers_;
+    std::vector<size_t> free_workers_;
+    // workers waiting for a task, the most recently idle one is woken first
+    std::vector<size_t> idle_workers_;
+    // workers that returned, destroyed after the round
+    std::vector<size_t> exited_;
+    // worker index + 1 by routine id, 0 for routines that are no workers
+    std::vector<size_t> worker_by_id_;
+    uint64_t live_workers_;
+    // workers blocked on a future, others take their place meanwhile
+    uint64_t blocked_;
+    Queue task_queue_;
+    // tasks added with a priority other than normal or with a deadline
+    PriorityTaskQueue<Task, kPriorityLevels> urgent_;
+    // tasks spawned by this processor, the owner takes the newest one,
+    // thieves the oldest
+    WorkStealingDeque<Task*> local_tasks_;
+    // cells of local tasks already run here, or stolen by us
+    std::vector<Task*> spare_tasks_;
+    Parker parker_;
+    const Peers& peers_;
     std::atomic<bool>& stop_;
+    std::atomic<uint64_t>& num_parked_;
+    // processors done with their routines, see Run
+    std::atomic<uint64_t>& num_retired_;
+    uint64_t index_;
     uint64_t num_workers_;
+    // num_workers_, or spawn_limit if more are spawned on demand
+    uint64_t max_workers_;
+    // workers started for critical and high tasks while all are busy
+    uint64_t urgent_limit_;
+    size_t starvation_limit_;
+    std::chrono::microseconds time_slice_;
+    bool preemption_;
+    // tasks taken so far, and whether low ones had the last aged turn
+    size_t fetches_;
+    bool aged_low_;
+    std::chrono::microseconds spin_time_;
+    std::chrono::milliseconds spawn_idle_time_;
+    bool work_stealing_;
+    bool migration_;
+    // ordinator of our thread while it runs, where peers move routines to
+    std::atomic<Ordinator*> home_;
+    // nothing was ready in the last round
+    std::atomic<bool> idle_;
+    // workers in the middle of a task, they may yield and want to run again
+    std::atomic<uint64_t> running_;
+    std::atomic<bool> parked_;
+    uint64_t seed_;
 public:
-    Processor(const uint64_t& num_workers, TaskQueue& task_queue,
-            std::atomic<bool>& stop):
-            num_workers_(num_workers), task_queue_(task_queue), stop_(stop) {
-        for (auto i = 0U; i < num_workers_; i++) {
-            const auto& worker = Create(std::bind(
-                    &Processor::ConsumeTask, this));
-            workers_.push_back(worker);
-        }
+    BasicProcessor(const PoolOptions& options, const Peers& peers,
+            uint64_t index, std::atomic<bool>& stop,
+            std::atomic<uint64_t>& num_parked,
+            std::atomic<uint64_t>& num_retired):
+            live_workers_(0U), blocked_(0U), peers_(peers), stop_(stop),
+            num_parked_(num_parked), num_retired_(num_retired), index_(index),
+            num_workers_(options.num_workers_per_core),
+            max_workers_(options.spawn_per_task ? std::max(
+                        options.spawn_limit, options.num_workers_per_core) :
+                options.num_workers_per_core),
+            urgent_limit_(std::max<uint64_t>(max_workers_,
+                        options.spawn_limit)),
+            starvation_limit_(options.starvation_limit),
+            time_slice_(options.time_slice),
+            preemption_(options.preemption), fetches_(0U),
+            aged_low_(false), spin_time_(options.spin_time),
+            spawn_idle_time_(options.spawn_idle_time),
+            work_stealing_(options.work_stealing),
+            migration_(options.migration), home_(nullptr), idle_(false),
+            running_(0U),
+            parked_(false), seed_(index + 1) {
     }
-    ~Processor() {
+    ~BasicProcessor() {
+        Task* task = nullptr;
+        while (local_tasks_.Pop(task))
+            delete task;
+        for (Task* spare : spare_tasks_)
+            delete spare;
     }
 
-    void ConsumeTask() {
-        do {
-            Task task;
-            if (tasks_.Pop(task)) {
-                task();
+    // Run tasks until the worker should return, nullptr then. A worker that
+    // moved to a peer in the middle of a task goes on there, that peer is
+    // given, along with the worker's index on it.
+    BasicProcessor* ConsumeTask(size_t& index) {
+        Task task;
+        Priority priority = Priority::kNormal;
+        while (true) {
+            Worker& worker = workers_[index];
+            if (worker.task) {
+                task = std::move(worker.task);
+                worker.task = nullptr;
+                priority = worker.priority;
+            }
+            else if (!FetchTask(task, priority, false)) {
+                if (stop_.load(std::memory_order_acquire) ||
+                        !WaitForTask(index))
+                    break;
+                continue;
             }
-        } while (!(stop_.load(std::memory_order_acquire) &&
-                    tasks_.IsEmpty()));
+            running_.fetch_add(1, std::memory_order_relaxed);
+            SetPriority(priority);
+            task();
+            task = nullptr;
+            // whatever the task set, its worker is back to normal
+            SetPriority(Priority::kNormal);
+            BasicProcessor* local = Local();
+            if (local != this || local->WorkerOf(Current()) != index) {
+                // this is stale, the worker was counted over to local
+                if (local == nullptr || !local->Owns(peers_))
+                    return nullptr;
+                local->running_.fetch_sub(1, std::memory_order_relaxed);
+                index = local->WorkerOf(Current());
+                return local;
+            }
+            running_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        live_workers_--;
+        exited_.push_back(index);
+        return nullptr;
     }
 
-    void Run() {
-        bool work_done = false;
-        while (!work_done) {
-            work_done = true;
-            for (const auto& worker : workers_) {
-                Task task;
-                if (task_queue_.TryPop(task)) {
-                    work_done = false;
-                    tasks_.Push(task);
-                }
-                auto ret = Resume(worker);
-                if (ret != -2) {
-                    work_done = false;
-                }
-                if (stop_.load(std::memory_order_acquire) && work_done) {
-                    if (tasks_.IsEmpty())
-                    tasks_.Close();
+    // out of the ready queue until Dispatch has a task for the worker, false
+    // if it should return instead
+    bool WaitForTask(size_t index) {
+        workers_[index].idle = true;
+        idle_workers_.push_back(index);
+        // spawned on top of the resident workers, not kept forever
+        bool timed = live_workers_ > num_workers_ + blocked_;
+        if (timed)
+            StartTimer(Clock::now() + spawn_idle_time_);
+        while (workers_[index].idle) {
+            if (timed && !TimerPending()) {
+                timed = false;
+                if (live_workers_ > num_workers_ + blocked_) {
+                    workers_[index].idle = false;
+                    idle_workers_.erase(std::find(idle_workers_.begin(),
+                                idle_workers_.end(), index));
+                    return false;
                 }
             }
+            Suspend();
         }
-        for (const auto& worker : workers_) {
-            Destroy(worker);
+        if (timed)
+            StopTimer();
+        return true;
+    }
+
+    // processor driving the calling thread, nullptr outside of a pool
+    CORO_TLS_ACCESSOR static BasicProcessor*& Local() {
+        CORO_TLS_FENCE();
+        thread_local BasicProcessor* processor = nullptr;
+        return processor;
+    }
+
+    void Run() {
+        Local() = this;
+        // routines woken from other threads, e.g. by Await, unpark us
+        SetWakeupParker(&parker_);
+        SetMigrationHooks(this);
+        SetBlockingHooks(this);
+        SetStarvationLimit(starvation_limit_);
+        SetTimeSlice(time_slice_);
+        if (preemption_)
+            EnablePreemption(time_slice_);
+        home_.store(Self().ordinator, std::memory_order_release);
+#ifdef __linux__
+        Uring::Local().SetDriven(true);
+#endif
+        for (auto i = 0U; i < num_workers_; i++)
+            StartWorker(nullptr, Priority::kNormal);
+        auto idle_since = std::chrono::steady_clock::time_point::min();
+        while (true) {
+            // before Dispatch, tasks added ahead of stop are seen by it
+            const bool stopping = stop_.load(std::memory_order_acquire);
+            // routines woken from other threads, whose timer fired, whose
+            // I/O completed or whose fd got ready join the ready queue
+            ApplyWakeups();
+            ExpireTimers();
+#ifdef __linux__
+            Uring& ring = Uring::Local();
+            ring.Reap();
+            Reactor& reactor = Reactor::Local();
+            if (reactor.IsWaiting())
+                reactor.Poll(std::chrono::nanoseconds(0));
+#endif
+            Dispatch();
+            // everybody ready now gets a turn, and routines they wake up or
+            // that yield keep running until the round has used its budget
+            size_t budget = ReadyCount();
+            if (migration_ && idle_.load(std::memory_order_relaxed) !=
+                    (budget == 0))
+                idle_.store(budget == 0, std::memory_order_relaxed);
+            if (budget == 0) {
+                // routines moved here in the meantime are taken in first
+                if (stopping && live_workers_ == 0 && CloseToMoves())
+                    break;
+                Idle(idle_since);
+                continue;
+            }
+            idle_since = std::chrono::steady_clock::time_point::min();
+            if (migration_ && budget > 1)
+                Balance(budget);
+            if (budget < kRoundBudget)
+                budget = kRoundBudget;
+            while (budget-- > 0) {
+                routine_t id = NextReady();
+                if (id == 0)
+                    break;
+                Resume(id);
+                // a new round dispatches it right away
+                if (UrgentWaiting())
+                    break;
+            }
+            for (size_t index : exited_) {
+                worker_by_id_[workers_[index].handle.id] = 0;
+                Destroy(workers_[index].handle.id);
+                free_workers_.push_back(index);
+            }
+            exited_.clear();
+#ifdef __linux__
+            // one submission for all I/O queued this round
+            ring.Submit();
+#endif
         }
+        idle_.store(false, std::memory_order_relaxed);
+        home_.store(nullptr, std::memory_order_release);
+#ifdef CORO_MIGRATION
+        // a peer may still be about to move a routine here, our ordinator
+        // has to be around to refuse it until every peer closed as well
+        num_retired_.fetch_add(1, std::memory_order_acq_rel);
+        while (num_retired_.load(std::memory_order_acquire) < peers_.size())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+        workers_.clear();
+        free_workers_.clear();
+        worker_by_id_.clear();
+#ifdef __linux__
+        Uring::Local().SetDriven(false);
+#endif
+        DisablePreemption();
+        SetBlockingHooks(nullptr);
+        SetMigrationHooks(nullptr);
+        SetWakeupParker(nullptr);
+        Local() = nullptr;
+    }
+
+    // where Wake sends routines to go on from this processor, nullptr
+    // while it does not run
+    Ordinator* Home() const {
+        return home_.load(std::memory_order_acquire);
     }
 
     void Finalize() {
         stop_.store(true, std::memory_order_release);
+        parker_.Unpark();
+    }
+
+    void AddTask(Task task) {
+        task_queue_.Push(std::move(task));
+        parker_.Unpark();
+    }
+
+    // AddTask from a thread of the pool, local being its processor. Waiting
+    // for room in a full queue could wait for that very thread, or for one
+    // waiting on it in turn, so local keeps the task instead.
+    void AddTask(Task task, BasicProcessor* local) {
+        if (!task_queue_.TryPush(std::move(task))) {
+            local->Spawn(std::move(task));
+            return;
+        }
+        parker_.Unpark();
+    }
+
+    void AddTask(Task task, Priority priority) {
+        urgent_.Push(std::move(task), size_t(priority));
+        parker_.Unpark();
+    }
+
+    // runs as critical, earlier deadlines first
+    void AddTask(Task task, Clock::time_point deadline) {
+        urgent_.PushDeadline(std::move(task), deadline);
+        parker_.Unpark();
+    }
+
+    // one bulk push, waiting for room in a bounded queue, and one wakeup
+    // for a chunk of AddTasks
+    template <typename Iterator>
+    void AddTasks(Iterator begin, Iterator end) {
+        task_queue_.PushBulk(begin, end);
+        parker_.Unpark();
+    }
+
+    // AddTasks from a thread of the pool, see AddTask(task, local)
+    template <typename Iterator>
+    void AddTasks(Iterator begin, Iterator end, BasicProcessor* local) {
+        Iterator rest = task_queue_.TryPushBulk(begin, end);
+        if (rest != begin)
+            parker_.Unpark();
+        if (rest != end)
+            local->SpawnBulk(rest, end);
+    }
+
+    // queue a task spawned on this processor's own thread
+    void Spawn(Task task) {
+        local_tasks_.Push(NewTask(std::move(task)));
+        if (local_tasks_.Size() > 1)
+            WakePeer();
+    }
+
+    template <typename Iterator>
+    void SpawnBulk(Iterator begin, Iterator end) {
+        for (; begin != end; ++begin)
+            local_tasks_.Push(NewTask(std::move(*begin)));
+        if (local_tasks_.Size() > 1)
+            WakePeer();
+    }
+
+    // all workers are inside a task, anything queued here has to wait
+    bool IsBusy() const {
+        return running_.load(std::memory_order_relaxed) >= max_workers_;
+    }
+
+    bool IsStealing() const {
+        return work_stealing_;
+    }
+
+    bool Owns(const Peers& peers) const {
+        return &peers_ == &peers;
+    }
+
+    // wake one sleeping processor so that it can steal
+    void WakePeer() {
+        if (!work_stealing_ ||
+                num_parked_.load(std::memory_order_relaxed) == 0)
+            return;
+        for (auto i = 1U; i < peers_.size(); i++) {
+            auto& peer = peers_[(index_ + i) % peers_.size()];
+            if (peer->parked_.load(std::memory_order_relaxed)) {
+                peer->parker_.Unpark();
+                return;
+            }
+        }
+    }
+
+private:
+    // hand queued tasks to idle workers or to new routines, and let idle
+    // workers return once the pool stops and nothing is left. Critical and
+    // high tasks get a worker of their own even if all are busy, up to
+    // urgent_limit_, it goes ahead of them in the ready queue. Workers
+    // blocked on a future do not count.
+    void Dispatch() {
+        Task task;
+        Priority priority = Priority::kNormal;
+        while (true) {
+            const bool room = !idle_workers_.empty() ||
+                live_workers_ < max_workers_ + blocked_;
+            if (!room && !UrgentWaiting())
+                break;
+            if (!FetchTask(task, priority, !room))
+                break;
+            if (idle_workers_.empty()) {
+                StartWorker(&task, priority);
+                continue;
+            }
+            Wakeup(idle_workers_.back(), &task, priority);
+            idle_workers_.pop_back();
+        }
+        if (stop_.load(std::memory_order_acquire)) {
+            while (!idle_workers_.empty()) {
+                Wakeup(idle_workers_.back(), nullptr, Priority::kNormal);
+                idle_workers_.pop_back();
+            }
+        }
+    }
+
+    // a critical or high task is queued and can get a worker
+    bool UrgentWaiting() const {
+        return !urgent_.Empty(size_t(Priority::kHigh)) &&
+            (!idle_workers_.empty() || live_workers_ < urgent_limit_);
+    }
+
+    void StartWorker(Task* task, Priority priority) {
+        size_t index = NewWorker();
+        Worker& worker = workers_[index];
+        if (task != nullptr)
+            worker.task = std::move(*task);
+        worker.priority = priority;
+        worker.handle.id = Create([this, index] {
+            BasicProcessor* processor = this;
+            size_t slot = index;
+            while (processor != nullptr)
+                processor = processor->ConsumeTask(slot);
+        });
+        SetWorkerOf(worker.handle.id, index);
+        SetPriority(worker.handle.id, priority);
+    }
+
+    // slot for a worker about to run here
+    size_t NewWorker() {
+        size_t index = workers_.size();
+        if (!free_workers_.empty()) {
+            index = free_workers_.back();
+            free_workers_.pop_back();
+        }
+        else {
+            workers_.emplace_back();
+        }
+        Worker& worker = workers_[index];
+        worker.idle = false;
+        worker.handle = Self();
+        live_workers_++;
+        return index;
+    }
+
+    size_t WorkerOf(routine_t id) const {
+        return id < worker_by_id_.size() ? worker_by_id_[id] - 1 : SIZE_MAX;
+    }
+
+    void SetWorkerOf(routine_t id, size_t index) {
+        if (worker_by_id_.size() <= id)
+            worker_by_id_.resize(id + 1);
+        worker_by_id_[id] = index + 1;
+    }
+
+    // a worker moved to a peer in the middle of its task, which counts it
+    // from now on; the pool is the cookie, routines that are no workers or
+    // move to another pool are not workers there
+    uintptr_t OnMovedOut(routine_t id) override {
+        size_t index = WorkerOf(id);
+        if (index == SIZE_MAX)
+            return 0;
+        worker_by_id_[id] = 0;
+        free_workers_.push_back(index);
+        live_workers_--;
+        running_.fetch_sub(1, std::memory_order_relaxed);
+        return reinterpret_cast<uintptr_t>(&peers_);
+    }
+
+    void OnMovedIn(routine_t id, uintptr_t cookie) override {
+        if (cookie != reinterpret_cast<uintptr_t>(&peers_))
+            return;
+        size_t index = NewWorker();
+        workers_[index].handle.id = id;
+        SetWorkerOf(id, index);
+        running_.fetch_add(1, std::memory_order_relaxed);
     }
 
-    void AddTask(const Task& task) {
-        task_queue_.Push(task);
+    // a worker about to wait for a future leaves its place to another one,
+    // the task it waits for may well be queued here behind it
+    bool OnBlocking() override {
+        if (WorkerOf(Current()) == SIZE_MAX)
+            return false;
+        blocked_++;
+        running_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void OnUnblocked() override {
+        blocked_--;
+        running_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // hand up to half of the routines ready at a MigrationPoint to an idle
+    // peer, it is woken up by their arrival
+    void Balance(size_t ready) {
+        for (auto i = 1U; i < peers_.size(); i++) {
+            auto& peer = peers_[(index_ + i) % peers_.size()];
+            if (!peer->idle_.load(std::memory_order_relaxed))
+                continue;
+            Ordinator* home = peer->Home();
+            if (home != nullptr && MoveReady(home, ready / 2) > 0) {
+                // busy until it had a round, keeps others from piling on
+                peer->idle_.store(false, std::memory_order_relaxed);
+                return;
+            }
+        }
+    }
+
+    void Wakeup(size_t index, Task* task, Priority priority) {
+        Worker& worker = workers_[index];
+        if (task != nullptr)
+            worker.task = std::move(*task);
+        worker.priority = priority;
+        worker.idle = false;
+        // queued in the class of its task right away
+        SetPriority(worker.handle.id, priority);
+        Wake(worker.handle);
+    }
+
+    // local tasks are queued by pointer, their cells are reused so that
+    // spawning a task allocates nothing once the processor warmed up
+    Task* NewTask(Task&& task) {
+        if (spare_tasks_.empty())
+            return new Task(std::move(task));
+        Task* cell = spare_tasks_.back();
+        spare_tasks_.pop_back();
+        *cell = std::move(task);
+        return cell;
+    }
+
+    // cell emptied by moving its task out, owner thread only
+    void RecycleTask(Task* cell) {
+        if (spare_tasks_.size() < kSpareTasks)
+            spare_tasks_.push_back(cell);
+        else
+            delete cell;
+    }
+
+    // Deadline, critical and high tasks first, then the newest local task,
+    // the shared queue, low tasks and at last other processors; only the
+    // first if urgent_only. Every starvation_limit_-th fetch normal and low
+    // tasks, in turn, go first instead.
+    bool FetchTask(Task& task, Priority& priority, bool urgent_only) {
+        const size_t kHigh = size_t(Priority::kHigh);
+        const size_t kLow = size_t(Priority::kLow);
+        size_t level = 0;
+        if (!urgent_only && starvation_limit_ != 0 && !urgent_.Empty() &&
+                ++fetches_ % starvation_limit_ == 0) {
+            aged_low_ = !aged_low_;
+            if (aged_low_ && urgent_.TryPop(task, level, kLow, kLow)) {
+                priority = Priority::kLow;
+                return true;
+            }
+            if (FetchNormal(task)) {
+                priority = Priority::kNormal;
+                return true;
+            }
+        }
+        if (urgent_.TryPop(task, level, 0, kHigh)) {
+            priority = Priority(level);
+            return true;
+        }
+        if (urgent_only)
+            return false;
+        priority = Priority::kNormal;
+        if (FetchNormal(task))
+            return true;
+        if (urgent_.TryPop(task, level, kLow, kLow)) {
+            priority = Priority::kLow;
+            return true;
+        }
+        return work_stealing_ && Steal(task, priority);
+    }
+
+    // newest local task first, then the shared queue
+    bool FetchNormal(Task& task) {
+        Task* local = nullptr;
+        if (local_tasks_.Pop(local)) {
+            task = std::move(*local);
+            RecycleTask(local);
+            return true;
+        }
+        return task_queue_.TryPop(task);
+    }
+
+    bool Steal(Task& task, Priority& priority) {
+        const auto num_peers = peers_.size();
+        if (num_peers < 2)
+            return false;
+        // xorshift, a random victim keeps thieves from piling up on one
+        seed_ ^= seed_ << 13;
+        seed_ ^= seed_ >> 7;
+        seed_ ^= seed_ << 17;
+        const auto first = seed_ % num_peers;
+        for (auto i = 0U; i < num_peers; i++) {
+            auto& victim = peers_[(first + i) % num_peers];
+            if (victim.get() == this)
+                continue;
+            size_t level = 0;
+            if (victim->urgent_.TryPop(task, level, 0,
+                        size_t(Priority::kHigh))) {
+                priority = Priority(level);
+                return true;
+            }
+            priority = Priority::kNormal;
+            Task* stolen = nullptr;
+            if (victim->local_tasks_.Steal(stolen)) {
+                task = std::move(*stolen);
+                RecycleTask(stolen);
+                return true;
+            }
+            if (Queue::kMultiConsumer && victim->task_queue_.TryPop(task))
+                return true;
+            if (victim->urgent_.TryPop(task, level, size_t(Priority::kLow),
+                        size_t(Priority::kLow))) {
+                priority = Priority::kLow;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // keep polling for spin_time_ after work ran out, then sleep until
+    // AddTask, Finalize, a busy peer, a wakeup of a suspended routine or
+    // the next timer gets us up, in the reactor if routines wait for I/O
+    void Idle(std::chrono::steady_clock::time_point& idle_since) {
+        auto now = std::chrono::steady_clock::now();
+        if (idle_since == std::chrono::steady_clock::time_point::min()) {
+            idle_since = now;
+        }
+        else if (now - idle_since >= spin_time_) {
+#ifdef __linux__
+            Reactor& reactor = Reactor::Local();
+            parker_.SetHook(reactor.IsWaiting() ||
+                    Uring::Local().IsPending() ? &reactor : nullptr);
+#endif
+            // a preemption timer would wake us every slice
+            if (preemption_)
+                PausePreemption();
+            parked_.store(true, std::memory_order_relaxed);
+            num_parked_.fetch_add(1, std::memory_order_relaxed);
+            parker_.ParkFor(NextTimerIn());
+            num_parked_.fetch_sub(1, std::memory_order_relaxed);
+            parked_.store(false, std::memory_order_relaxed);
+            if (preemption_)
+                ResumePreemption();
+            idle_since = std::chrono::steady_clock::time_point::min();
+        }
     }
 };
 
-class ProcessorPool {
+template <typename Queue = TaskQueue>
+class BasicProcessorPool : public Executor {
 public:
-    ProcessorPool() = delete;
-    ProcessorPool(const uint64_t num_workers_per_core):
-            ProcessorPool(std::thread::hardware_concurrency(),
+    typedef BasicProcessor<Queue> Processor;
+
+    BasicProcessorPool() = delete;
+    BasicProcessorPool(const uint64_t num_workers_per_core):
+            BasicProcessorPool(std::thread::hardware_concurrency(),
             num_workers_per_core) {}
-    ProcessorPool(const uint64_t& num_cores, const uint64_t&
-            num_workers_per_core) : num_cores_(num_cores),
-            num_workers_per_core_(num_workers_per_core),
-            last_core_(0U) {
-        for (auto core = 0U; core < num_cores; core++) {
-            task_queues_.EmplaceBack(new TaskQueue);
+    BasicProcessorPool(const uint64_t& num_cores, const uint64_t&
+            num_workers_per_core, std::chrono::microseconds spin_time =
+                std::chrono::microseconds(PROCESSOR_SPIN_US)):
+            BasicProcessorPool(MakeOptions(num_cores, num_workers_per_core,
+                        spin_time)) {}
+    BasicProcessorPool(const PoolOptions& options) : options_(options),
+            num_cores_(options.num_cores), last_core_(0U), stop_(false),
+            num_parked_(0U), num_retired_(0U), num_started_(0U) {
+        const std::vector<int> allowed = options_.pin_threads ?
+            AllowedCpus() : std::vector<int>();
+        for (auto core = 0U; core < num_cores_; core++) {
+            if (!options_.cpu_sets.empty())
+                cpus_.push_back(options_.cpu_sets[core %
+                        options_.cpu_sets.size()]);
+            else if (!allowed.empty())
+                cpus_.push_back(std::vector<int>(1,
+                            allowed[core % allowed.size()]));
+            else
+                cpus_.emplace_back();
+            if (cpus_.back().empty())
+                continue;
+            const size_t node = NodeOfCpu(cpus_.back()[0]);
+            if (cores_by_node_.size() <= node)
+                cores_by_node_.resize(node + 1);
+            cores_by_node_[node].push_back(core);
+        }
+        next_on_node_.resize(cores_by_node_.size(), 0U);
+        for (auto core = 0U; core < num_cores_; core++) {
+            processors_.EmplaceBack(options_.numa_local ? nullptr :
+                    NewProcessor(core));
+        }
+        for (auto core = 0U; core < num_cores_; core++) {
             threads_.PushBack(std::unique_ptr<std::thread>(
                 new std::thread([this, core]{
-                    std::shared_ptr<Processor> processor(
-                            new Processor(
-                                num_workers_per_core_,
-                                *task_queues_[core], stop_)
-                    );
-                    processors_.EmplaceBack(processor);
-                    processor->Run();
+                    Start(core);
                 }))
             );
         }
+        // tasks may be added as soon as we return
+        if (options_.numa_local)
+            WaitForProcessors();
     }
-    ~ProcessorPool() {
+    ~BasicProcessorPool() override {
         Finalize();
     }
     void Finalize() {
         stop_.store(true, std::memory_order_release);
+        for (const auto& processor : processors_) {
+            processor->Finalize();
+        }
         for (const auto& thread : threads_) {
-            thread->join();
+            if (thread->joinable())
+                thread->join();
+        }
+    }
+    // Queue task, moving it along until a worker runs it. Any callable
+    // converts, captures up to TASK_INLINE_SIZE bytes are stored inline.
+    void AddTask(Task task) {
+        // a task adding tasks keeps them close, thieves spread them out
+        Processor* local = Processor::Local();
+        if (local != nullptr && local->IsStealing() &&
+                local->Owns(processors_) && Current() != 0) {
+            local->Spawn(std::move(task));
+            return;
+        }
+        Enqueue(*processors_[NextCore()], std::move(task));
+    }
+    // Queue task to run in class priority, ahead of normal tasks if more
+    // urgent, see PoolOptions::starvation_limit.
+    void AddTask(Task task, Priority priority) {
+        if (priority == Priority::kNormal) {
+            AddTask(std::move(task));
+            return;
         }
+        auto& processor = processors_[NextCore()];
+        processor->AddTask(std::move(task), priority);
+        if (processor->IsBusy())
+            processor->WakePeer();
     }
-    void AddTask(const Task& task) {
-        // add task in a round-robin manner
+    // Queue task to run as critical, of those the one with the earliest
+    // deadline is started first. Nothing is done when it passes.
+    void AddTask(Task task, Clock::time_point deadline) {
+        auto& processor = processors_[NextCore()];
+        processor->AddTask(std::move(task), deadline);
+        if (processor->IsBusy())
+            processor->WakePeer();
+    }
+    // node for AddTask meaning the one the calling thread runs on
+    static const int kLocalNode = -1;
+    // Queue task on a processor pinned to NUMA node, round robin among
+    // them, or like AddTask(task) if none is.
+    void AddTask(Task task, int node) {
+        if (node == kLocalNode)
+            node = CurrentNode();
+        if (node < 0 || size_t(node) >= cores_by_node_.size() ||
+                cores_by_node_[node].empty()) {
+            AddTask(std::move(task));
+            return;
+        }
+        const auto& cores = cores_by_node_[node];
         task_lock_.lock();
-        last_core_ = (last_core_ + 1) % num_cores_;
-        const auto last_core = last_core_;
+        const auto core = cores[next_on_node_[node]++ % cores.size()];
         task_lock_.unlock();
-        task_queues_[last_core]->Push(task);
+        Enqueue(*processors_[core], std::move(task));
+    }
+    // Run func as a task, its result or exception comes back through the
+    // returned future. Future and task share one allocation.
+    template <typename Function>
+    Future<typename std::result_of<typename std::decay<Function>::type()>
+            ::type> Submit(Function&& func) {
+        typedef typename std::decay<Function>::type F;
+        typedef typename std::result_of<F()>::type Result;
+        auto state = new detail::FutureTask<Result, F>(this,
+                std::forward<Function>(func));
+        Future<Result> future(state);
+        try {
+            AddTask([state] { state->Run(); });
+        }
+        catch (...) {
+            state->Release();
+            throw;
+        }
+        return future;
+    }
+    // continuations of futures stay on the processor completing them
+    void Execute(Task task) override {
+        Processor* local = Processor::Local();
+        if (local == nullptr || !local->Owns(processors_)) {
+            AddTask(std::move(task));
+            return;
+        }
+        if (local->IsStealing())
+            local->Spawn(std::move(task));
+        else
+            local->AddTask(std::move(task), local);
+    }
+    // Queue the tasks of [begin, end), moving them out of it unless the
+    // iterators are const, in one chunk per processor, each woken once. A
+    // ReadWriteQueue takes its lock once per chunk, a BoundedQueue reserves
+    // the cells for as much of it as fits with one CAS, again whenever it
+    // was full or lost a race, an MpscQueue links it with one exchange.
+    // Outside of the pool a full BoundedQueue is waited for, see
+    // Processor::AddTask(task, local) for tasks adding tasks.
+    template <typename Iterator>
+    void AddTasks(Iterator begin, Iterator end) {
+        Processor* local = Processor::Local();
+        if (local != nullptr && local->IsStealing() &&
+                local->Owns(processors_) && Current() != 0) {
+            local->SpawnBulk(begin, end);
+            return;
+        }
+        const uint64_t size = uint64_t(std::distance(begin, end));
+        if (size == 0)
+            return;
+        const uint64_t chunks = std::min<uint64_t>(size, num_cores_);
+        task_lock_.lock();
+        const auto first_core = last_core_ + 1;
+        last_core_ = (last_core_ + chunks) % num_cores_;
+        task_lock_.unlock();
+        for (uint64_t chunk = 0; chunk < chunks; chunk++) {
+            // the first size % chunks chunks take one task more
+            uint64_t count = size / chunks + (chunk < size % chunks ? 1 : 0);
+            Iterator chunk_end = begin;
+            std::advance(chunk_end, count);
+            auto& processor = processors_[(first_core + chunk) % num_cores_];
+            if (local != nullptr && local->Owns(processors_))
+                processor->AddTasks(begin, chunk_end, local);
+            else
+                processor->AddTasks(begin, chunk_end);
+            if (processor->IsBusy())
+                processor->WakePeer();
+            begin = chunk_end;
+        }
+    }
+
+    // copies the tasks of a container of copyable callables
+    template <typename Range>
+    void AddTasks(const Range& tasks) {
+        AddTasks(std::begin(tasks), std::end(tasks));
+    }
+
+    // moves the tasks out of a container about to go away
+    template <typename Range, typename = typename std::enable_if<
+        !std::is_lvalue_reference<Range>::value>::type>
+    void AddTasks(Range&& tasks) {
+        AddTasks(std::make_move_iterator(std::begin(tasks)),
+                std::make_move_iterator(std::end(tasks)));
+    }
+
+    // Wake the routine behind global from any thread, a routine waiting in
+    // coro::Park goes on from processor core; false once it is gone.
+    bool Wake(const GlobalHandle& global, uint64_t core) {
+        return coro::Wake(global, processors_[core % num_cores_]->Home());
     }
 private:
+    // queue task on processor, without waiting for room from a thread of
+    // the pool
+    void Enqueue(Processor& processor, Task task) {
+        Processor* local = Processor::Local();
+        if (local != nullptr && local->Owns(processors_))
+            processor.AddTask(std::move(task), local);
+        else
+            processor.AddTask(std::move(task));
+        if (processor.IsBusy())
+            processor.WakePeer();
+    }
+    // add tasks in a round-robin manner
+    uint64_t NextCore() {
+        std::lock_guard<SpinLock> lk(task_lock_);
+        last_core_ = (last_core_ + 1) % num_cores_;
+        return last_core_;
+    }
+
+    std::shared_ptr<Processor> NewProcessor(uint64_t core) {
+        return std::make_shared<Processor>(options_, processors_, core,
+                stop_, num_parked_, num_retired_);
+    }
+
+    // on the thread of processor core
+    void Start(uint64_t core) {
+        if (!cpus_[core].empty())
+            PinThread(cpus_[core]);
+        if (options_.numa_local) {
+            processors_[core] = NewProcessor(core);
+            num_started_.fetch_add(1, std::memory_order_release);
+            // peers are looked at from the first round on
+            WaitForProcessors();
+        }
+        processors_[core]->Run();
+    }
+
+    void WaitForProcessors() {
+        while (num_started_.load(std::memory_order_acquire) < num_cores_)
+            std::this_thread::yield();
+    }
+
+    static PoolOptions MakeOptions(uint64_t num_cores,
+            uint64_t num_workers_per_core,
+            std::chrono::microseconds spin_time) {
+        PoolOptions options;
+        options.num_cores = num_cores;
+        options.num_workers_per_core = num_workers_per_core;
+        options.spin_time = spin_time;
+        return options;
+    }
+
+    PoolOptions options_;
     uint64_t num_cores_;
-    uint64_t num_workers_per_core_;
     uint64_t last_core_;
     SpinLock task_lock_;
     std::atomic<bool> stop_;
-    SmallVector<std::unique_ptr<TaskQueue>> task_queues_;
+    std::atomic<uint64_t> num_parked_;
+    std::atomic<uint64_t> num_retired_;
+    // processors built on their own thread so far, with numa_local
+    std::atomic<uint64_t> num_started_;
+    // CPUs of every processor, empty if it is not pinned
+    std::vector<std::vector<int>> cpus_;
+    // pinned processors by NUMA node, and where AddTask(task, node) goes next
+    std::vector<std::vector<uint64_t>> cores_by_node_;
+    std::vector<uint64_t> next_on_node_;
     SmallVector<std::unique_ptr<std::thread>> threads_;
     SmallVector<std::shared_ptr<Processor>> processors_;
 };
-}  // namespace coro
 
+using Processor = BasicProcessor<TaskQueue>;
+using ProcessorPool = BasicProcessorPool<TaskQueue>;
+}  // namespace coro
@@ -0,0 +1,384 @@
+#pragma once
+// Readiness based socket I/O for coroutines on top of epoll, linux only.
+//
+// Every thread has its own Reactor. Read, Write, Accept and Connect try the
+// call first and only if it would block suspend the routine until the
+// reactor of its thread reports the fd ready. Processors poll their reactor
+// between rounds and sleep in it while idle, a thread resuming routines by
+// hand has to call Reactor::Local().Poll itself.
+//
+// fds are switched to non-blocking mode and registered edge triggered on
+// first use, with the reactor of every thread using them. Close them with
+// coro::Close, so that all reactors forget them before the number is handed
+// out again. Only one routine may wait for reading and one for writing on
+// an fd at a time.
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "parker.h"
+#include "spinlock.h"
+#include "coroutine.h"
+
+namespace coro {
+
+class Reactor : public ParkHook {
+public:
+    Reactor() : epoll_fd_(-1), event_fd_(-1), waiting_(0),
+            closed_any_(false) {
+        std::lock_guard<SpinLock> lk(Registry().lock);
+        Registry().reactors.push_back(this);
+    }
+    ~Reactor() {
+        {
+            std::lock_guard<SpinLock> lk(Registry().lock);
+            std::vector<Reactor*>& reactors = Registry().reactors;
+            reactors.erase(std::find(reactors.begin(), reactors.end(), this));
+        }
+        if (event_fd_ >= 0)
+            ::close(event_fd_);
+        if (epoll_fd_ >= 0)
+            ::close(epoll_fd_);
+    }
+
+    CORO_TLS_ACCESSOR static Reactor& Local() {
+        CORO_TLS_FENCE();
+        thread_local Reactor reactor;
+        return reactor;
+    }
+
+    /*!
+     * \brief Switch fd to non-blocking mode and watch it, once per fd.
+     */
+    inline void Register(int fd) {
+        ForgetClosed();
+        FdState& state = State(fd);
+        if (state.registered)
+            return;
+        Init();
+        int flags = fcntl(fd, F_GETFL);
+        if (flags >= 0 && (flags & O_NONBLOCK) == 0)
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = fd;
+        // regular files can not be polled, they never block either
+        state.pollable =
+            epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) == 0 ||
+            errno == EEXIST;
+        state.registered = true;
+    }
+
+    /*!
+     * \brief Suspend the current routine until fd is readable, or writable
+     * if write is set. May return early, retry the call and wait again.
+     * Outside of a routine the thread blocks in poll.
+     */
+    inline void Wait(int fd, bool write) {
+        ForgetClosed();
+        FdState& state = State(fd);
+        bool& ready = write ? state.write_ready : state.read_ready;
+        if (ready || !state.pollable) {
+            ready = false;
+            return;
+        }
+        if (Current() == 0) {
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = write ? POLLOUT : POLLIN;
+            pfd.revents = 0;
+            ::poll(&pfd, 1, -1);
+            return;
+        }
+        Handle& waiter = write ? state.writer : state.reader;
+        assert(waiter.id == 0);
+        waiter = Self();
+        waiting_++;
+        Suspend();
+        // woken by someone else, fds_ may have grown meanwhile
+        FdState& after = fds_[size_t(fd)];
+        Handle& still = write ? after.writer : after.reader;
+        if (still.id == Current()) {
+            still.id = 0;
+            waiting_--;
+        }
+    }
+
+    /*!
+     * \brief Wake routines whose fds became ready, waiting up to timeout for
+     * the first event. Gives the number of routines woken up.
+     */
+    inline size_t Poll(std::chrono::nanoseconds timeout) {
+        if (epoll_fd_ < 0)
+            return 0;
+        ForgetClosed();
+        int ms = -1;
+        if (timeout != std::chrono::nanoseconds::max()) {
+            // round up, waking before the deadline only means another round
+            ms = int(std::chrono::duration_cast<std::chrono::milliseconds>(
+                        timeout + std::chrono::microseconds(999)).count());
+        }
+        struct epoll_event events[kMaxEvents];
+        int n = epoll_wait(epoll_fd_, events, kMaxEvents, ms);
+        size_t woken = 0;
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == event_fd_) {
+                uint64_t count;
+                ssize_t r = ::read(event_fd_, &count, sizeof(count));
+                (void)r;
+                continue;
+            }
+            FdState& state = fds_[size_t(fd)];
+            uint32_t ev = events[i].events;
+            if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                woken += Ready(state.reader, state.read_ready);
+            if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                woken += Ready(state.writer, state.write_ready);
+        }
+        return woken;
+    }
+
+    /*!
+     * \brief Forget fd before it is closed, its waiters are woken up.
+     */
+    inline void Forget(int fd) {
+        if (fd < 0 || size_t(fd) >= fds_.size() ||
+                !fds_[size_t(fd)].registered)
+            return;
+        FdState& state = fds_[size_t(fd)];
+        if (state.pollable)
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        Ready(state.reader, state.read_ready);
+        Ready(state.writer, state.write_ready);
+        state = FdState();
+    }
+
+    /*!
+     * \brief Make every reactor forget fd before it is closed, those of other
+     * threads do so before they next look at an fd.
+     */
+    static void ForgetEverywhere(int fd) {
+        Reactor& local = Local();
+        local.Forget(fd);
+        std::lock_guard<SpinLock> lk(Registry().lock);
+        for (Reactor* reactor : Registry().reactors) {
+            if (reactor == &local)
+                continue;
+            std::lock_guard<SpinLock> closed_lk(reactor->closed_lock_);
+            reactor->closed_.push_back(fd);
+            reactor->closed_any_.store(true, std::memory_order_release);
+            // a routine of it may wait for fd, and will not hear of it
+            if (reactor->event_fd_ >= 0)
+                reactor->Interrupt();
+        }
+    }
+
+    // routines are waiting for fds of this reactor
+    inline bool IsWaiting() const {
+        return waiting_ != 0;
+    }
+
+    void Sleep(std::chrono::nanoseconds timeout) override {
+        Poll(timeout);
+    }
+
+    void Interrupt() override {
+        uint64_t one = 1;
+        ssize_t r = ::write(event_fd_, &one, sizeof(one));
+        (void)r;
+    }
+
+private:
+    static const int kMaxEvents = 128;
+
+    // reactors of all threads, for ForgetEverywhere
+    struct Reactors {
+        SpinLock lock;
+        std::vector<Reactor*> reactors;
+    };
+
+    static Reactors& Registry() {
+        static Reactors registry;
+        return registry;
+    }
+
+    // fds closed by other threads, their numbers may come back any time
+    inline void ForgetClosed() {
+        if (!closed_any_.load(std::memory_order_acquire))
+            return;
+        std::vector<int> closed;
+        {
+            std::lock_guard<SpinLock> lk(closed_lock_);
+            closed.swap(closed_);
+            closed_any_.store(false, std::memory_order_relaxed);
+        }
+        for (int fd : closed)
+            Forget(fd);
+    }
+
+    struct FdState {
+        Handle reader;
+        Handle writer;
+        // an edge arrived while nobody was waiting
+        bool read_ready;
+        bool write_ready;
+        bool registered;
+        bool pollable;
+
+        FdState() : read_ready(false), write_ready(false), registered(false),
+                pollable(false) {
+            reader.ordinator = writer.ordinator = nullptr;
+            reader.id = writer.id = 0;
+        }
+    };
+
+    inline FdState& State(int fd) {
+        assert(fd >= 0);
+        if (size_t(fd) >= fds_.size())
+            fds_.resize(size_t(fd) + 1);
+        return fds_[size_t(fd)];
+    }
+
+    inline size_t Ready(Handle& waiter, bool& ready) {
+        if (waiter.id == 0) {
+            ready = true;
+            return 0;
+        }
+        Wake(waiter);
+        waiter.id = 0;
+        waiting_--;
+        return 1;
+    }
+
+    inline void Init() {
+        if (epoll_fd_ >= 0)
+            return;
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ < 0)
+            throw std::system_error(errno, std::system_category(),
+                    "epoll_create1");
+        int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd < 0)
+            throw std::system_error(errno, std::system_category(), "eventfd");
+        {
+            // read by ForgetEverywhere on other threads
+            std::lock_guard<SpinLock> lk(closed_lock_);
+            event_fd_ = event_fd;
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = event_fd_;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &event);
+    }
+
+    int epoll_fd_;
+    // written by Interrupt to end a Sleep
+    int event_fd_;
+    size_t waiting_;
+    std::vector<FdState> fds_;
+    SpinLock closed_lock_;
+    std::vector<int> closed_;
+    std::atomic<bool> closed_any_;
+    Reactor(const Reactor&) = delete;
+};
+
+inline bool WouldBlock(ssize_t result) {
+    return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// read(2) that suspends the routine instead of blocking
+inline ssize_t Read(int fd, void *buf, size_t count) {
+    Reactor& reactor = Reactor::Local();
+    reactor.Register(fd);
+    while (true) {
+        ssize_t n = ::read(fd, buf, count);
+        if (WouldBlock(n))
+            reactor.Wait(fd, false);
+        else if (n >= 0 || errno != EINTR)
+            return n;
+    }
+}
+
+// write(2) that suspends the routine instead of blocking, may write less
+// than count like write does
+inline ssize_t Write(int fd, const void *buf, size_t count) {
+    Reactor& reactor = Reactor::Local();
+    reactor.Register(fd);
+    while (true) {
+        ssize_t n = ::write(fd, buf, count);
+        if (WouldBlock(n))
+            reactor.Wait(fd, true);
+        else if (n >= 0 || errno != EINTR)
+            return n;
+    }
+}
+
+// accept(2) that suspends the routine instead of blocking, the new socket
+// is non-blocking and close-on-exec
+inline int Accept(int fd, struct sockaddr *addr = nullptr,
+        socklen_t *addrlen = nullptr) {
+    Reactor& reactor = Reactor::Local();
+    reactor.Register(fd);
+    while (true) {
+        int client = accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            reactor.Wait(fd, false);
+        else if (client >= 0 || (errno != EINTR && errno != ECONNABORTED))
+            return client;
+    }
+}
+
+// connect(2) that suspends the routine until the connection is established
+// or failed, 0 on success and -1 with errno set otherwise
+inline int Connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+    Reactor& reactor = Reactor::Local();
+    reactor.Register(fd);
+    if (::connect(fd, addr, addrlen) == 0)
+        return 0;
+    if (errno != EINPROGRESS && errno != EINTR)
+        return -1;
+    int error = 0;
+    do {
+        reactor.Wait(fd, true);
+        socklen_t len = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0)
+            return -1;
+        // still in progress if neither connected nor failed yet
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        if (error == 0 && getpeername(fd,
+                    reinterpret_cast<struct sockaddr *>(&peer),
+                    &peer_len) != 0) {
+            if (errno != ENOTCONN)
+                return -1;
+            continue;
+        }
+        break;
+    } while (true);
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+// close(2) that makes the reactors of all threads forget fd first
+inline int Close(int fd) {
+    Reactor::ForgetEverywhere(fd);
+    return ::close(fd);
+}
+
+}  // namespace coro
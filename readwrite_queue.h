@@ -1,28 +1,91 @@
 #pragma once
-#include <queue>
 #include <mutex>
 #include <memory>
+#include <utility>
+#include <vector>
 #include "spinlock.h"
+// Values live in a ring that doubles when full and never shrinks, so a
+// queue that has seen its peak pushes and pops without allocating.
 template<typename T> class ReadWriteQueue {
 public:
-    ReadWriteQueue() {}
+    static const bool kMultiConsumer = true;
+
+    ReadWriteQueue() : ring_(16), head_(0), size_(0) {}
     ~ReadWriteQueue() {}
 
     void Push(T new_value) {
         lock_.lock();
-        queue_.push(std::move(new_value));
+        PushLocked(std::move(new_value));
         lock_.unlock();
     }
 
+    // never full, for code that also takes bounded queues
+    bool TryPush(T&& value) {
+        Push(std::move(value));
+        return true;
+    }
+
+    template<typename Iterator>
+    Iterator TryPushBulk(Iterator begin, Iterator end) {
+        PushBulk(begin, end);
+        return end;
+    }
+
+    // push a whole range with a single lock acquisition
+    template<typename Iterator>
+    void PushBulk(Iterator begin, Iterator end) {
+        std::lock_guard<SpinLock> lk(lock_);
+        for (; begin != end; ++begin)
+            PushLocked(std::move(*begin));
+    }
+
     bool TryPop(T& value) {
         std::lock_guard<SpinLock> lk(lock_);
-        if(queue_.empty())
+        if (size_ == 0)
             return false;
-        value = std::move(queue_.front());
-        queue_.pop();
+        PopLocked(value);
         return true;
   }
+
+    // pop up to max values into out, returns how many were popped
+    template<typename OutputIterator>
+    size_t TryPopBulk(OutputIterator out, size_t max) {
+        std::lock_guard<SpinLock> lk(lock_);
+        size_t count = 0;
+        T value;
+        while (count < max && size_ != 0) {
+            PopLocked(value);
+            *out++ = std::move(value);
+            count++;
+        }
+        return count;
+    }
 private:
+    void PushLocked(T&& value) {
+        if (size_ == ring_.size())
+            Grow();
+        ring_[(head_ + size_) & (ring_.size() - 1)] = std::move(value);
+        size_++;
+    }
+
+    void PopLocked(T& value) {
+        value = std::move(ring_[head_]);
+        // whatever the move left behind goes now, not when overwritten
+        ring_[head_] = T();
+        head_ = (head_ + 1) & (ring_.size() - 1);
+        size_--;
+    }
+
+    void Grow() {
+        std::vector<T> bigger(ring_.size() * 2);
+        for (size_t i = 0; i < size_; i++)
+            bigger[i] = std::move(ring_[(head_ + i) & (ring_.size() - 1)]);
+        ring_.swap(bigger);
+        head_ = 0;
+    }
+
     SpinLock lock_;
-    std::queue<T> queue_;
+    std::vector<T> ring_;
+    size_t head_;
+    size_t size_;
 };
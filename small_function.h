@@ -0,0 +1,185 @@
+#pragma once
+// Move-only replacement of std::function with a configurable inline buffer.
+//
+// Callables up to InlineSize bytes that can be moved without throwing are
+// stored inside the object, bigger ones fall back to the heap. Unlike
+// std::function, nothing is ever copied, so move-only captures work as well.
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "alignof.h"
+
+template <typename Signature, std::size_t InlineSize = 48>
+class SmallFunction;
+
+template <typename R, typename... Args, std::size_t InlineSize>
+class SmallFunction<R(Args...), InlineSize> {
+public:
+    SmallFunction() noexcept : ops_(nullptr) {}
+    SmallFunction(std::nullptr_t) noexcept : ops_(nullptr) {}
+
+    template <typename F, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type,
+                SmallFunction>::value>::type>
+    SmallFunction(F &&f) : ops_(nullptr) {
+        Assign(std::forward<F>(f));
+    }
+
+    SmallFunction(SmallFunction &&other) noexcept : ops_(other.ops_) {
+        if (ops_ != nullptr) {
+            ops_->move(&storage_, &other.storage_);
+            other.ops_ = nullptr;
+        }
+    }
+
+    SmallFunction &operator=(SmallFunction &&other) noexcept {
+        if (this != &other) {
+            Reset();
+            if (other.ops_ != nullptr) {
+                other.ops_->move(&storage_, &other.storage_);
+                ops_ = other.ops_;
+                other.ops_ = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    SmallFunction &operator=(std::nullptr_t) noexcept {
+        Reset();
+        return *this;
+    }
+
+    template <typename F, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type,
+                SmallFunction>::value>::type>
+    SmallFunction &operator=(F &&f) {
+        Reset();
+        Assign(std::forward<F>(f));
+        return *this;
+    }
+
+    SmallFunction(const SmallFunction &) = delete;
+    SmallFunction &operator=(const SmallFunction &) = delete;
+
+    ~SmallFunction() {
+        Reset();
+    }
+
+    explicit operator bool() const noexcept {
+        return ops_ != nullptr;
+    }
+
+    R operator()(Args... args) {
+        return ops_->invoke(&storage_, std::forward<Args>(args)...);
+    }
+
+    void Reset() noexcept {
+        if (ops_ != nullptr) {
+            ops_->destroy(&storage_);
+            ops_ = nullptr;
+        }
+    }
+
+    // true if a callable of type F is stored without a heap allocation
+    template <typename F>
+    static constexpr bool IsInline() {
+        return sizeof(F) <= InlineSize &&
+            alignof(F) <= alignof(Storage) &&
+            std::is_nothrow_move_constructible<F>::value;
+    }
+
+private:
+    typedef AlignedCharArrayUnion<char[InlineSize], void *, long double,
+            long long> Storage;
+
+    struct Ops {
+        R (*invoke)(void *, Args &&...);
+        void (*move)(void *, void *);
+        void (*destroy)(void *);
+    };
+
+    template <typename F>
+    struct InlineOps {
+        static R Invoke(void *storage, Args &&...args) {
+            return (*static_cast<F *>(storage))(std::forward<Args>(args)...);
+        }
+        static void Move(void *dst, void *src) {
+            F *from = static_cast<F *>(src);
+            new (dst) F(std::move(*from));
+            from->~F();
+        }
+        static void Destroy(void *storage) {
+            static_cast<F *>(storage)->~F();
+        }
+        static const Ops *Get() {
+            static const Ops ops = {Invoke, Move, Destroy};
+            return &ops;
+        }
+    };
+
+    template <typename F>
+    struct HeapOps {
+        static R Invoke(void *storage, Args &&...args) {
+            return (**static_cast<F **>(storage))(std::forward<Args>(args)...);
+        }
+        static void Move(void *dst, void *src) {
+            *static_cast<F **>(dst) = *static_cast<F **>(src);
+        }
+        static void Destroy(void *storage) {
+            delete *static_cast<F **>(storage);
+        }
+        static const Ops *Get() {
+            static const Ops ops = {Invoke, Move, Destroy};
+            return &ops;
+        }
+    };
+
+    template <typename F>
+    void Assign(F &&f) {
+        typedef typename std::decay<F>::type Callable;
+        if (IsEmpty(f))
+            return;
+        Assign(std::forward<F>(f), std::integral_constant<bool,
+                IsInline<Callable>()>());
+    }
+
+    template <typename F>
+    void Assign(F &&f, std::true_type) {
+        typedef typename std::decay<F>::type Callable;
+        new (&storage_) Callable(std::forward<F>(f));
+        ops_ = InlineOps<Callable>::Get();
+    }
+
+    template <typename F>
+    void Assign(F &&f, std::false_type) {
+        typedef typename std::decay<F>::type Callable;
+        *reinterpret_cast<Callable **>(&storage_) =
+            new Callable(std::forward<F>(f));
+        ops_ = HeapOps<Callable>::Get();
+    }
+
+    // empty std::function or null function pointers stay empty
+    template <typename F>
+    static bool IsEmpty(const F &f) {
+        return IsEmptyImpl(f, 0);
+    }
+    // a function itself is never null, and testing it warns
+    template <typename Result, typename... Params>
+    static bool IsEmpty(Result (&)(Params...)) {
+        return false;
+    }
+    template <typename F>
+    static auto IsEmptyImpl(const F &f, int) -> decltype(!f, bool()) {
+        return !f;
+    }
+    template <typename F>
+    static bool IsEmptyImpl(const F &, long) {
+        return false;
+    }
+
+    Storage storage_;
+    const Ops *ops_;
+};
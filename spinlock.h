@@ -1,23 +1,102 @@
 #pragma once
 #include <atomic>
+#include <thread>
+
+#ifdef __linux__
+#include "futex.h"
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// spins before a contended lock goes to sleep, each one pauses for an
+// exponentially growing number of cycles up to SPINLOCK_MAX_BACKOFF
+#ifndef SPINLOCK_SPINS
+#define SPINLOCK_SPINS 64
+#endif
+
+#ifndef SPINLOCK_MAX_BACKOFF
+#define SPINLOCK_MAX_BACKOFF 64
+#endif
+
+/*!
+ * \brief Hint the cpu that we are busy waiting, it saves power and lets
+ * the hyperthread sibling run.
+ */
+inline void CpuRelax() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield" ::: "memory");
+#elif defined(_M_X64) || defined(_M_IX86)
+    _mm_pause();
+#endif
+}
+
 class SpinLock {
 public:
-    SpinLock() : lock_(ATOMIC_FLAG_INIT) {}
+    SpinLock() : state_(kUnlocked) {}
     ~SpinLock() = default;
     /*!
      * \brief Acquire lock.
      */
     inline void lock() noexcept(true) {
-        while (lock_.test_and_set(std::memory_order_acquire)) {
-        }
+        if (try_lock())
+            return;
+        LockSlow();
+    }
+    /*!
+     * \brief Try to acquire lock without waiting.
+     */
+    inline bool try_lock() noexcept(true) {
+        int expected = kUnlocked;
+        return state_.load(std::memory_order_relaxed) == kUnlocked &&
+            state_.compare_exchange_strong(expected, kLocked,
+                    std::memory_order_acquire, std::memory_order_relaxed);
     }
     /*!
      * \brief Release lock.
      */
     inline void unlock() noexcept(true) {
-        lock_.clear(std::memory_order_release);
+        if (state_.exchange(kUnlocked, std::memory_order_release) == kSleeping)
+            Wake();
     }
 private:
-    std::atomic_flag lock_;
+    static const int kUnlocked = 0;
+    static const int kLocked = 1;
+    // locked, and somebody may sleep on it
+    static const int kSleeping = 2;
+
+    void LockSlow() noexcept(true) {
+        // test and test-and-set, only try the rmw once the lock looks free
+        int backoff = 1;
+        for (int spin = 0; spin < SPINLOCK_SPINS; spin++) {
+            for (int i = 0; i < backoff; i++)
+                CpuRelax();
+            if (backoff < SPINLOCK_MAX_BACKOFF)
+                backoff <<= 1;
+            if (try_lock())
+                return;
+        }
+        // from now on the holder has to wake us up
+        while (state_.exchange(kSleeping, std::memory_order_acquire) !=
+                kUnlocked) {
+#ifdef __linux__
+            FutexWait(&state_, kSleeping);
+#else
+            std::this_thread::yield();
+#endif
+        }
+    }
+
+    void Wake() noexcept(true) {
+#ifdef __linux__
+        FutexWake(&state_);
+#endif
+    }
+
+    // a lock of its own cache line, so that neighbours do not false share
+    alignas(64) std::atomic<int> state_;
+    char padding_[64 - sizeof(std::atomic<int>)];
     SpinLock(const SpinLock&) = delete;
 };
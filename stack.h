@@ -0,0 +1,225 @@
+#pragma once
+// Stack providers for the unix implementation of coroutine.h.
+//
+// By default every stack is an anonymous mmap region with a PROT_NONE guard
+// page below it: pages that are never touched cost no memory and running off
+// the end of the stack faults instead of corrupting the heap. Set your own
+// StackAllocator with coro::SetStackAllocator to plug in another provider.
+//
+// GrowableStackAllocator only reserves address space and commits STACK_INITIAL
+// bytes up front, further pages are committed from a SIGSEGV handler when the
+// stack runs into the reserved part.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// bytes committed up front by GrowableStackAllocator
+#ifndef STACK_INITIAL
+#define STACK_INITIAL (8*1024)
+#endif
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+namespace coro {
+
+struct Stack {
+    char *base;     // lowest usable address
+    size_t size;    // usable bytes from base upwards
+    // lowest committed address of a growable stack, nullptr otherwise
+    char *committed;
+
+    Stack() : base(nullptr), size(0), committed(nullptr) {}
+    Stack(char *b, size_t s) : base(b), size(s), committed(nullptr) {}
+};
+
+class StackAllocator {
+public:
+    virtual ~StackAllocator() {}
+    /*!
+     * \brief Provide a stack of at least size bytes, throw std::bad_alloc
+     * if it is not possible.
+     */
+    virtual Stack Allocate(size_t size) = 0;
+    /*!
+     * \brief Give back a stack obtained from Allocate.
+     */
+    virtual void Deallocate(const Stack &stack) = 0;
+};
+
+inline size_t PageSize() {
+    static const size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+    return page_size;
+}
+
+inline size_t RoundToPage(size_t size) {
+    const size_t page = PageSize();
+    return (size + page - 1) & ~(page - 1);
+}
+
+class MmapStackAllocator : public StackAllocator {
+public:
+    Stack Allocate(size_t size) override {
+        const size_t page = PageSize();
+        size = RoundToPage(size);
+        void *mem = mmap(nullptr, size + page, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::bad_alloc();
+        // stacks grow downwards, so the guard page is the lowest one
+        if (mprotect(mem, page, PROT_NONE) != 0) {
+            munmap(mem, size + page);
+            throw std::bad_alloc();
+        }
+        return Stack(static_cast<char *>(mem) + page, size);
+    }
+
+    void Deallocate(const Stack &stack) override {
+        const size_t page = PageSize();
+        munmap(stack.base - page, stack.size + page);
+    }
+};
+
+inline StackAllocator *DefaultStackAllocator() {
+    static MmapStackAllocator allocator;
+    return &allocator;
+}
+
+// stack of the routine running on this thread, read by the fault handler
+inline Stack *&ActiveStack() {
+    thread_local Stack *stack = nullptr;
+    return stack;
+}
+
+// commit pages of a growable stack down to addr, at least doubling what is
+// committed so far, only calls async-signal-safe functions
+inline bool GrowStack(Stack &stack, char *addr) {
+    if (stack.committed == nullptr || addr < stack.base ||
+            addr >= stack.committed)
+        return false;
+    const size_t page = PageSize();
+    char *top = stack.base + stack.size;
+    char *low = stack.committed - (top - stack.committed);
+    char *fault = reinterpret_cast<char *>(
+            reinterpret_cast<uintptr_t>(addr) & ~uintptr_t(page - 1));
+    if (low > fault)
+        low = fault;
+    if (low < stack.base)
+        low = stack.base;
+    if (mprotect(low, stack.committed - low, PROT_READ | PROT_WRITE) != 0)
+        return false;
+    stack.committed = low;
+    return true;
+}
+
+namespace detail {
+
+inline struct sigaction &PreviousFaultAction(int sig) {
+    static struct sigaction segv, bus;
+    return sig == SIGSEGV ? segv : bus;
+}
+
+inline void StackFaultHandler(int sig, siginfo_t *info, void *uc) {
+    Stack *stack = ActiveStack();
+    if (stack != nullptr && GrowStack(*stack,
+                static_cast<char *>(info->si_addr)))
+        return;
+    // not a growable stack, hand the fault over to whoever was there before
+    struct sigaction &previous = PreviousFaultAction(sig);
+    if (previous.sa_flags & SA_SIGINFO) {
+        previous.sa_sigaction(sig, info, uc);
+    }
+    else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+        previous.sa_handler(sig);
+    }
+    else {
+        // let the fault repeat with the default disposition
+        signal(sig, SIG_DFL);
+    }
+}
+
+// the handler runs on an alternate stack, the faulting one is full
+struct AltStack {
+    void *mem;
+    size_t size;
+
+    AltStack() : mem(nullptr), size(64 * 1024) {
+        mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            mem = nullptr;
+            return;
+        }
+        stack_t ss;
+        ss.ss_sp = mem;
+        ss.ss_size = size;
+        ss.ss_flags = 0;
+        sigaltstack(&ss, nullptr);
+    }
+
+    ~AltStack() {
+        if (mem == nullptr)
+            return;
+        stack_t ss;
+        ss.ss_sp = nullptr;
+        ss.ss_size = 0;
+        ss.ss_flags = SS_DISABLE;
+        sigaltstack(&ss, nullptr);
+        munmap(mem, size);
+    }
+};
+
+inline void InstallStackFaultHandler() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = StackFaultHandler;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &PreviousFaultAction(SIGSEGV));
+        sigaction(SIGBUS, &action, &PreviousFaultAction(SIGBUS));
+    });
+    thread_local AltStack alt_stack;
+    (void)alt_stack;
+}
+
+}  // namespace detail
+
+class GrowableStackAllocator : public MmapStackAllocator {
+public:
+    Stack Allocate(size_t size) override {
+        detail::InstallStackFaultHandler();
+        const size_t page = PageSize();
+        size = RoundToPage(size);
+        void *mem = mmap(nullptr, size + page, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::bad_alloc();
+        Stack stack(static_cast<char *>(mem) + page, size);
+        size_t initial = RoundToPage(STACK_INITIAL);
+        if (initial > size)
+            initial = size;
+        stack.committed = stack.base + size - initial;
+        if (mprotect(stack.committed, initial, PROT_READ | PROT_WRITE) != 0) {
+            munmap(mem, size + page);
+            throw std::bad_alloc();
+        }
+        return stack;
+    }
+};
+
+}  // namespace coro
@@ -0,0 +1,586 @@
+#pragma once
+// Mutex, ConditionVariable, Semaphore, RWMutex and WaitGroup for routines,
+// and plain threads, of any thread.
+//
+// A routine that has to wait queues a node and suspends, its processor
+// keeps running the others. Semaphore, RWMutex, ConditionVariable and
+// WaitGroup hand off: whoever releases claims the oldest nodes and hands
+// them what they waited for, a permit, the lock or a signal, before it
+// wakes them up through their wakeup inboxes, so a woken waiter never has
+// to compete for it again and nobody barges past a queue.
+//
+// Mutex barges like Go's: Unlock frees it and wakes the oldest waiter to
+// try again, and anybody locking meanwhile may take it first. A waiter
+// that lost that race queues at the front, and the next Unlock hands the
+// mutex straight to it.
+//
+// Nodes come from a per-thread cache and never live on a routine's stack,
+// routines on the shared stack can wait here as well.
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "spinlock.h"
+#include "coroutine.h"
+#include "channel.h"
+
+// tries of a contended Mutex::Lock before the routine queues, backing off
+// like SpinLock
+#ifndef MUTEX_SPINS
+#define MUTEX_SPINS 16
+#endif
+
+namespace coro {
+
+namespace detail {
+
+// a routine or thread waiting for one of the primitives below
+struct SyncNode {
+    SyncNode *prev;
+    SyncNode *next;
+    bool linked;
+    Waiter *waiter;
+    int source;
+    Waiter own;
+
+    SyncNode() : prev(nullptr), next(nullptr), linked(false),
+            waiter(&own), source(0) {}
+
+    // a node from the calling thread's cache, armed for the caller
+    static SyncNode *Acquire() {
+        std::vector<SyncNode *> &cache = Cache().nodes;
+        SyncNode *node;
+        if (cache.empty()) {
+            node = new SyncNode();
+        }
+        else {
+            node = cache.back();
+            cache.pop_back();
+        }
+        node->source = 0;
+        node->waiter->Prepare();
+        return node;
+    }
+
+    static void Release(SyncNode *node) {
+        std::vector<SyncNode *> &cache = Cache().nodes;
+        if (cache.size() < kCacheLimit)
+            cache.push_back(node);
+        else
+            delete node;
+    }
+
+private:
+    static const size_t kCacheLimit = 64;
+
+    struct NodeCache {
+        std::vector<SyncNode *> nodes;
+        ~NodeCache() {
+            for (SyncNode *node : nodes)
+                delete node;
+        }
+    };
+
+    CORO_TLS_ACCESSOR static NodeCache &Cache() {
+        CORO_TLS_FENCE();
+        thread_local NodeCache cache;
+        return cache;
+    }
+};
+
+typedef WaitQueue<SyncNode> SyncQueue;
+
+// Wait until the queued node is claimed, true, or until deadline, false,
+// taking it back off queue. The node goes back to the cache.
+inline bool WaitQueued(::SpinLock &lock, SyncQueue &queue, SyncNode *node,
+        Clock::time_point deadline) {
+    bool claimed = node->waiter->Wait(deadline);
+    if (!claimed) {
+        std::lock_guard<::SpinLock> lk(lock);
+        if (node->linked)
+            queue.Remove(node);
+    }
+    SyncNode::Release(node);
+    return claimed;
+}
+
+// queue node with lock held, then release it and WaitQueued
+inline bool Block(::SpinLock &lock, SyncQueue &queue, SyncNode *node,
+        Clock::time_point deadline) {
+    queue.PushBack(node);
+    lock.unlock();
+    return WaitQueued(lock, queue, node, deadline);
+}
+
+// claimed nodes linked through next, notified once the lock is released
+inline void NotifyAll(SyncNode *woken) {
+    while (woken != nullptr) {
+        SyncNode *next = woken->next;
+        woken->waiter->Notify();
+        woken = next;
+    }
+}
+
+}  // namespace detail
+
+/*!
+ * \brief Mutual exclusion that suspends the routine instead of blocking its
+ * thread, it may be held across Yield, sleeps and I/O. lock, unlock and
+ * try_lock make it fit std::lock_guard and std::unique_lock.
+ */
+class Mutex {
+public:
+    Mutex() : state_(0), owner_(nullptr) {}
+
+    inline void Lock() {
+        Lock(Clock::time_point::max());
+    }
+
+    inline bool TryLock() {
+        uint32_t state = state_.load(std::memory_order_relaxed);
+        while ((state & kLocked) == 0) {
+            if (state_.compare_exchange_weak(state, state | kLocked,
+                        std::memory_order_acquire,
+                        std::memory_order_relaxed)) {
+                owner_.store(ThreadTag(), std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Lock giving up after timeout, false then
+    inline bool TryLockFor(std::chrono::nanoseconds timeout) {
+        return Lock(Clock::now() + timeout);
+    }
+
+    /*!
+     * \brief Unlock and wake the oldest waiter to try again, or hand the
+     * mutex straight to it if it already lost once.
+     */
+    inline void Unlock() {
+        uint32_t state = kLocked;
+        if (state_.compare_exchange_strong(state, 0,
+                    std::memory_order_release, std::memory_order_relaxed))
+            return;
+        lock_.lock();
+        detail::SyncNode *node = waiters_.Claim();
+        const uint32_t waiting = waiters_.IsEmpty() ? 0 : kWaiting;
+        // only Unlock clears kLocked and kWaiting is set under lock_
+        if (node != nullptr && node->source == kHandoff)
+            state_.store(kLocked | waiting, std::memory_order_relaxed);
+        else
+            state_.store(waiting, std::memory_order_release);
+        lock_.unlock();
+        if (node != nullptr)
+            node->waiter->Notify();
+    }
+
+    inline void lock() {
+        Lock();
+    }
+
+    inline bool try_lock() {
+        return TryLock();
+    }
+
+    inline void unlock() {
+        Unlock();
+    }
+
+private:
+    static const uint32_t kLocked = 1;
+    // the queue is not empty, Unlock has to look at it
+    static const uint32_t kWaiting = 2;
+    // source of a node that lost after a wakeup, it gets the lock handed
+    static const int kHandoff = 1;
+
+    // Whoever comes along may take the mutex while it is free, even past a
+    // woken waiter, which keeps it busy instead of reserved for a routine
+    // still waiting to be resumed. A waiter that lost that race queues at
+    // the front and no longer has to race.
+    inline bool Lock(Clock::time_point deadline) {
+        if (TryLock())
+            return true;
+        // a holder running on another thread is likely done before we
+        // would be suspended and woken again, one on ours can not go on
+        // before we do
+        int backoff = 1;
+        for (int spin = 0; spin < MUTEX_SPINS &&
+                owner_.load(std::memory_order_relaxed) != ThreadTag();
+                spin++) {
+            for (int i = 0; i < backoff; i++)
+                CpuRelax();
+            if (backoff < SPINLOCK_MAX_BACKOFF)
+                backoff <<= 1;
+            if (TryLock())
+                return true;
+        }
+        bool woken = false;
+        while (true) {
+            lock_.lock();
+            uint32_t state = state_.load(std::memory_order_relaxed);
+            while (true) {
+                if ((state & kLocked) == 0) {
+                    if (state_.compare_exchange_weak(state, state | kLocked,
+                                std::memory_order_acquire,
+                                std::memory_order_relaxed)) {
+                        lock_.unlock();
+                        owner_.store(ThreadTag(), std::memory_order_relaxed);
+                        return true;
+                    }
+                }
+                else if ((state & kWaiting) != 0 ||
+                        state_.compare_exchange_weak(state,
+                            state | kWaiting, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            detail::SyncNode *node = detail::SyncNode::Acquire();
+            node->source = woken ? kHandoff : 0;
+            if (woken)
+                waiters_.PushFront(node);
+            else
+                waiters_.PushBack(node);
+            lock_.unlock();
+            bool handoff = node->source == kHandoff;
+            if (!detail::WaitQueued(lock_, waiters_, node, deadline))
+                return false;
+            if (handoff) {
+                owner_.store(ThreadTag(), std::memory_order_relaxed);
+                return true;
+            }
+            woken = true;
+        }
+    }
+
+    // tells threads apart, for owner_
+    CORO_TLS_ACCESSOR static inline const void *ThreadTag() {
+        CORO_TLS_FENCE();
+        thread_local char tag;
+        return &tag;
+    }
+
+    ::SpinLock lock_;
+    std::atomic<uint32_t> state_;
+    // thread of the last holder, whether spinning for it makes sense
+    std::atomic<const void *> owner_;
+    detail::SyncQueue waiters_;
+    Mutex(const Mutex&) = delete;
+};
+
+/*!
+ * \brief Condition variable for Mutex, or any lock with lock and unlock, as
+ * std::condition_variable_any. Waiters are woken oldest first.
+ */
+class ConditionVariable {
+public:
+    ConditionVariable() {}
+
+    // unlock, wait for a notification, then lock again
+    template<typename Lockable>
+    inline void Wait(Lockable &lock) {
+        WaitUntil(lock, Clock::time_point::max());
+    }
+
+    template<typename Lockable, typename Predicate>
+    inline void Wait(Lockable &lock, Predicate pred) {
+        while (!pred())
+            Wait(lock);
+    }
+
+    // Wait giving up after timeout, false if it timed out; the lock is
+    // held again either way
+    template<typename Lockable>
+    inline bool WaitFor(Lockable &lock, std::chrono::nanoseconds timeout) {
+        return WaitUntil(lock, Clock::now() + timeout);
+    }
+
+    // Wait until pred holds, false if it still does not after timeout
+    template<typename Lockable, typename Predicate>
+    inline bool WaitFor(Lockable &lock, std::chrono::nanoseconds timeout,
+            Predicate pred) {
+        Clock::time_point deadline = Clock::now() + timeout;
+        while (!pred()) {
+            if (!WaitUntil(lock, deadline))
+                return pred();
+        }
+        return true;
+    }
+
+    inline void NotifyOne() {
+        lock_.lock();
+        detail::SyncNode *node = waiters_.Claim();
+        lock_.unlock();
+        if (node != nullptr)
+            node->waiter->Notify();
+    }
+
+    inline void NotifyAll() {
+        detail::SyncNode *woken = nullptr;
+        lock_.lock();
+        while (detail::SyncNode *node = waiters_.Claim()) {
+            node->next = woken;
+            woken = node;
+        }
+        lock_.unlock();
+        detail::NotifyAll(woken);
+    }
+
+private:
+    // queued before the lock is let go, a notification right after it can
+    // not be missed
+    template<typename Lockable>
+    inline bool WaitUntil(Lockable &lock, Clock::time_point deadline) {
+        detail::SyncNode *node = detail::SyncNode::Acquire();
+        lock_.lock();
+        waiters_.PushBack(node);
+        lock_.unlock();
+        lock.unlock();
+        bool notified = detail::WaitQueued(lock_, waiters_, node, deadline);
+        lock.lock();
+        return notified;
+    }
+
+    ::SpinLock lock_;
+    detail::SyncQueue waiters_;
+    ConditionVariable(const ConditionVariable&) = delete;
+};
+
+/*!
+ * \brief Counting semaphore, Acquire takes a permit and waits while there
+ * is none, Release hands permits to waiters first.
+ */
+class Semaphore {
+public:
+    explicit Semaphore(uint64_t permits = 0) : permits_(permits) {}
+
+    inline void Acquire() {
+        Acquire(Clock::time_point::max());
+    }
+
+    inline bool TryAcquire() {
+        std::lock_guard<::SpinLock> lk(lock_);
+        if (permits_ == 0)
+            return false;
+        permits_--;
+        return true;
+    }
+
+    // Acquire giving up after timeout, false then
+    inline bool TryAcquireFor(std::chrono::nanoseconds timeout) {
+        return Acquire(Clock::now() + timeout);
+    }
+
+    inline void Release(uint64_t permits = 1) {
+        detail::SyncNode *woken = nullptr;
+        lock_.lock();
+        for (; permits > 0; permits--) {
+            detail::SyncNode *node = waiters_.Claim();
+            if (node == nullptr)
+                break;
+            node->next = woken;
+            woken = node;
+        }
+        permits_ += permits;
+        lock_.unlock();
+        detail::NotifyAll(woken);
+    }
+
+private:
+    inline bool Acquire(Clock::time_point deadline) {
+        lock_.lock();
+        if (permits_ > 0) {
+            permits_--;
+            lock_.unlock();
+            return true;
+        }
+        return detail::Block(lock_, waiters_, detail::SyncNode::Acquire(),
+                deadline);
+    }
+
+    ::SpinLock lock_;
+    uint64_t permits_;
+    detail::SyncQueue waiters_;
+    Semaphore(const Semaphore&) = delete;
+};
+
+/*!
+ * \brief Readers-writer lock. A queued writer keeps new readers out, and a
+ * writer leaving lets all queued readers in before the next writer, so
+ * neither side starves.
+ */
+class RWMutex {
+public:
+    RWMutex() : readers_(0), writer_(false) {}
+
+    inline void Lock() {
+        lock_.lock();
+        if (!writer_ && readers_ == 0) {
+            writer_ = true;
+            lock_.unlock();
+            return;
+        }
+        detail::Block(lock_, writers_, detail::SyncNode::Acquire(),
+                Clock::time_point::max());
+    }
+
+    inline bool TryLock() {
+        std::lock_guard<::SpinLock> lk(lock_);
+        if (writer_ || readers_ != 0)
+            return false;
+        writer_ = true;
+        return true;
+    }
+
+    inline void Unlock() {
+        lock_.lock();
+        writer_ = false;
+        detail::SyncNode *woken = Admit(true);
+        lock_.unlock();
+        detail::NotifyAll(woken);
+    }
+
+    inline void LockShared() {
+        lock_.lock();
+        if (!writer_ && writers_.IsEmpty()) {
+            readers_++;
+            lock_.unlock();
+            return;
+        }
+        detail::Block(lock_, readers_waiting_, detail::SyncNode::Acquire(),
+                Clock::time_point::max());
+    }
+
+    inline bool TryLockShared() {
+        std::lock_guard<::SpinLock> lk(lock_);
+        if (writer_ || !writers_.IsEmpty())
+            return false;
+        readers_++;
+        return true;
+    }
+
+    inline void UnlockShared() {
+        detail::SyncNode *woken = nullptr;
+        lock_.lock();
+        if (--readers_ == 0)
+            woken = Admit(false);
+        lock_.unlock();
+        detail::NotifyAll(woken);
+    }
+
+    inline void lock() {
+        Lock();
+    }
+
+    inline bool try_lock() {
+        return TryLock();
+    }
+
+    inline void unlock() {
+        Unlock();
+    }
+
+    inline void lock_shared() {
+        LockShared();
+    }
+
+    inline bool try_lock_shared() {
+        return TryLockShared();
+    }
+
+    inline void unlock_shared() {
+        UnlockShared();
+    }
+
+private:
+    // with the lock free, let in the next writer or all queued readers,
+    // the side that did not just have it first; returns the claimed nodes
+    // to notify
+    inline detail::SyncNode *Admit(bool readers_first) {
+        if (!readers_first) {
+            if (detail::SyncNode *node = writers_.Claim()) {
+                writer_ = true;
+                node->next = nullptr;
+                return node;
+            }
+        }
+        detail::SyncNode *woken = nullptr;
+        while (detail::SyncNode *node = readers_waiting_.Claim()) {
+            readers_++;
+            node->next = woken;
+            woken = node;
+        }
+        if (woken != nullptr || !readers_first)
+            return woken;
+        if (detail::SyncNode *node = writers_.Claim()) {
+            writer_ = true;
+            node->next = nullptr;
+            return node;
+        }
+        return nullptr;
+    }
+
+    ::SpinLock lock_;
+    uint64_t readers_;
+    bool writer_;
+    detail::SyncQueue writers_;
+    detail::SyncQueue readers_waiting_;
+    RWMutex(const RWMutex&) = delete;
+};
+
+/*!
+ * \brief Waits for a group of tasks: Add before starting them, Done from
+ * each when it finished, Wait until all have.
+ */
+class WaitGroup {
+public:
+    explicit WaitGroup(int64_t count = 0) : count_(count) {}
+
+    inline void Add(int64_t delta = 1) {
+        detail::SyncNode *woken = nullptr;
+        lock_.lock();
+        count_ += delta;
+        if (count_ <= 0) {
+            while (detail::SyncNode *node = waiters_.Claim()) {
+                node->next = woken;
+                woken = node;
+            }
+        }
+        lock_.unlock();
+        detail::NotifyAll(woken);
+    }
+
+    inline void Done() {
+        Add(-1);
+    }
+
+    inline void Wait() {
+        Wait(Clock::time_point::max());
+    }
+
+    // Wait giving up after timeout, false then
+    inline bool WaitFor(std::chrono::nanoseconds timeout) {
+        return Wait(Clock::now() + timeout);
+    }
+
+private:
+    inline bool Wait(Clock::time_point deadline) {
+        lock_.lock();
+        if (count_ <= 0) {
+            lock_.unlock();
+            return true;
+        }
+        return detail::Block(lock_, waiters_, detail::SyncNode::Acquire(),
+                deadline);
+    }
+
+    ::SpinLock lock_;
+    int64_t count_;
+    detail::SyncQueue waiters_;
+    WaitGroup(const WaitGroup&) = delete;
+};
+
+}  // namespace coro
@@ -0,0 +1,63 @@
+// Producers push runs of values into a small BoundedQueue with PushBulk,
+// consumers take them with TryPopBulk and TryPop. Every value has to come
+// out exactly once.
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "mpmc_queue.h"
+
+int main() {
+    const uint64_t kProducers = 4;
+    const uint64_t kConsumers = 3;
+    const uint64_t kPerProducer = 200000;
+    const uint64_t kTotal = kProducers * kPerProducer;
+    BoundedQueue<uint64_t> queue(64);
+    std::vector<std::atomic<uint8_t>> seen(kTotal);
+    for (auto& flag : seen)
+        flag.store(0);
+    std::atomic<uint64_t> received(0);
+    std::vector<std::thread> threads;
+    for (uint64_t p = 0; p < kProducers; p++) {
+        threads.emplace_back([&queue, p] {
+            std::vector<uint64_t> values;
+            for (uint64_t i = 0; i < kPerProducer; i++) {
+                values.push_back(p * kPerProducer + i);
+                // runs of 1 to 100 values, longer ones than the queue holds
+                if (values.size() == 1 + i % 100) {
+                    queue.PushBulk(values.begin(), values.end());
+                    values.clear();
+                }
+            }
+            queue.PushBulk(values.begin(), values.end());
+        });
+    }
+    for (uint64_t c = 0; c < kConsumers; c++) {
+        threads.emplace_back([&queue, &seen, &received, c] {
+            std::vector<uint64_t> popped(48);
+            while (received.load() < kTotal) {
+                size_t n = c == 0 ? queue.TryPopBulk(popped.begin(), 1 +
+                        received.load() % popped.size()) :
+                    queue.TryPop(popped[0]);
+                for (size_t i = 0; i < n; i++)
+                    seen[popped[i]].fetch_add(1);
+                if (n == 0)
+                    std::this_thread::yield();
+                received.fetch_add(n);
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    for (uint64_t i = 0; i < kTotal; i++) {
+        if (seen[i].load() != 1) {
+            std::printf("value %llu came out %d times\n",
+                    (unsigned long long)i, int(seen[i].load()));
+            return 1;
+        }
+    }
+    std::printf("%llu values came out once each\n",
+            (unsigned long long)kTotal);
+    return 0;
+}
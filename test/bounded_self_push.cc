@@ -0,0 +1,37 @@
+// A task of a single processor pool without work stealing queues more tasks
+// than its bounded queue holds, one by one and in bulk. Its processor is the
+// only consumer of that queue, so it must not wait for room there.
+#include <atomic>
+#include <cstdio>
+#include <future>
+#include <unistd.h>
+#include <vector>
+#include "processor_pool.h"
+
+int main() {
+    alarm(10);
+    const int kTasks = 10000;
+    std::atomic<int> done(0);
+    std::promise<void> all_done;
+    {
+        coro::PoolOptions options;
+        options.num_cores = 1;
+        options.work_stealing = false;
+        coro::BasicProcessorPool<BoundedQueue<coro::Task>> pool(options);
+        auto count = [&done, &all_done] {
+            if (done.fetch_add(1) + 1 == 2 * kTasks)
+                all_done.set_value();
+        };
+        pool.AddTask([&pool, count] {
+            for (int i = 0; i < kTasks; i++)
+                pool.AddTask(count);
+            std::vector<coro::Task> tasks;
+            for (int i = 0; i < kTasks; i++)
+                tasks.push_back(count);
+            pool.AddTasks(std::move(tasks));
+        });
+        all_done.get_future().wait();
+    }
+    std::printf("%d of %d tasks ran\n", done.load(), 2 * kTasks);
+    return done.load() == 2 * kTasks ? 0 : 1;
+}
@@ -0,0 +1,171 @@
+// Channels shared by tasks of several processors: every value pushed by
+// several producers is popped exactly once by several consumers, Push
+// blocks on a full bounded channel, timed Push and Pop give up, and Close
+// wakes blocked senders and receivers.
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "processor_pool.h"
+#include "channel.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static std::atomic<int> failures(0);
+
+static void Check(bool ok, const char *what) {
+    if (ok)
+        return;
+    if (failures.fetch_add(1) < 10)
+        std::printf("failed: %s\n", what);
+}
+
+// run count tasks calling body(i) and wait for all of them from outside
+static void RunTasks(coro::ProcessorPool &pool, int count,
+        const std::function<void(int)> &body) {
+    std::atomic<int> done(0);
+    for (int i = 0; i < count; i++) {
+        pool.AddTask([&body, &done, i] {
+            body(i);
+            done++;
+        });
+    }
+    while (done.load() < count)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+// producers push every way there is, the last one done closes the channel
+static void ExactlyOnce(coro::ProcessorPool &pool, size_t capacity) {
+    const int kProducers = 4;
+    const int kConsumers = 4;
+    const int kPerProducer = 5000;
+    coro::Channel<int> channel{coro::Capacity(capacity)};
+    std::vector<std::atomic<int>> seen(kProducers * kPerProducer);
+    for (auto& count : seen)
+        count.store(0);
+    std::atomic<int> producing(kProducers);
+    RunTasks(pool, kProducers + kConsumers, [&](int task) {
+        if (task >= kProducers) {
+            int value;
+            while (channel.Pop(value))
+                seen[value]++;
+            return;
+        }
+        for (int i = 0; i < kPerProducer; i++) {
+            int value = task * kPerProducer + i;
+            bool pushed;
+            if (i % 3 == 0)
+                pushed = channel.Push(value);
+            else if (i % 3 == 1)
+                pushed = channel.Push(std::move(value));
+            else
+                pushed = channel.Push(value, std::chrono::seconds(10));
+            Check(pushed, "Push into an open channel");
+        }
+        if (--producing == 0)
+            channel.Close();
+    });
+    for (auto& count : seen)
+        Check(count.load() == 1, "every value is popped exactly once");
+}
+
+static void Full(coro::ProcessorPool &pool) {
+    coro::Channel<int> channel{coro::Capacity(2)};
+    std::atomic<bool> pushed(false);
+    RunTasks(pool, 2, [&](int task) {
+        if (task == 0) {
+            Check(channel.Push(1) && channel.Push(2), "Push with room");
+            Check(!channel.TryPush(3), "TryPush into a full channel");
+            Check(channel.Push(3), "Push once there is room again");
+            pushed = true;
+            return;
+        }
+        coro::SleepFor(std::chrono::milliseconds(20));
+        Check(!pushed.load(), "Push blocks while the channel is full");
+        int value = 0;
+        Check(channel.Pop(value) && value == 1, "Pop the oldest value");
+        while (!pushed.load())
+            coro::SleepFor(std::chrono::milliseconds(1));
+        Check(channel.Pop(value) && value == 2 && channel.Pop(value) &&
+                value == 3, "the blocked value comes last");
+    });
+}
+
+static void Timeouts(coro::ProcessorPool &pool) {
+    const auto timeout = std::chrono::milliseconds(20);
+    coro::Channel<std::vector<int>> channel{coro::Capacity(1)};
+    RunTasks(pool, 1, [&](int) {
+        std::vector<int> value(1, 7);
+        auto start = Clock::now();
+        Check(!channel.Pop(value, timeout), "Pop from an empty channel");
+        Check(Clock::now() - start >= timeout, "Pop waits for its timeout");
+        Check(channel.Push(value, timeout), "timed Push of a copy");
+        start = Clock::now();
+        Check(!channel.Push(value, timeout), "Push into a full channel");
+        Check(Clock::now() - start >= timeout, "Push waits for its timeout");
+        Check(value.size() == 1 && value[0] == 7,
+                "a copy that timed out is left alone");
+        std::vector<int> popped;
+        Check(channel.Pop(popped, timeout) && popped == value,
+                "the copy pushed before is there");
+    });
+}
+
+static void CloseWakes(coro::ProcessorPool &pool) {
+    coro::Channel<int> unbuffered{coro::Capacity(0)};
+    coro::Channel<int> empty;
+    coro::Channel<int> buffered;
+    std::atomic<int> blocking(0);
+    RunTasks(pool, 4, [&](int task) {
+        int value = 0;
+        if (task == 0) {
+            blocking++;
+            Check(!unbuffered.Push(1), "Close fails a blocked Push");
+        }
+        else if (task == 1) {
+            blocking++;
+            Check(!empty.Pop(value), "Close fails a blocked Pop");
+        }
+        else if (task == 2) {
+            buffered.Push(5);
+            buffered.Close();
+            Check(buffered.Pop(value) && value == 5,
+                    "a closed channel is drained first");
+            Check(!buffered.Pop(value), "then Pop fails");
+            Check(!buffered.Push(6), "and Push fails right away");
+        }
+        else {
+            while (blocking.load() < 2)
+                coro::SleepFor(std::chrono::milliseconds(1));
+            // give them time to block
+            coro::SleepFor(std::chrono::milliseconds(20));
+            unbuffered.Close();
+            empty.Close();
+        }
+    });
+}
+
+int main() {
+    alarm(30);
+    {
+        // tasks blocked in a channel keep their workers, more are started
+        // for the tasks behind them
+        coro::PoolOptions options;
+        options.num_cores = 4;
+        options.spawn_per_task = true;
+        coro::ProcessorPool pool(options);
+        ExactlyOnce(pool, 0);
+        ExactlyOnce(pool, 16);
+        ExactlyOnce(pool, SIZE_MAX);
+        Full(pool);
+        Timeouts(pool);
+        CloseWakes(pool);
+    }
+    if (failures.load() != 0)
+        return 1;
+    std::printf("channels deliver once and wake on close\n");
+    return 0;
+}
@@ -0,0 +1,58 @@
+// A routine on a growable stack moves, at a MigrationPoint, to a thread that
+// never allocated one itself, and grows its stack there. The fault handler
+// needs an alternate stack on that thread, or the process dies.
+#ifndef CORO_MIGRATION
+#define CORO_MIGRATION
+#endif
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include "coroutine.h"
+
+// touches about depth KB of stack
+static __attribute__((noinline)) size_t Recurse(size_t depth) {
+    volatile char frame[1024];
+    frame[0] = char(depth);
+    if (depth == 0)
+        return frame[0];
+    return Recurse(depth - 1) + frame[0];
+}
+
+int main() {
+    std::atomic<coro::Ordinator *> target(nullptr);
+    std::atomic<bool> done(false);
+    std::thread plain([&] {
+        target = coro::Self().ordinator;
+        while (!done) {
+            coro::ApplyWakeups();
+            coro::routine_t id = coro::NextReady();
+            if (id != 0)
+                coro::Resume(id);
+            else
+                std::this_thread::yield();
+        }
+        coro::ApplyWakeups();
+    });
+    while (target.load() == nullptr)
+        std::this_thread::yield();
+
+    coro::GrowableStackAllocator growable;
+    coro::SetStackAllocator(&growable);
+    coro::Create([&] {
+        coro::MigrationPoint();
+        Recurse(1024);
+        done = true;
+    }, 4 * 1024 * 1024);
+    coro::Resume(coro::NextReady());
+    if (coro::MoveReady(target, 1) != 1) {
+        std::fprintf(stderr, "routine did not move\n");
+        return 1;
+    }
+    while (!done)
+        std::this_thread::yield();
+    plain.join();
+    while (!coro::CloseToMoves())
+        coro::ApplyWakeups();
+    std::printf("grew a moved growable stack\n");
+    return 0;
+}
@@ -0,0 +1,63 @@
+// An fd registered with the reactor of one thread is closed with coro::Close
+// on another, and its number comes back with a new socket. The first thread
+// has to watch the new socket, not trust its registration of the old one.
+#include <atomic>
+#include <cstdlib>
+#include <cstdio>
+#include <thread>
+#include "reactor.h"
+
+int main() {
+    // a stale registration also skips making the new fd non-blocking, the
+    // read then blocks for good
+    alarm(10);
+    int old_pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, old_pair) != 0)
+        return 1;
+    char byte = 'x';
+    if (::write(old_pair[1], &byte, 1) != 1)
+        return 1;
+    coro::Resume(coro::Create([&] {
+        coro::Read(old_pair[0], &byte, 1);
+    }));
+    std::thread([&] {
+        coro::Close(old_pair[0]);
+        ::close(old_pair[1]);
+    }).join();
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+        return 1;
+    if (pair[0] != old_pair[0]) {
+        std::fprintf(stderr, "fd number was not reused\n");
+        return 1;
+    }
+    std::atomic<bool> done(false);
+    coro::routine_t reader = coro::Create([&] {
+        char got = 0;
+        if (coro::Read(pair[0], &got, 1) == 1 && got == 'y')
+            done = true;
+    });
+    coro::Resume(reader);
+    std::thread writer([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        char data = 'y';
+        if (::write(pair[1], &data, 1) != 1)
+            std::abort();
+    });
+    coro::Reactor& reactor = coro::Reactor::Local();
+    for (int i = 0; i < 20 && !done; i++) {
+        reactor.Poll(std::chrono::milliseconds(100));
+        coro::ApplyWakeups();
+        coro::routine_t id;
+        while ((id = coro::NextReady()) != 0)
+            coro::Resume(id);
+    }
+    writer.join();
+    if (!done) {
+        std::fprintf(stderr, "reader never woke up\n");
+        return 1;
+    }
+    std::printf("reused fd number is watched again\n");
+    return 0;
+}
@@ -0,0 +1,174 @@
+// Select over channels: of several cases that can go on exactly one takes
+// effect, SelectFor gives up after its timeout and hands unsent values
+// back, TrySelect does not block, and Selects racing plain Push and Pop on
+// other processors never lose or duplicate a value.
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "processor_pool.h"
+#include "channel.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static std::atomic<int> failures(0);
+
+static void Check(bool ok, const char *what) {
+    if (ok)
+        return;
+    if (failures.fetch_add(1) < 10)
+        std::printf("failed: %s\n", what);
+}
+
+// run count tasks calling body(i) and wait for all of them from outside
+static void RunTasks(coro::ProcessorPool &pool, int count,
+        const std::function<void(int)> &body) {
+    std::atomic<int> done(0);
+    for (int i = 0; i < count; i++) {
+        pool.AddTask([&body, &done, i] {
+            body(i);
+            done++;
+        });
+    }
+    while (done.load() < count)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+static void OneOfSeveral() {
+    coro::Channel<int> a, b;
+    coro::Channel<int> room_a{coro::Capacity(1)}, room_b{coro::Capacity(1)};
+    int fired_first = 0;
+    for (int round = 0; round < 200; round++) {
+        a.Push(1);
+        b.Push(2);
+        int from_a = 0, from_b = 0;
+        int fired = coro::Select(coro::Recv(a, from_a),
+                coro::Recv(b, from_b));
+        Check(fired == 0 ? from_a == 1 && from_b == 0 && a.Size() == 0 &&
+                b.Size() == 1 : fired == 1 && from_b == 2 && from_a == 0 &&
+                a.Size() == 1 && b.Size() == 0,
+                "one of two ready Recv cases takes its value");
+        fired_first += fired == 0;
+        a.Clear();
+        b.Clear();
+
+        int x = 3, y = 4;
+        fired = coro::Select(coro::Send(room_a, x), coro::Send(room_b, y));
+        Check(fired >= 0 && room_a.Size() + room_b.Size() == 1 &&
+                room_a.Size() == size_t(fired == 0),
+                "one of two ready Send cases pushes");
+        room_a.Clear();
+        room_b.Clear();
+    }
+    Check(fired_first > 0 && fired_first < 200,
+            "ready cases are picked at random");
+}
+
+static void Timeouts(coro::ProcessorPool &pool) {
+    const auto timeout = std::chrono::milliseconds(20);
+    RunTasks(pool, 1, [&](int) {
+        coro::Channel<int> empty;
+        coro::Channel<std::vector<int>> full{coro::Capacity(1)};
+        full.Push(std::vector<int>(1, 1));
+        int value = 0;
+        std::vector<int> unsent(1, 2);
+        auto start = Clock::now();
+        int fired = coro::SelectFor(timeout, coro::Recv(empty, value),
+                coro::Send(full, unsent));
+        Check(fired == -1, "SelectFor returns -1 after its timeout");
+        Check(Clock::now() - start >= timeout,
+                "SelectFor waits for its timeout");
+        Check(unsent.size() == 1 && unsent[0] == 2 && full.Size() == 1,
+                "a Send case that timed out hands its value back");
+
+        start = Clock::now();
+        fired = coro::TrySelect(coro::Recv(empty, value),
+                coro::Send(full, unsent));
+        Check(fired == -1 && Clock::now() - start < timeout,
+                "TrySelect returns -1 right away");
+        empty.Push(5);
+        Check(coro::TrySelect(coro::Recv(empty, value),
+                    coro::Send(full, unsent)) == 0 && value == 5,
+                "TrySelect takes a case that is ready");
+    });
+}
+
+// Half of the producers Push, half Select a Send case; half of the
+// consumers Pop, half Select a Recv case, some with a timeout so that they
+// give up while values are on their way.
+static void Race(coro::ProcessorPool &pool, size_t capacity) {
+    const int kProducers = 4;
+    const int kConsumers = 4;
+    const int kPerProducer = 5000;
+    coro::Channel<int> channel{coro::Capacity(capacity)};
+    coro::Channel<int> never;
+    std::vector<std::atomic<int>> seen(kProducers * kPerProducer);
+    for (auto& count : seen)
+        count.store(0);
+    std::atomic<int> producing(kProducers);
+    RunTasks(pool, kProducers + kConsumers, [&](int task) {
+        if (task < kProducers) {
+            int other = 0;
+            for (int i = 0; i < kPerProducer; i++) {
+                int value = task * kPerProducer + i;
+                if (task % 2 == 0)
+                    Check(channel.Push(value), "Push into an open channel");
+                else
+                    Check(coro::Select(coro::Send(channel, value),
+                                coro::Recv(never, other)) == 0,
+                            "only the Send case fires");
+            }
+            if (--producing == 0)
+                channel.Close();
+            return;
+        }
+        int value = 0;
+        while (true) {
+            if (task % 2 == 0) {
+                if (!channel.Pop(value))
+                    break;
+                seen[value]++;
+                continue;
+            }
+            bool ok = false;
+            int other = 0;
+            int fired = task % 4 == 1 ?
+                coro::Select(coro::Recv(channel, value, ok),
+                        coro::Recv(never, other)) :
+                coro::SelectFor(std::chrono::microseconds(50),
+                        coro::Recv(channel, value, ok),
+                        coro::Recv(never, other));
+            if (fired == -1)
+                continue;
+            Check(fired == 0, "only the Recv case of the channel fires");
+            if (!ok)
+                break;
+            seen[value]++;
+        }
+    });
+    for (auto& count : seen)
+        Check(count.load() == 1, "every value arrives exactly once");
+}
+
+int main() {
+    alarm(30);
+    OneOfSeveral();
+    {
+        // tasks blocked in a channel keep their workers, more are started
+        // for the tasks behind them
+        coro::PoolOptions options;
+        options.num_cores = 4;
+        options.spawn_per_task = true;
+        coro::ProcessorPool pool(options);
+        Timeouts(pool);
+        Race(pool, 0);
+        Race(pool, 8);
+    }
+    if (failures.load() != 0)
+        return 1;
+    std::printf("selects take exactly one case\n");
+    return 0;
+}
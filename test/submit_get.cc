@@ -0,0 +1,29 @@
+// Every task of a pool with one worker per core submits a task and waits
+// for its result. The submitted task is queued on the processor of the
+// waiting one, which has to run it with another worker meanwhile.
+#include <atomic>
+#include <cstdio>
+#include <future>
+#include <unistd.h>
+#include "processor_pool.h"
+
+int main() {
+    alarm(10);
+    const int kTasks = 100;
+    std::atomic<int> done(0);
+    std::promise<void> all_done;
+    {
+        coro::ProcessorPool pool(4, 1);
+        for (int i = 0; i < kTasks; i++) {
+            pool.AddTask([&pool, &done, &all_done, i] {
+                if (pool.Submit([i] { return i; }).Get() != i)
+                    return;
+                if (done.fetch_add(1) + 1 == kTasks)
+                    all_done.set_value();
+            });
+        }
+        all_done.get_future().wait();
+    }
+    std::printf("%d of %d tasks got their results\n", done.load(), kTasks);
+    return done.load() == kTasks ? 0 : 1;
+}
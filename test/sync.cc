@@ -0,0 +1,229 @@
+// The primitives of sync.h between tasks of several processors: mutual
+// exclusion, the handoff of a Mutex to a waiter that lost a race, timed
+// waits running into their deadline, permit counts, readers against
+// writers and the release of a WaitGroup.
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <thread>
+#include <unistd.h>
+#include "processor_pool.h"
+#include "sync.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static std::atomic<int> failures(0);
+
+static void Check(bool ok, const char *what) {
+    if (ok)
+        return;
+    // a broken primitive fails in every iteration, the first few tell
+    if (failures.fetch_add(1) < 10)
+        std::printf("failed: %s\n", what);
+}
+
+// run count tasks calling body(i) and wait for all of them from outside
+static void RunTasks(coro::ProcessorPool &pool, int count,
+        const std::function<void(int)> &body) {
+    std::atomic<int> done(0);
+    for (int i = 0; i < count; i++) {
+        pool.AddTask([&body, &done, i] {
+            body(i);
+            done++;
+        });
+    }
+    while (done.load() < count)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+static void MutualExclusion(coro::ProcessorPool &pool) {
+    coro::Mutex mutex;
+    std::atomic<int> inside(0);
+    long counter = 0;
+    RunTasks(pool, 16, [&](int) {
+        for (int i = 0; i < 2000; i++) {
+            std::lock_guard<coro::Mutex> lk(mutex);
+            Check(inside.fetch_add(1) == 0, "one holder of a Mutex at a time");
+            counter++;
+            if (i % 64 == 0)
+                coro::Yield();
+            inside--;
+        }
+    });
+    Check(counter == 16 * 2000, "every increment under the Mutex counted");
+}
+
+// On one thread, so that the order is fixed: a waiter woken by Unlock finds
+// the mutex taken again, queues at the front, and the next Unlock hands it
+// the mutex before it even runs.
+static void Handoff() {
+    coro::Mutex mutex;
+    bool waiter_has_it = false;
+    mutex.Lock();
+    coro::routine_t waiter = coro::Create([&] {
+        mutex.Lock();
+        waiter_has_it = true;
+        mutex.Unlock();
+    });
+    coro::Resume(waiter);
+    Check(!waiter_has_it, "the waiter queues behind the holder");
+    mutex.Unlock();
+    Check(mutex.TryLock(), "a free Mutex may be taken past a woken waiter");
+    // the waiter loses, and queues to get it handed this time
+    coro::ApplyWakeups();
+    coro::Resume(waiter);
+    Check(!waiter_has_it, "the woken waiter lost the race");
+    mutex.Unlock();
+    Check(!mutex.TryLock(), "Unlock hands the Mutex to the waiter that lost");
+    coro::ApplyWakeups();
+    coro::Resume(waiter);
+    Check(waiter_has_it, "the waiter runs with the Mutex it was handed");
+    Check(mutex.TryLock(), "the waiter unlocked it again");
+    mutex.Unlock();
+    coro::Destroy(waiter);
+}
+
+static bool TookAbout(Clock::time_point start, std::chrono::milliseconds d) {
+    return Clock::now() - start >= d;
+}
+
+static void Deadlines(coro::ProcessorPool &pool) {
+    const auto timeout = std::chrono::milliseconds(20);
+    coro::Mutex mutex;
+    coro::ConditionVariable cond;
+    coro::Semaphore semaphore(0);
+    coro::WaitGroup group(1);
+    std::atomic<bool> held(false);
+    std::atomic<bool> release(false);
+    // one task keeps the mutex while another one times out on it
+    RunTasks(pool, 2, [&](int i) {
+        if (i == 0) {
+            mutex.Lock();
+            held = true;
+            while (!release.load())
+                coro::SleepFor(std::chrono::milliseconds(1));
+            mutex.Unlock();
+            return;
+        }
+        while (!held.load())
+            coro::SleepFor(std::chrono::milliseconds(1));
+        auto start = Clock::now();
+        Check(!mutex.TryLockFor(timeout), "TryLockFor of a held Mutex");
+        Check(TookAbout(start, timeout), "TryLockFor waits for its timeout");
+        release = true;
+    });
+    RunTasks(pool, 1, [&](int) {
+        std::unique_lock<coro::Mutex> lk(mutex);
+        auto start = Clock::now();
+        Check(!cond.WaitFor(lk, timeout), "WaitFor without a notification");
+        Check(TookAbout(start, timeout), "WaitFor waits for its timeout");
+        Check(lk.owns_lock() && !mutex.TryLock(),
+                "WaitFor holds the lock again after its timeout");
+        start = Clock::now();
+        Check(!semaphore.TryAcquireFor(timeout), "TryAcquireFor no permit");
+        Check(TookAbout(start, timeout), "TryAcquireFor waits for timeout");
+        start = Clock::now();
+        Check(!group.WaitFor(timeout), "WaitFor of a WaitGroup not done");
+        Check(TookAbout(start, timeout), "WaitGroup waits for its timeout");
+    });
+}
+
+static void Permits(coro::ProcessorPool &pool) {
+    coro::Semaphore semaphore(3);
+    std::atomic<int> inside(0);
+    std::atomic<int> most(0);
+    RunTasks(pool, 16, [&](int) {
+        for (int i = 0; i < 200; i++) {
+            semaphore.Acquire();
+            int now = inside.fetch_add(1) + 1;
+            int seen = most.load();
+            while (now > seen && !most.compare_exchange_weak(seen, now)) {
+            }
+            coro::Yield();
+            inside--;
+            semaphore.Release();
+        }
+    });
+    Check(most.load() <= 3, "at most 3 holders of 3 permits");
+    int taken = 0;
+    while (semaphore.TryAcquire())
+        taken++;
+    Check(taken == 3, "all 3 permits are back");
+    semaphore.Release(2);
+    Check(semaphore.TryAcquire() && semaphore.TryAcquire() &&
+            !semaphore.TryAcquire(), "Release(2) adds 2 permits");
+}
+
+static void ReadersWriters(coro::ProcessorPool &pool) {
+    coro::RWMutex rw;
+    std::atomic<int> readers(0);
+    std::atomic<int> writers(0);
+    std::atomic<int> most_readers(0);
+    RunTasks(pool, 16, [&](int task) {
+        for (int i = 0; i < 500; i++) {
+            if (task % 4 == 0) {
+                std::lock_guard<coro::RWMutex> lk(rw);
+                Check(writers.fetch_add(1) == 0, "one writer at a time");
+                Check(readers.load() == 0, "no reader next to a writer");
+                coro::Yield();
+                writers--;
+                continue;
+            }
+            rw.LockShared();
+            int now = readers.fetch_add(1) + 1;
+            int seen = most_readers.load();
+            while (now > seen && !most_readers.compare_exchange_weak(seen,
+                        now)) {
+            }
+            Check(writers.load() == 0, "no writer next to a reader");
+            coro::Yield();
+            readers--;
+            rw.UnlockShared();
+        }
+    });
+    Check(most_readers.load() > 1, "readers share the RWMutex");
+    Check(rw.TryLock(), "the RWMutex is free in the end");
+    rw.Unlock();
+}
+
+static void GroupRelease(coro::ProcessorPool &pool) {
+    const int kWorkers = 8;
+    coro::WaitGroup group(kWorkers);
+    std::atomic<int> finished(0);
+    RunTasks(pool, kWorkers + 2, [&](int i) {
+        if (i >= kWorkers) {
+            group.Wait();
+            Check(finished.load() == kWorkers,
+                    "WaitGroup waiters go on once all are done");
+            return;
+        }
+        coro::SleepFor(std::chrono::milliseconds(1 + i));
+        finished++;
+        group.Done();
+    });
+    Check(group.WaitFor(std::chrono::milliseconds(0)),
+            "a released WaitGroup does not block");
+}
+
+int main() {
+    alarm(30);
+    Handoff();
+    {
+        // every waiting task keeps its worker, more are started for the
+        // tasks behind it
+        coro::PoolOptions options;
+        options.num_cores = 4;
+        options.spawn_per_task = true;
+        coro::ProcessorPool pool(options);
+        MutualExclusion(pool);
+        Deadlines(pool);
+        Permits(pool);
+        ReadersWriters(pool);
+        GroupRelease(pool);
+    }
+    if (failures.load() != 0)
+        return 1;
+    std::printf("sync primitives behave\n");
+    return 0;
+}
@@ -0,0 +1,172 @@
+#pragma once
+// Hierarchical timing wheel after "Hashed and Hierarchical Timing Wheels"
+// (Varghese, Lauck, SOSP 1987), laid out like the classic linux one.
+//
+// Four levels of 256 slots each hold timers due within 2^8, 2^16, 2^24 and
+// 2^32 ticks. Timers are intrusive doubly linked nodes owned by the caller,
+// so Add and Remove are O(1) and never allocate. When the lowest level
+// wraps, the next slot of the level above is cascaded down. Not thread
+// safe, every thread keeps its own wheel.
+#include <cstddef>
+#include <cstdint>
+
+struct TimerNode {
+    TimerNode *prev;
+    TimerNode *next;
+    // tick the timer fires at
+    uint64_t expiry;
+    // free for the owner, e.g. whom to wake up
+    uintptr_t data;
+
+    TimerNode() : prev(nullptr), next(nullptr), expiry(0), data(0) {}
+
+    inline bool IsLinked() const {
+        return next != nullptr;
+    }
+};
+
+class TimerWheel {
+public:
+    explicit TimerWheel(uint64_t now = 0) : now_(now), size_(0) {
+        for (int level = 0; level < kLevels; level++) {
+            for (int slot = 0; slot < kSlots; slot++) {
+                TimerNode *head = &slots_[level][slot];
+                head->prev = head->next = head;
+            }
+        }
+    }
+
+    /*!
+     * \brief Fire node at tick expiry, or with the next Advance if that tick
+     * has passed already. node must not be linked.
+     */
+    inline void Add(TimerNode *node, uint64_t expiry) {
+        node->expiry = expiry;
+        Link(node);
+        size_++;
+    }
+
+    /*!
+     * \brief Cancel a linked timer.
+     */
+    inline void Remove(TimerNode *node) {
+        Unlink(node);
+        size_--;
+    }
+
+    /*!
+     * \brief Process every tick up to and including now, unlinking due
+     * timers and passing them to fire.
+     */
+    template<typename F>
+    inline size_t Advance(uint64_t now, F &&fire) {
+        size_t fired = 0;
+        if (size_ == 0) {
+            if (now >= now_)
+                now_ = now + 1;
+            return 0;
+        }
+        while (now_ <= now && size_ != 0) {
+            size_t index = size_t(now_ & kMask);
+            if (index == 0)
+                Cascade();
+            TimerNode *head = &slots_[0][index];
+            while (head->next != head) {
+                TimerNode *node = head->next;
+                Unlink(node);
+                size_--;
+                fired++;
+                fire(node);
+            }
+            now_++;
+        }
+        if (size_ == 0 && now >= now_)
+            now_ = now + 1;
+        return fired;
+    }
+
+    /*!
+     * \brief Ticks from the current one until Advance may fire something,
+     * exact for timers due in this round of the lowest level, otherwise the
+     * tick the next cascade happens at. UINT64_MAX if the wheel is empty.
+     */
+    inline uint64_t TicksUntilNext() const {
+        if (size_ == 0)
+            return UINT64_MAX;
+        for (uint64_t tick = now_; ; tick++) {
+            // anything may cascade down at a wrap
+            if ((tick & kMask) == 0)
+                return tick - now_;
+            const TimerNode *head = &slots_[0][size_t(tick & kMask)];
+            if (head->next != head)
+                return tick - now_;
+        }
+    }
+
+    // first tick Advance has not processed yet
+    inline uint64_t Now() const {
+        return now_;
+    }
+
+    inline size_t Size() const {
+        return size_;
+    }
+
+    inline bool IsEmpty() const {
+        return size_ == 0;
+    }
+
+private:
+    static const int kBits = 8;
+    static const int kSlots = 1 << kBits;
+    static const uint64_t kMask = kSlots - 1;
+    static const int kLevels = 4;
+
+    inline void Link(TimerNode *node) {
+        uint64_t expiry = node->expiry < now_ ? now_ : node->expiry;
+        uint64_t delta = expiry - now_;
+        int level = 0;
+        while (level < kLevels - 1 && delta >= (uint64_t(1) << (kBits *
+                        (level + 1))))
+            level++;
+        // beyond the top level, park it in the furthest slot, it is looked
+        // at again when that one cascades
+        if (delta >= (uint64_t(1) << (kBits * kLevels)))
+            expiry = now_ + (uint64_t(1) << (kBits * kLevels)) - 1;
+        TimerNode *head = &slots_[level][size_t((expiry >> (kBits * level)) &
+                kMask)];
+        node->prev = head->prev;
+        node->next = head;
+        head->prev->next = node;
+        head->prev = node;
+    }
+
+    inline void Unlink(TimerNode *node) {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = nullptr;
+    }
+
+    // move the timers of the current slot of each higher level one level
+    // down, as far up as the lower levels wrapped
+    inline void Cascade() {
+        for (int level = 1; level < kLevels; level++) {
+            size_t index = size_t((now_ >> (kBits * level)) & kMask);
+            TimerNode *head = &slots_[level][index];
+            TimerNode *node = head->next;
+            head->prev = head->next = head;
+            while (node != head) {
+                TimerNode *next = node->next;
+                Link(node);
+                node = next;
+            }
+            if (index != 0)
+                break;
+        }
+    }
+
+    TimerNode slots_[kLevels][kSlots];
+    uint64_t now_;
+    size_t size_;
+    TimerWheel(const TimerWheel&) = delete;
+};
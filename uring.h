@@ -0,0 +1,400 @@
+#pragma once
+// Completion based file and socket I/O for coroutines on io_uring, linux
+// only, talking to the kernel with raw syscalls.
+//
+// Every processor thread owns a ring. ReadAt, WriteAt and Fsync queue a
+// submission and suspend the routine; the processor submits everything
+// queued during a round with one io_uring_enter, harvests completions
+// between rounds and sleeps in its reactor, woken through an eventfd, while
+// nothing else is runnable. UringRecv and UringSend try the socket inline
+// first and only queue a submission once it would block. Where io_uring is
+// unavailable, too old, or the caller is not a routine on a processor, file
+// calls are offloaded with Await and socket calls go through the epoll
+// reactor.
+//
+// Buffers are written by the kernel while the routine is suspended, so they
+// must not live on the shared stack of SetSharedStack.
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "coroutine.h"
+#include "reactor.h"
+
+// submission queue entries of every ring
+#ifndef URING_ENTRIES
+#define URING_ENTRIES 256
+#endif
+
+namespace coro {
+
+class Uring {
+public:
+    Uring() : ring_fd_(-1), event_fd_(-1), tried_(false), driven_(false),
+            ring_mem_(nullptr), sqes_(nullptr), ring_size_(0),
+            sqes_size_(0), sq_entries_(0),
+            queued_(0), pending_(0), free_op_(0) {}
+    ~Uring() {
+        if (sqes_ != nullptr)
+            munmap(sqes_, sqes_size_);
+        if (ring_mem_ != nullptr)
+            munmap(ring_mem_, ring_size_);
+        if (ring_fd_ >= 0)
+            ::close(ring_fd_);
+        if (event_fd_ >= 0)
+            ::close(event_fd_);
+    }
+
+    CORO_TLS_ACCESSOR static Uring& Local() {
+        CORO_TLS_FENCE();
+        thread_local Uring ring;
+        return ring;
+    }
+
+    /*!
+     * \brief Processors mark their thread's ring as driven, only then do
+     * routines submit to it.
+     */
+    inline void SetDriven(bool driven) {
+        driven_ = driven;
+    }
+
+    // set up lazily, false if this thread can not use io_uring
+    inline bool Available() {
+        if (!tried_) {
+            tried_ = true;
+            Setup();
+        }
+        return ring_fd_ >= 0;
+    }
+
+    // usable by the routine running now
+    inline bool Usable() {
+        return driven_ && Current() != 0 && Available();
+    }
+
+    /*!
+     * \brief Queue a submission for the current routine, suspend until it
+     * completes and give its result, -errno on failure.
+     */
+    inline int Execute(uint8_t opcode, int fd, uint64_t addr, uint32_t len,
+            uint64_t offset, uint32_t op_flags) {
+        uint32_t index = AllocateOp();
+        struct io_uring_sqe *sqe = NextSqe();
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->off = offset;
+        sqe->addr = addr;
+        sqe->len = len;
+        sqe->rw_flags = op_flags;
+        sqe->user_data = index;
+        queued_++;
+        pending_++;
+        ops_[index].waiter = Self();
+        while (!ops_[index].done)
+            Suspend();
+        int result = ops_[index].result;
+        ReleaseOp(index);
+        return result;
+    }
+
+    /*!
+     * \brief Hand everything queued to the kernel, once per round.
+     */
+    inline void Submit() {
+        if (queued_ == 0)
+            return;
+        __atomic_store_n(sq_tail_, sq_tail_local_, __ATOMIC_RELEASE);
+        int n = int(syscall(__NR_io_uring_enter, ring_fd_, queued_, 0, 0,
+                    nullptr, 0));
+        // busy with completions, try again next round
+        if (n > 0)
+            queued_ -= unsigned(n);
+    }
+
+    /*!
+     * \brief Wake routines whose submissions completed, gives how many.
+     */
+    inline size_t Reap() {
+        if (pending_ == 0)
+            return 0;
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        size_t woken = 0;
+        for (; head != tail; head++) {
+            const struct io_uring_cqe& cqe = cqes_[head & cq_mask_];
+            Op& op = ops_[size_t(cqe.user_data)];
+            op.result = cqe.res;
+            op.done = true;
+            Wake(op.waiter);
+            pending_--;
+            woken++;
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        if (woken != 0) {
+            uint64_t count;
+            ssize_t r = ::read(event_fd_, &count, sizeof(count));
+            (void)r;
+        }
+        return woken;
+    }
+
+    // submissions are in flight, their completions wake the reactor
+    inline bool IsPending() const {
+        return pending_ != 0;
+    }
+
+private:
+    struct Op {
+        Handle waiter;
+        int result;
+        bool done;
+        uint32_t next_free;
+    };
+
+    inline void Setup() {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int fd = int(syscall(__NR_io_uring_setup, URING_ENTRIES, &params));
+        if (fd < 0)
+            return;
+        // IORING_OP_READ, SEND and friends came with fast poll
+        const uint32_t needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+            IORING_FEAT_FAST_POLL;
+        if ((params.features & needed) != needed) {
+            ::close(fd);
+            return;
+        }
+        // both rings share one mapping
+        size_t ring_size = params.sq_off.array +
+            params.sq_entries * sizeof(uint32_t);
+        size_t cq_size = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+        if (cq_size > ring_size)
+            ring_size = cq_size;
+        void *ring = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (ring == MAP_FAILED) {
+            ::close(fd);
+            return;
+        }
+        sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+        void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            munmap(ring, ring_size);
+            ::close(fd);
+            return;
+        }
+        int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd < 0 || syscall(__NR_io_uring_register, fd,
+                    IORING_REGISTER_EVENTFD, &event_fd, 1) != 0) {
+            if (event_fd >= 0)
+                ::close(event_fd);
+            munmap(sqes, sqes_size_);
+            munmap(ring, ring_size);
+            ::close(fd);
+            return;
+        }
+        char *base = static_cast<char *>(ring);
+        ring_mem_ = ring;
+        ring_size_ = ring_size;
+        sqes_ = static_cast<struct io_uring_sqe *>(sqes);
+        sq_head_ = reinterpret_cast<unsigned *>(base + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned *>(
+                base + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+        cq_head_ = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned *>(
+                base + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<struct io_uring_cqe *>(
+                base + params.cq_off.cqes);
+        sq_entries_ = params.sq_entries;
+        sq_tail_local_ = *sq_tail_;
+        ring_fd_ = fd;
+        event_fd_ = event_fd;
+        // completions make the eventfd readable, which ends a reactor sleep
+        Reactor::Local().Register(event_fd_);
+    }
+
+    inline struct io_uring_sqe *NextSqe() {
+        // the queue is full, submit now instead of at the end of the round
+        while (sq_tail_local_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >=
+                sq_entries_) {
+            Submit();
+            Reap();
+        }
+        unsigned index = sq_tail_local_ & sq_mask_;
+        sq_array_[index] = index;
+        sq_tail_local_++;
+        return &sqes_[index];
+    }
+
+    inline uint32_t AllocateOp() {
+        uint32_t index;
+        if (free_op_ != 0) {
+            index = free_op_ - 1;
+            free_op_ = ops_[index].next_free;
+        }
+        else {
+            index = uint32_t(ops_.size());
+            ops_.emplace_back();
+        }
+        ops_[index].done = false;
+        ops_[index].result = 0;
+        return index;
+    }
+
+    inline void ReleaseOp(uint32_t index) {
+        ops_[index].next_free = free_op_;
+        free_op_ = index + 1;
+    }
+
+    int ring_fd_;
+    int event_fd_;
+    bool tried_;
+    bool driven_;
+    void *ring_mem_;
+    struct io_uring_sqe *sqes_;
+    size_t ring_size_;
+    size_t sqes_size_;
+    unsigned sq_entries_;
+    unsigned *sq_head_;
+    unsigned *sq_tail_;
+    unsigned sq_mask_;
+    unsigned *sq_array_;
+    // tail including queued entries the kernel has not seen yet
+    unsigned sq_tail_local_;
+    unsigned *cq_head_;
+    unsigned *cq_tail_;
+    unsigned cq_mask_;
+    struct io_uring_cqe *cqes_;
+    // queued since the last Submit, and not completed yet
+    unsigned queued_;
+    size_t pending_;
+    // completion records indexed by user_data, chained through next_free
+    // counting from 1 once released
+    std::vector<Op> ops_;
+    uint32_t free_op_;
+    Uring(const Uring&) = delete;
+};
+
+inline ssize_t UringResult(int result) {
+    if (result < 0) {
+        errno = -result;
+        return -1;
+    }
+    return result;
+}
+
+// pread(2) for routines
+inline ssize_t ReadAt(int fd, void *buf, size_t count, off_t offset) {
+    Uring& ring = Uring::Local();
+    if (!ring.Usable())
+        return Await([fd, buf, count, offset] {
+            return ::pread(fd, buf, count, offset);
+        });
+    return UringResult(ring.Execute(IORING_OP_READ, fd,
+                reinterpret_cast<uint64_t>(buf), uint32_t(count),
+                uint64_t(offset), 0));
+}
+
+// pwrite(2) for routines
+inline ssize_t WriteAt(int fd, const void *buf, size_t count, off_t offset) {
+    Uring& ring = Uring::Local();
+    if (!ring.Usable())
+        return Await([fd, buf, count, offset] {
+            return ::pwrite(fd, buf, count, offset);
+        });
+    return UringResult(ring.Execute(IORING_OP_WRITE, fd,
+                reinterpret_cast<uint64_t>(buf), uint32_t(count),
+                uint64_t(offset), 0));
+}
+
+// Whether the kernel would fail a submission on fd with EAGAIN rather than
+// wait for it, as it does for sockets in non-blocking mode
+inline bool NonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && (flags & O_NONBLOCK) != 0;
+}
+
+// recv(2) for routines. Data already there is taken inline; otherwise a
+// blocking socket waits in io_uring, and sockets in non-blocking mode, like
+// the ones from Accept, wait in the reactor.
+inline ssize_t UringRecv(int fd, void *buf, size_t count, int flags = 0) {
+    ssize_t n;
+    do
+        n = ::recv(fd, buf, count, flags | MSG_DONTWAIT);
+    while (n < 0 && errno == EINTR);
+    if (!WouldBlock(n))
+        return n;
+    Uring& ring = Uring::Local();
+    if (ring.Usable() && !NonBlocking(fd)) {
+        int result = ring.Execute(IORING_OP_RECV, fd,
+                reinterpret_cast<uint64_t>(buf), uint32_t(count), 0,
+                uint32_t(flags));
+        if (result != -EAGAIN)
+            return UringResult(result);
+    }
+    Reactor& reactor = Reactor::Local();
+    reactor.Register(fd);
+    while (true) {
+        reactor.Wait(fd, false);
+        n = ::recv(fd, buf, count, flags);
+        if (!WouldBlock(n) && (n >= 0 || errno != EINTR))
+            return n;
+    }
+}
+
+// send(2) for routines, never raises SIGPIPE. Like UringRecv, it only leaves
+// the routine when the socket buffer is full.
+inline ssize_t UringSend(int fd, const void *buf, size_t count,
+        int flags = 0) {
+    flags |= MSG_NOSIGNAL;
+    ssize_t n;
+    do
+        n = ::send(fd, buf, count, flags | MSG_DONTWAIT);
+    while (n < 0 && errno == EINTR);
+    if (!WouldBlock(n))
+        return n;
+    Uring& ring = Uring::Local();
+    if (ring.Usable() && !NonBlocking(fd)) {
+        int result = ring.Execute(IORING_OP_SEND, fd,
+                reinterpret_cast<uint64_t>(buf), uint32_t(count), 0,
+                uint32_t(flags));
+        if (result != -EAGAIN)
+            return UringResult(result);
+    }
+    Reactor& reactor = Reactor::Local();
+    reactor.Register(fd);
+    while (true) {
+        reactor.Wait(fd, true);
+        n = ::send(fd, buf, count, flags);
+        if (!WouldBlock(n) && (n >= 0 || errno != EINTR))
+            return n;
+    }
+}
+
+// fsync(2) for routines, fdatasync(2) if datasync is set
+inline int Fsync(int fd, bool datasync = false) {
+    Uring& ring = Uring::Local();
+    if (!ring.Usable())
+        return Await([fd, datasync] {
+            return datasync ? ::fdatasync(fd) : ::fsync(fd);
+        });
+    return int(UringResult(ring.Execute(IORING_OP_FSYNC, fd, 0, 0, 0,
+                    datasync ? IORING_FSYNC_DATASYNC : 0)));
+}
+
+}  // namespace coro
@@ -0,0 +1,126 @@
+#pragma once
+// Chase-Lev work stealing deque, after "Correct and Efficient Work-Stealing
+// for Weak Memory Models" (Le, Pop, Cohen, Zappa Nardelli, PPoPP 2013).
+//
+// The owning thread pushes and pops at the bottom, any other thread may
+// steal from the top. T has to be trivially copyable, tasks are stored by
+// pointer. Arrays outgrown by the owner are kept until the deque dies, a
+// thief may still be reading from them.
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+template<typename T> class WorkStealingDeque {
+public:
+    explicit WorkStealingDeque(size_t capacity = 256):
+            top_(0), bottom_(0) {
+        size_t cap = 1;
+        while (cap < capacity)
+            cap <<= 1;
+        arrays_.emplace_back(new Array(cap));
+        array_.store(arrays_.back().get(), std::memory_order_relaxed);
+    }
+    ~WorkStealingDeque() {}
+
+    /*!
+     * \brief Push at the bottom, owner only.
+     */
+    void Push(T value) {
+        int64_t b = bottom_.load(std::memory_order_relaxed);
+        int64_t t = top_.load(std::memory_order_acquire);
+        Array *a = array_.load(std::memory_order_relaxed);
+        if (b - t > int64_t(a->capacity) - 1)
+            a = Grow(a, t, b);
+        a->Put(b, value);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+
+    /*!
+     * \brief Pop the most recently pushed value, owner only.
+     */
+    bool Pop(T& value) {
+        int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+        Array *a = array_.load(std::memory_order_relaxed);
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top_.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        value = a->Get(b);
+        if (t == b) {
+            // last element, race against thieves for it
+            bool won = top_.compare_exchange_strong(t, t + 1,
+                    std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    /*!
+     * \brief Take the oldest value, any thread. Fails when the deque is
+     * empty or another thread won the race for the same value.
+     */
+    bool Steal(T& value) {
+        int64_t t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom_.load(std::memory_order_acquire);
+        if (t >= b)
+            return false;
+        Array *a = array_.load(std::memory_order_acquire);
+        T stolen = a->Get(t);
+        if (!top_.compare_exchange_strong(t, t + 1,
+                    std::memory_order_seq_cst, std::memory_order_relaxed))
+            return false;
+        value = stolen;
+        return true;
+    }
+
+    size_t Size() const {
+        int64_t b = bottom_.load(std::memory_order_relaxed);
+        int64_t t = top_.load(std::memory_order_relaxed);
+        return b > t ? size_t(b - t) : 0;
+    }
+
+    bool IsEmpty() const {
+        return Size() == 0;
+    }
+
+private:
+    struct Array {
+        size_t capacity;
+        std::unique_ptr<std::atomic<T>[]> slots;
+
+        explicit Array(size_t cap): capacity(cap),
+                slots(new std::atomic<T>[cap]) {}
+        T Get(int64_t i) const {
+            return slots[size_t(i) & (capacity - 1)].load(
+                    std::memory_order_relaxed);
+        }
+        void Put(int64_t i, T value) {
+            slots[size_t(i) & (capacity - 1)].store(value,
+                    std::memory_order_relaxed);
+        }
+    };
+
+    Array *Grow(Array *a, int64_t t, int64_t b) {
+        arrays_.emplace_back(new Array(a->capacity * 2));
+        Array *bigger = arrays_.back().get();
+        for (int64_t i = t; i < b; i++)
+            bigger->Put(i, a->Get(i));
+        array_.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+    alignas(64) std::atomic<int64_t> top_;
+    alignas(64) std::atomic<int64_t> bottom_;
+    std::atomic<Array *> array_;
+    // every array ever used, only touched by the owner
+    std::vector<std::unique_ptr<Array>> arrays_;
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+};